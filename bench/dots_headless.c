@@ -0,0 +1,241 @@
+#include "ecs/ecs.h"
+#include <time.h>
+
+// The dot demo (src/main.c) without a window. Dots are drawn into a CPU
+// framebuffer and moved for a fixed number of frames, then one JSON document
+// with the draw, move and frame costs is printed to stdout.
+// Usage: dots_headless [entities] [frames] [out.ppm]
+typedef struct {
+  float x, y;
+} Position, Move;
+
+// Same layout as raylib's Color, one pixel of the framebuffer
+typedef struct {
+  u8 r, g, b, a;
+} Color;
+
+USING_COMPONENT(Position);
+USING_COMPONENT(Move);
+USING_COMPONENT(Color);
+
+#define SCREEN_WIDTH 960
+#define SCREEN_HEIGHT 540
+#define FRAME_TIME (1.0f / 60)
+
+static u32 framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Deterministic between runs so builds are compared on the same frames
+static u64 random_state = 0x9E3779B97F4A7C15;
+
+static i32 randomValue(i32 min, i32 max) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return min + (i32)((random_state >> 32) % (u32)(max - min + 1));
+}
+
+static void newDot(Scene *scene, float x, float y) {
+  EntityID entity = sceneNewEntity(scene);
+  sceneAddComponent(scene, entity, Position);
+  sceneSetComponent(scene, entity, Position, {
+      .x = x, .y = y});
+
+  sceneAddComponent(scene, entity, Color);
+  sceneSetComponent(scene, entity, Color, {
+      randomValue(0, 255), randomValue(0, 255), randomValue(0, 255), 255});
+
+  sceneAddComponent(scene, entity, Move);
+  sceneSetComponent(scene, entity, Move, {
+      .x = randomValue(-100, 100), .y = randomValue(-100, 100)});
+}
+
+// Plots count dots, positions truncated to pixels like DrawPixel. Dots off
+// screen are skipped, later dots overwrite earlier ones. With SSE2 four dots
+// get their bounds and pixel index at once, the stores stay scalar since
+// there's no scatter before AVX-512.
+static void rasterScatter(const Position *pos, const Color *col, u32 count) {
+  const u32 *colors = (const u32*)col;
+  u32 i = 0;
+
+#if defined(__AVX512F__)
+  const __m512 width = _mm512_set1_ps(SCREEN_WIDTH);
+  const __m512 height = _mm512_set1_ps(SCREEN_HEIGHT);
+  const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+  const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+  for (; i + 16 <= count; i += 16) {
+    __m512 a = _mm512_loadu_ps(&pos[i].x);
+    __m512 b = _mm512_loadu_ps(&pos[i + 8].x);
+    __m512 x = _mm512_permutex2var_ps(a, even, b);
+    __m512 y = _mm512_permutex2var_ps(a, odd, b);
+
+    __mmask16 inside =
+      _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GE_OQ) &
+      _mm512_cmp_ps_mask(x, width, _CMP_LT_OQ) &
+      _mm512_cmp_ps_mask(y, _mm512_setzero_ps(), _CMP_GE_OQ) &
+      _mm512_cmp_ps_mask(y, height, _CMP_LT_OQ);
+    __m512i index = _mm512_add_epi32(
+        _mm512_mullo_epi32(_mm512_cvttps_epi32(y), _mm512_set1_epi32(SCREEN_WIDTH)),
+        _mm512_cvttps_epi32(x));
+
+    // Conflicting lanes store in lane order, so the last dot wins
+    _mm512_mask_i32scatter_epi32(
+        framebuffer, inside, index, _mm512_loadu_si512(&colors[i]), 4);
+  }
+#elif defined(__SSE2__)
+  const __m128 width = _mm_set1_ps(SCREEN_WIDTH);
+  const __m128 height = _mm_set1_ps(SCREEN_HEIGHT);
+  for (; i + 4 <= count; i += 4) {
+    __m128 a = _mm_loadu_ps(&pos[i].x);
+    __m128 b = _mm_loadu_ps(&pos[i + 2].x);
+    __m128 x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+    __m128 inside = _mm_and_ps(
+        _mm_and_ps(_mm_cmpge_ps(x, _mm_setzero_ps()), _mm_cmplt_ps(x, width)),
+        _mm_and_ps(_mm_cmpge_ps(y, _mm_setzero_ps()), _mm_cmplt_ps(y, height)));
+    u32 lanes = _mm_movemask_ps(inside);
+    if (!lanes) {
+      continue;
+    }
+
+    // Whole pixel rows and columns, the index stays exact in floats
+    __m128 row = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+    __m128 column = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    u32 index[4];
+    _mm_storeu_si128(
+        (__m128i*)index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(row, width), column)));
+
+    while (lanes) {
+      u32 lane = __builtin_ctz(lanes);
+      framebuffer[index[lane]] = colors[i + lane];
+      lanes &= lanes - 1;
+    }
+  }
+#endif
+
+  for (; i < count; i++) {
+    if (pos[i].x >= 0 && pos[i].x < SCREEN_WIDTH && pos[i].y >= 0 && pos[i].y < SCREEN_HEIGHT) {
+      framebuffer[(u32)pos[i].y * SCREEN_WIDTH + (u32)pos[i].x] = colors[i];
+    }
+  }
+}
+
+static void drawSystemStep(Scene *scene) {
+  rasterScatter(
+      sceneReadComponentArray(scene, Position), sceneReadComponentArray(scene, Color),
+      sceneGetEntityArraySize(scene));
+}
+
+static void moveSystemStep(Scene *scene) {
+  Position *pos = sceneGetComponentArray(scene, Position);
+  const Move *move = sceneReadComponentArray(scene, Move);
+
+  for (u32 i = 0; i < sceneGetEntityArraySize(scene); i++) {
+    pos[i].x += move[i].x * FRAME_TIME;
+    pos[i].y += move[i].y * FRAME_TIME;
+  }
+}
+
+// Binary PPM of the last frame, to check the output by eye
+static bool writeFrame(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+  for (u32 i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+    const u8 *pixel = (const u8*)&framebuffer[i];
+    fwrite(pixel, 3, 1, file);
+  }
+  return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+  u32 entity_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  u32 frame_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 600;
+  if (!frame_count) {
+    frame_count = 1;
+  }
+
+  ecsInit(64 kB);
+  registerComponentSize(Position);
+  registerComponentSize(Move);
+  registerComponentSize(Color);
+
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+
+  ECSQuery draw_query, move_query;
+  queryInit(&draw_query);
+  queryRequire(&draw_query, Position);
+  queryRequire(&draw_query, Color);
+  queryInit(&move_query);
+  queryRequire(&move_query, Position);
+  queryRequire(&move_query, Move);
+
+  ECSSystem draw_system = {
+    .name = "draw",
+    .query = &draw_query,
+    .begin = NULL,
+    .step = drawSystemStep
+  };
+  ECSSystem move_system = {
+    .name = "move",
+    .query = &move_query,
+    .begin = NULL,
+    .step = moveSystemStep
+  };
+
+  for (u32 i = 0; i < entity_count; i++) {
+    newDot(&scene, randomValue(0, SCREEN_WIDTH), randomValue(0, SCREEN_HEIGHT));
+  }
+
+  double draw_seconds = 0, move_seconds = 0, clear_seconds = 0;
+  for (u32 frame = 0; frame < frame_count; frame++) {
+    double start = now();
+    memset(framebuffer, 0, sizeof(framebuffer));
+    double cleared = now();
+    sceneRunSystem(&scene, &draw_system);
+    double drawn = now();
+    sceneRunSystem(&scene, &move_system);
+    double end = now();
+
+    clear_seconds += cleared - start;
+    draw_seconds += drawn - cleared;
+    move_seconds += end - drawn;
+  }
+
+  // Keeps the frame from being optimized out, and tells builds apart
+  u64 frame_hash = 0;
+  for (u32 i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+    frame_hash = (frame_hash ^ framebuffer[i]) * 0x100000001B3;
+  }
+
+  double frame_seconds = clear_seconds + draw_seconds + move_seconds;
+  double dot_frames = (double)entity_count * frame_count;
+  printf(
+      "{\n  \"compiler\": \"%s\",\n  \"entities\": %u,\n  \"frames\": %u,\n"
+      "  \"draw_ns_per_entity\": %.3f,\n  \"move_ns_per_entity\": %.3f,\n"
+      "  \"clear_ms_per_frame\": %.4f,\n  \"frame_ms\": %.4f,\n"
+      "  \"entities_per_second\": %.0f,\n  \"frame_hash\": \"%016llx\"\n}\n",
+      __VERSION__, entity_count, frame_count,
+      entity_count ? draw_seconds * 1e9 / dot_frames : 0.0,
+      entity_count ? move_seconds * 1e9 / dot_frames : 0.0,
+      clear_seconds * 1e3 / frame_count, frame_seconds * 1e3 / frame_count,
+      dot_frames / frame_seconds, (unsigned long long)frame_hash);
+
+  bool ok = argc <= 3 || writeFrame(argv[3]);
+  if (!ok) {
+    fprintf(stderr, "can't write %s\n", argv[3]);
+  }
+
+  sceneDestroy(&scene);
+  ecsDeinit();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,308 @@
+#include "ecs/ecs.h"
+#include <time.h>
+
+// Headless ECS benchmarks, prints one JSON document to stdout.
+// Usage: ecs_bench [max_entities] [repetitions]
+typedef struct {
+  float x, y;
+} Position, Velocity;
+
+typedef struct {
+  u8 value;
+} Tag;
+
+typedef Tag Tag0, Tag1, Tag2, Tag3, Tag4, Tag5, Tag6;
+
+USING_COMPONENT(Position);
+USING_COMPONENT(Velocity);
+USING_COMPONENT(Tag0);
+USING_COMPONENT(Tag1);
+USING_COMPONENT(Tag2);
+USING_COMPONENT(Tag3);
+USING_COMPONENT(Tag4);
+USING_COMPONENT(Tag5);
+USING_COMPONENT(Tag6);
+
+#define TAG_COUNT 7
+
+static ComponentID tag_ids[TAG_COUNT];
+static u32 repetitions = 5;
+static bool first_result = true;
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Deterministic between runs so builds are compared on the same work
+static u64 random_state;
+
+static u32 randomNext() {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state >> 32;
+}
+
+static void printResult(const char *name, u32 entities, u64 ops, double seconds) {
+  printf(
+      "%s\n    {\"name\": \"%s\", \"entities\": %u, \"ops\": %llu, "
+      "\"total_ms\": %.4f, \"ns_per_op\": %.3f}",
+      first_result ? "" : ",", name, entities, (unsigned long long)ops,
+      seconds * 1e3, seconds * 1e9 / ops);
+  first_result = false;
+}
+
+// Gives entity the tags of a combination, so combinations map to archetypes
+static void addTags(Scene *scene, EntityID entity, u32 combination) {
+  for (u32 i = 0; i < TAG_COUNT; i++) {
+    if (combination & (1 << i)) {
+      _addComponent(scene, entity, tag_ids[i]);
+    }
+  }
+}
+
+static void spawnMovers(Scene *scene, u32 count, u32 archetype_count) {
+  for (u32 i = 0; i < count; i++) {
+    EntityID entity = sceneNewEntity(scene);
+    sceneAddComponent(scene, entity, Position);
+    sceneSetComponent(scene, entity, Position, {i, i});
+    sceneAddComponent(scene, entity, Velocity);
+    sceneSetComponent(scene, entity, Velocity, {1, 0.5f});
+    addTags(scene, entity, i % archetype_count);
+  }
+}
+
+// Benchmarks, each returns the seconds its timed part took
+static double benchCreate(u32 count) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+
+  double start = now();
+  for (u32 i = 0; i < count; i++) {
+    sceneNewEntity(&scene);
+  }
+  double seconds = now() - start;
+
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+static double benchAddChain(u32 count) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+  for (u32 i = 0; i < count; i++) {
+    sceneNewEntity(&scene);
+  }
+
+  double start = now();
+  for (EntityID entity = 0; entity < count; entity++) {
+    sceneAddComponent(&scene, entity, Position);
+    sceneAddComponent(&scene, entity, Velocity);
+    sceneAddComponent(&scene, entity, Tag0);
+    sceneAddComponent(&scene, entity, Tag1);
+  }
+  double seconds = now() - start;
+
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+// Kills half the entities in random order and spawns as many again
+static double benchKillChurn(u32 count) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+  spawnMovers(&scene, count, 1);
+
+  EntityID *order = malloc(sizeof(EntityID) * count);
+  for (u32 i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  for (u32 i = count - 1; i > 0; i--) {
+    u32 j = randomNext() % (i + 1);
+    EntityID swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+
+  double start = now();
+  for (u32 i = 0; i < count / 2; i++) {
+    sceneKillEntity(&scene, order[i]);
+  }
+  spawnMovers(&scene, count / 2, 1);
+  double seconds = now() - start;
+
+  free(order);
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+static double benchGetRandom(u32 count) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+  spawnMovers(&scene, count, 1);
+
+  EntityID *lookups = malloc(sizeof(EntityID) * count);
+  for (u32 i = 0; i < count; i++) {
+    lookups[i] = randomNext() % count;
+  }
+
+  float sum = 0;
+  double start = now();
+  for (u32 i = 0; i < count; i++) {
+    sum += sceneGetComponent(&scene, lookups[i], Position)->x;
+  }
+  double seconds = now() - start;
+
+  // Keeps the loop from being optimized out
+  if (sum < 0) {
+    fprintf(stderr, "%f\n", sum);
+  }
+  free(lookups);
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+static void moveStep(Scene *scene) {
+  Position *pos = sceneGetComponentArray(scene, Position);
+  const Velocity *vel = sceneReadComponentArray(scene, Velocity);
+  for (u32 i = 0; i < sceneGetEntityArraySize(scene); i++) {
+    pos[i].x += vel[i].x;
+    pos[i].y += vel[i].y;
+  }
+}
+
+// Small worlds run several times so the timings aren't just clock noise
+static u32 benchIterations(u32 count) {
+  return count < 1000000 ? 1000000 / count : 1;
+}
+
+static double benchRunSystem(u32 count, u32 archetype_count) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+  spawnMovers(&scene, count, archetype_count);
+
+  ECSQuery query;
+  queryInit(&query);
+  queryRequire(&query, Position);
+  queryRequire(&query, Velocity);
+  ECSSystem system = {
+    .query = &query,
+      .begin = NULL,
+      .step = moveStep
+  };
+
+  u32 iterations = benchIterations(count);
+  double start = now();
+  for (u32 i = 0; i < iterations; i++) {
+    sceneRunSystem(&scene, &system);
+  }
+  double seconds = (now() - start) / iterations;
+
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+// Walks the archetypes matching a query among 100, without running anything
+static double benchQueryMatch(u32 count, u64 *matched) {
+  Scene scene;
+  sceneInit(&scene, 1 MB);
+  spawnMovers(&scene, count, 100);
+
+  ECSQuery query;
+  queryInit(&query);
+  queryRequire(&query, Position);
+  queryRequire(&query, Tag2);
+
+  u32 iterations = 1000;
+  *matched = 0;
+  double start = now();
+  for (u32 i = 0; i < iterations; i++) {
+    ECSQueryIter iter;
+    queryIterInit(&iter, &scene, &query);
+    while (queryIterNext(&iter)) {
+      (*matched)++;
+    }
+  }
+  double seconds = (now() - start) / iterations;
+  *matched /= iterations;
+
+  sceneDestroy(&scene);
+  return seconds;
+}
+
+// Best of the repetitions
+#define BENCH_BEST(seconds, call) do { \
+    seconds = 0; \
+    for (u32 rep = 0; rep < repetitions; rep++) { \
+      random_state = 0x9E3779B97F4A7C15ull; \
+      double run = call; \
+      if (!rep || run < seconds) seconds = run; \
+    } \
+  } while (0)
+
+int main(int argc, char **argv) {
+  u32 max_entities = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  if (argc > 2) {
+    repetitions = strtoul(argv[2], NULL, 10);
+  }
+  if (!repetitions) {
+    repetitions = 1;
+  }
+
+  ecsInit(64 kB);
+  registerComponentSize(Position);
+  registerComponentSize(Velocity);
+  registerComponentSize(Tag0);
+  registerComponentSize(Tag1);
+  registerComponentSize(Tag2);
+  registerComponentSize(Tag3);
+  registerComponentSize(Tag4);
+  registerComponentSize(Tag5);
+  registerComponentSize(Tag6);
+  ComponentID tags[TAG_COUNT] = {Tag0ID, Tag1ID, Tag2ID, Tag3ID, Tag4ID, Tag5ID, Tag6ID};
+  memcpy(tag_ids, tags, sizeof(tags));
+
+#ifdef __SSE2__
+  bool sse2 = true;
+#else
+  bool sse2 = false;
+#endif
+  printf(
+      "{\n  \"compiler\": \"%s\",\n  \"sse2\": %s,\n  \"repetitions\": %u,\n"
+      "  \"results\": [",
+      __VERSION__, sse2 ? "true" : "false", repetitions);
+
+  for (u32 count = 1000; count <= max_entities; count *= 10) {
+    double seconds;
+    BENCH_BEST(seconds, benchCreate(count));
+    printResult("create", count, count, seconds);
+
+    BENCH_BEST(seconds, benchAddChain(count));
+    printResult("add_component_chain", count, 4 * (u64)count, seconds);
+
+    BENCH_BEST(seconds, benchKillChurn(count));
+    printResult("kill_churn", count, count, seconds);
+
+    BENCH_BEST(seconds, benchGetRandom(count));
+    printResult("get_component_random", count, count, seconds);
+
+    BENCH_BEST(seconds, benchRunSystem(count, 1));
+    printResult("run_system_1_archetype", count, count, seconds);
+
+    BENCH_BEST(seconds, benchRunSystem(count, 10));
+    printResult("run_system_10_archetypes", count, count, seconds);
+
+    BENCH_BEST(seconds, benchRunSystem(count, 100));
+    printResult("run_system_100_archetypes", count, count, seconds);
+
+    u64 matched = 0;
+    BENCH_BEST(seconds, benchQueryMatch(count, &matched));
+    printResult("query_match_100_archetypes", count, matched ? matched : 1, seconds);
+  }
+  printf("\n  ]\n}\n");
+
+  ecsDeinit();
+  return 0;
+}
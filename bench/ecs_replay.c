@@ -0,0 +1,78 @@
+#include "ecs/trace.h"
+#include <time.h>
+
+// Replays a recorded operation trace (see src/ecs/trace.h) on a fresh scene
+// and prints one JSON document to stdout, timings are the best repetition.
+// Usage: ecs_replay trace [repetitions]
+static const char *op_names[TRACE_OP_COUNT] = {
+  "new_entity", "add_component", "kill_entity", "run_system", "clear",
+  "define_component", "define_system", "untraced"
+};
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [repetitions]\n", argv[0]);
+    return 1;
+  }
+  u32 repetitions = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+  if (!repetitions) {
+    repetitions = 1;
+  }
+
+  size_t bytesize;
+  u8 *bytes = traceLoad(argv[1], &bytesize);
+  if (!bytes) {
+    fprintf(stderr, "can't read %s\n", argv[1]);
+    return 1;
+  }
+
+  ecsInit(64 kB);
+  double best = 0;
+  TraceReplayStats stats;
+  size_t high_water = 0;
+  for (u32 i = 0; i < repetitions; i++) {
+    Scene scene;
+    sceneInit(&scene, 1 MB);
+
+    double start = now();
+    bool ok = sceneReplayTrace(&scene, bytes, bytesize, &stats);
+    double seconds = now() - start;
+
+    high_water = scene.arena.high_water;
+    sceneDestroy(&scene);
+    if (!ok) {
+      fprintf(stderr, "%s diverged or is malformed\n", argv[1]);
+      free(bytes);
+      ecsDeinit();
+      return 1;
+    }
+    if (!i || seconds < best) {
+      best = seconds;
+    }
+  }
+
+  u64 total_ops = 0;
+  printf(
+      "{\n  \"trace\": \"%s\",\n  \"bytesize\": %zu,\n  \"compiler\": \"%s\",\n"
+      "  \"repetitions\": %u,\n  \"ops\": {",
+      argv[1], bytesize, __VERSION__, repetitions);
+  for (u32 i = 0; i < TRACE_OP_COUNT; i++) {
+    printf("%s\"%s\": %llu", i ? ", " : "", op_names[i], (unsigned long long)stats.ops[i]);
+    total_ops += stats.ops[i];
+  }
+  printf(
+      "},\n  \"system_rows\": %llu,\n  \"column_sum\": %llu,\n"
+      "  \"arena_high_water\": %zu,\n  \"total_ms\": %.4f,\n  \"ns_per_op\": %.3f\n}\n",
+      (unsigned long long)stats.rows, (unsigned long long)stats.column_sum, high_water,
+      best * 1e3, total_ops ? best * 1e9 / total_ops : 0.0);
+
+  free(bytes);
+  ecsDeinit();
+  return 0;
+}
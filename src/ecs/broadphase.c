@@ -0,0 +1,429 @@
+#include "broadphase.h"
+
+// Sorted bounds are padded by a vector's worth of bodies that never overlap
+#define BROADPHASE_PADDING 8
+// Fewer bodies than this are swept on the calling thread alone
+#define BROADPHASE_PARALLEL_BODIES 4096
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Orders like the floats do, NaNs last
+static u32 broadphaseKey(float value) {
+  u32 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits ^ (bits >> 31 ? 0xFFFFFFFF : 0x80000000);
+}
+
+static void broadphaseEmit(BroadphaseWorker *worker, EntityID a, EntityID b) {
+  if (worker->pair_count == worker->pair_cap) {
+    worker->pair_cap = worker->pair_cap ? worker->pair_cap * 2 : 1024;
+    worker->pairs = realloc(worker->pairs, sizeof(BroadphasePair) * worker->pair_cap);
+  }
+  worker->pairs[worker->pair_count++] = (BroadphasePair) {.a = a, .b = b};
+}
+
+// Tests the bodies of one segment of the sorted axis against all the bodies
+// after them, until their lower x bound passes the body's upper one
+static void broadphaseSweep(Broadphase *broadphase, BroadphaseWorker *worker, u32 part, u32 parts) {
+  u32 n = broadphase->body_count;
+  u32 begin = (u64)n * part / parts, end = (u64)n * (part + 1) / parts;
+  const float *min_x = broadphase->sorted_min_x, *max_x = broadphase->sorted_max_x;
+  const float *min_y = broadphase->sorted_min_y, *max_y = broadphase->sorted_max_y;
+  const EntityID *entities = broadphase->sorted_entities;
+  worker->pair_count = 0;
+
+  for (u32 i = begin; i < end; i++) {
+    EntityID entity = entities[i];
+    u32 j = i + 1;
+
+#if defined(__AVX2__)
+    __m256 upper_x = _mm256_set1_ps(max_x[i]);
+    __m256 lower_y = _mm256_set1_ps(min_y[i]), upper_y = _mm256_set1_ps(max_y[i]);
+    for (; j < n; j += 8) {
+      // Sorted, so lanes passing the x test are a prefix
+      u32 x_lanes = _mm256_movemask_ps(
+          _mm256_cmp_ps(_mm256_loadu_ps(&min_x[j]), upper_x, _CMP_LE_OQ));
+      __m256 y_overlap = _mm256_and_ps(
+          _mm256_cmp_ps(_mm256_loadu_ps(&min_y[j]), upper_y, _CMP_LE_OQ),
+          _mm256_cmp_ps(_mm256_loadu_ps(&max_y[j]), lower_y, _CMP_GE_OQ));
+      u32 lanes = x_lanes & _mm256_movemask_ps(y_overlap);
+
+      while (lanes) {
+        u32 lane = __builtin_ctz(lanes);
+        broadphaseEmit(worker, entity, entities[j + lane]);
+        lanes &= lanes - 1;
+      }
+      if (x_lanes != 0xFF) {
+        break;
+      }
+    }
+#elif defined(__SSE2__)
+    __m128 upper_x = _mm_set1_ps(max_x[i]);
+    __m128 lower_y = _mm_set1_ps(min_y[i]), upper_y = _mm_set1_ps(max_y[i]);
+    for (; j < n; j += 4) {
+      u32 x_lanes = _mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(&min_x[j]), upper_x));
+      __m128 y_overlap = _mm_and_ps(
+          _mm_cmple_ps(_mm_loadu_ps(&min_y[j]), upper_y),
+          _mm_cmpge_ps(_mm_loadu_ps(&max_y[j]), lower_y));
+      u32 lanes = x_lanes & _mm_movemask_ps(y_overlap);
+
+      while (lanes) {
+        u32 lane = __builtin_ctz(lanes);
+        broadphaseEmit(worker, entity, entities[j + lane]);
+        lanes &= lanes - 1;
+      }
+      if (x_lanes != 0xF) {
+        break;
+      }
+    }
+#else
+    for (; j < n && min_x[j] <= max_x[i]; j++) {
+      if (min_y[j] <= max_y[i] && max_y[j] >= min_y[i]) {
+        broadphaseEmit(worker, entity, entities[j]);
+      }
+    }
+#endif
+  }
+}
+
+static void *broadphaseWorkerRun(void *arg) {
+  BroadphaseWorker *worker = arg;
+  Broadphase *broadphase = worker->broadphase;
+  u64 generation = 0;
+
+  pthread_mutex_lock(&broadphase->lock);
+  while (true) {
+    while (!broadphase->quit && broadphase->generation == generation) {
+      pthread_cond_wait(&broadphase->start, &broadphase->lock);
+    }
+    if (broadphase->quit) {
+      break;
+    }
+    generation = broadphase->generation;
+    pthread_mutex_unlock(&broadphase->lock);
+
+    broadphaseSweep(broadphase, worker, worker->index, broadphase->thread_count);
+
+    pthread_mutex_lock(&broadphase->lock);
+    if (--broadphase->running == 0) {
+      pthread_cond_signal(&broadphase->done);
+    }
+  }
+  pthread_mutex_unlock(&broadphase->lock);
+  return NULL;
+}
+
+void broadphaseInit(
+    Broadphase *broadphase, ComponentID position, u32 position_offset,
+    ComponentID extent, u32 extent_offset, u32 thread_count) {
+  assert(position_offset + 2 * sizeof(float) <= component_sizes[position] &&
+      "The position doesn't fit in its component, register its size first.");
+  assert(extent_offset + 2 * sizeof(float) <= component_sizes[extent] &&
+      "The extent doesn't fit in its component, register its size first.");
+  thread_count = thread_count ? thread_count : 1;
+  thread_count = thread_count < BROADPHASE_MAX_THREADS ? thread_count : BROADPHASE_MAX_THREADS;
+
+  *broadphase = (Broadphase) {
+    .position = position,
+      .extent = extent,
+      .position_offset = position_offset,
+      .extent_offset = extent_offset,
+
+      .entities = NULL,
+      .min_x = NULL,
+      .max_x = NULL,
+      .min_y = NULL,
+      .max_y = NULL,
+      .body_count = 0,
+      .body_cap = 0,
+
+      .order = NULL,
+      .scratch_order = NULL,
+      .sorted_entities = NULL,
+      .sorted_min_x = NULL,
+      .sorted_max_x = NULL,
+      .sorted_min_y = NULL,
+      .sorted_max_y = NULL,
+      .keys = NULL,
+      .scratch_keys = NULL,
+
+      .pairs = NULL,
+      .pair_count = 0,
+      .pair_cap = 0,
+
+      .thread_count = thread_count,
+      .generation = 0,
+      .running = 0,
+      .quit = false,
+
+      .radix_sorts = 0,
+      .insertion_sorts = 0,
+      .sort_moves = 0
+  };
+  queryInit(&broadphase->query);
+  _queryRequire(&broadphase->query, position);
+  _queryRequire(&broadphase->query, extent);
+
+  pthread_mutex_init(&broadphase->lock, NULL);
+  pthread_cond_init(&broadphase->start, NULL);
+  pthread_cond_init(&broadphase->done, NULL);
+  for (u32 i = 0; i < thread_count; i++) {
+    broadphase->workers[i] = (BroadphaseWorker) {
+      .broadphase = broadphase,
+        .index = i,
+        .pairs = NULL,
+        .pair_count = 0,
+        .pair_cap = 0
+    };
+    if (i) {
+      int result = pthread_create(
+          &broadphase->workers[i].thread, NULL, broadphaseWorkerRun, &broadphase->workers[i]);
+      assert(result == 0 && "Failed to start a broadphase worker.");
+      (void)result;
+    }
+  }
+}
+
+void broadphaseDeinit(Broadphase *broadphase) {
+  pthread_mutex_lock(&broadphase->lock);
+  broadphase->quit = true;
+  pthread_cond_broadcast(&broadphase->start);
+  pthread_mutex_unlock(&broadphase->lock);
+
+  for (u32 i = 0; i < broadphase->thread_count; i++) {
+    if (i) {
+      pthread_join(broadphase->workers[i].thread, NULL);
+    }
+    free(broadphase->workers[i].pairs);
+  }
+  pthread_mutex_destroy(&broadphase->lock);
+  pthread_cond_destroy(&broadphase->start);
+  pthread_cond_destroy(&broadphase->done);
+
+  free(broadphase->entities);
+  free(broadphase->min_x);
+  free(broadphase->max_x);
+  free(broadphase->min_y);
+  free(broadphase->max_y);
+  free(broadphase->order);
+  free(broadphase->scratch_order);
+  free(broadphase->sorted_entities);
+  free(broadphase->sorted_min_x);
+  free(broadphase->sorted_max_x);
+  free(broadphase->sorted_min_y);
+  free(broadphase->sorted_max_y);
+  free(broadphase->keys);
+  free(broadphase->scratch_keys);
+  free(broadphase->pairs);
+}
+
+static void broadphaseReserve(Broadphase *broadphase, u64 count) {
+  assert(count < UINT32_MAX - BROADPHASE_PADDING && "Too many bodies for the broadphase.");
+  if (count <= broadphase->body_cap) {
+    return;
+  }
+  u32 cap = broadphase->body_cap ? broadphase->body_cap : 1024;
+  while (cap < count) {
+    cap *= 2;
+  }
+
+  // Old bodies are compared against on the next gather, so they're kept
+  broadphase->entities = realloc(broadphase->entities, sizeof(EntityID) * cap);
+  broadphase->min_x = realloc(broadphase->min_x, sizeof(float) * cap);
+  broadphase->max_x = realloc(broadphase->max_x, sizeof(float) * cap);
+  broadphase->min_y = realloc(broadphase->min_y, sizeof(float) * cap);
+  broadphase->max_y = realloc(broadphase->max_y, sizeof(float) * cap);
+  broadphase->order = realloc(broadphase->order, sizeof(u32) * cap);
+  broadphase->scratch_order = realloc(broadphase->scratch_order, sizeof(u32) * cap);
+  broadphase->keys = realloc(broadphase->keys, sizeof(u32) * cap);
+  broadphase->scratch_keys = realloc(broadphase->scratch_keys, sizeof(u32) * cap);
+
+  broadphase->sorted_entities = realloc(broadphase->sorted_entities, sizeof(EntityID) * cap);
+  size_t padded = sizeof(float) * (cap + BROADPHASE_PADDING);
+  broadphase->sorted_min_x = realloc(broadphase->sorted_min_x, padded);
+  broadphase->sorted_max_x = realloc(broadphase->sorted_max_x, padded);
+  broadphase->sorted_min_y = realloc(broadphase->sorted_min_y, padded);
+  broadphase->sorted_max_y = realloc(broadphase->sorted_max_y, padded);
+  broadphase->body_cap = cap;
+}
+
+// Reads every body's bounds, returns whether the bodies are the same ones in
+// the same order as last time
+static bool broadphaseGather(Broadphase *broadphase, Scene *scene) {
+  u64 count = 0;
+  ECSQueryIter iter;
+  queryIterInit(&iter, scene, &broadphase->query);
+  Archetype *type;
+  while ((type = queryIterNext(&iter))) {
+    count += type->size;
+  }
+  broadphaseReserve(broadphase, count);
+
+  bool same = count == broadphase->body_count;
+  size_t position_size = component_sizes[broadphase->position];
+  size_t extent_size = component_sizes[broadphase->extent];
+  u32 n = 0;
+
+  queryIterInit(&iter, scene, &broadphase->query);
+  while ((type = queryIterNext(&iter))) {
+    u8 position_column = archetypeGetComponentIndex(type, broadphase->position);
+    u8 extent_column = archetypeGetComponentIndex(type, broadphase->extent);
+
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      ArchetypeChunk *chunk = archetypeReadChunk(type, j);
+      const EntityID *entities = chunkGetEntities(chunk);
+      const u8 *positions = (u8*)chunkGetColumn(type, chunk, position_column) +
+        broadphase->position_offset;
+      const u8 *extents = (u8*)chunkGetColumn(type, chunk, extent_column) +
+        broadphase->extent_offset;
+      u32 rows = archetypeChunkRows(type, j);
+
+      for (u32 r = 0; r < rows; r++, n++) {
+        float position[2], extent[2];
+        memcpy(position, positions + position_size * r, sizeof(position));
+        memcpy(extent, extents + extent_size * r, sizeof(extent));
+
+        same = same && broadphase->entities[n] == entities[r];
+        broadphase->entities[n] = entities[r];
+        broadphase->min_x[n] = position[0] - extent[0];
+        broadphase->max_x[n] = position[0] + extent[0];
+        broadphase->min_y[n] = position[1] - extent[1];
+        broadphase->max_y[n] = position[1] + extent[1];
+      }
+    }
+  }
+  broadphase->body_count = n;
+  return same;
+}
+
+// Stable LSD radix sort of keys with their body indices
+static void broadphaseRadixSort(Broadphase *broadphase) {
+  u32 n = broadphase->body_count;
+  for (u32 shift = 0; shift < 32; shift += RADIX_BITS) {
+    u32 counts[RADIX_BUCKETS] = {0};
+    const u32 *keys = broadphase->keys, *order = broadphase->order;
+    for (u32 i = 0; i < n; i++) {
+      counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+    }
+    u32 offset = 0;
+    for (u32 b = 0; b < RADIX_BUCKETS; b++) {
+      u32 bucket_count = counts[b];
+      counts[b] = offset;
+      offset += bucket_count;
+    }
+    u32 *out_keys = broadphase->scratch_keys, *out_order = broadphase->scratch_order;
+    for (u32 i = 0; i < n; i++) {
+      u32 slot = counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+      out_keys[slot] = keys[i];
+      out_order[slot] = order[i];
+    }
+
+    broadphase->scratch_keys = broadphase->keys;
+    broadphase->scratch_order = broadphase->order;
+    broadphase->keys = out_keys;
+    broadphase->order = out_order;
+  }
+  broadphase->radix_sorts++;
+}
+
+// False when it gave up after too many moves, the order is still a valid
+// permutation then
+static bool broadphaseInsertionSort(Broadphase *broadphase) {
+  u32 n = broadphase->body_count;
+  u32 *keys = broadphase->keys, *order = broadphase->order;
+  u64 moves = 0, max_moves = (u64)n * BROADPHASE_MAX_SORT_MOVES;
+
+  for (u32 i = 1; i < n; i++) {
+    u32 key = keys[i], body = order[i];
+    u32 j = i;
+    while (j && keys[j - 1] > key) {
+      keys[j] = keys[j - 1];
+      order[j] = order[j - 1];
+      j--;
+    }
+    keys[j] = key;
+    order[j] = body;
+
+    moves += i - j;
+    if (moves > max_moves) {
+      broadphase->sort_moves += moves;
+      return false;
+    }
+  }
+  broadphase->sort_moves += moves;
+  broadphase->insertion_sorts++;
+  return true;
+}
+
+u32 broadphaseUpdate(Broadphase *broadphase, Scene *scene) {
+  bool same = broadphaseGather(broadphase, scene);
+  u32 n = broadphase->body_count;
+
+  // Keys are refreshed in the last order, which is nearly sorted when the
+  // bodies are the same ones
+  u32 *keys = broadphase->keys, *order = broadphase->order;
+  for (u32 i = 0; i < n; i++) {
+    if (!same) {
+      order[i] = i;
+    }
+    keys[i] = broadphaseKey(broadphase->min_x[order[i]]);
+  }
+  if (!same || !broadphaseInsertionSort(broadphase)) {
+    broadphaseRadixSort(broadphase);
+  }
+
+  order = broadphase->order;
+  for (u32 i = 0; i < n; i++) {
+    u32 body = order[i];
+    broadphase->sorted_entities[i] = broadphase->entities[body];
+    broadphase->sorted_min_x[i] = broadphase->min_x[body];
+    broadphase->sorted_max_x[i] = broadphase->max_x[body];
+    broadphase->sorted_min_y[i] = broadphase->min_y[body];
+    broadphase->sorted_max_y[i] = broadphase->max_y[body];
+  }
+  // NaN padding fails every comparison and ends sweeps
+  for (u32 i = n; i < n + BROADPHASE_PADDING; i++) {
+    broadphase->sorted_min_x[i] = broadphase->sorted_max_x[i] = __builtin_nanf("");
+    broadphase->sorted_min_y[i] = broadphase->sorted_max_y[i] = __builtin_nanf("");
+  }
+
+  u32 parts = n >= BROADPHASE_PARALLEL_BODIES ? broadphase->thread_count : 1;
+  if (parts > 1) {
+    pthread_mutex_lock(&broadphase->lock);
+    broadphase->generation++;
+    broadphase->running = parts - 1;
+    pthread_cond_broadcast(&broadphase->start);
+    pthread_mutex_unlock(&broadphase->lock);
+  }
+  broadphaseSweep(broadphase, &broadphase->workers[0], 0, parts);
+  if (parts > 1) {
+    pthread_mutex_lock(&broadphase->lock);
+    while (broadphase->running) {
+      pthread_cond_wait(&broadphase->done, &broadphase->lock);
+    }
+    pthread_mutex_unlock(&broadphase->lock);
+  }
+
+  // Segments in axis order, so pairs come out the same for any thread count
+  u64 pair_count = 0;
+  for (u32 i = 0; i < parts; i++) {
+    pair_count += broadphase->workers[i].pair_count;
+  }
+  assert(pair_count <= UINT32_MAX && "Too many broadphase pairs.");
+  if (pair_count > broadphase->pair_cap) {
+    broadphase->pair_cap = pair_count;
+    broadphase->pairs = realloc(broadphase->pairs, sizeof(BroadphasePair) * pair_count);
+  }
+  broadphase->pair_count = 0;
+  for (u32 i = 0; i < parts; i++) {
+    BroadphaseWorker *worker = &broadphase->workers[i];
+    if (worker->pair_count) {
+      memcpy(
+          broadphase->pairs + broadphase->pair_count, worker->pairs,
+          sizeof(BroadphasePair) * worker->pair_count);
+    }
+    broadphase->pair_count += worker->pair_count;
+  }
+  return broadphase->pair_count;
+}
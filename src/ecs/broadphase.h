@@ -0,0 +1,84 @@
+#ifndef ECS_BROADPHASE_H
+#define ECS_BROADPHASE_H
+#include "ecs/ecs.h"
+#include <stddef.h>
+#include <pthread.h>
+
+// Sweep and prune broadphase over entities with a position and an extent
+// component, two floats at an offset in each (center and half size). Bounds
+// are gathered straight from the archetype columns every update, and bodies
+// are kept sorted by their lower x bound between updates. While the set of
+// bodies stays the same the previous order is insertion sorted, which is
+// close to linear when bodies move little between frames. New or removed
+// bodies, or an insertion sort moving too much, fall back to a radix sort.
+// The sweep tests a body against the following ones 8 (AVX2) or 4 (SSE2) at
+// a time and runs on thread_count threads, each sweeping a segment of the
+// sorted axis into its own pair buffer.
+#define BROADPHASE_MAX_THREADS 64
+
+// Insertion sorts moving bodies more than this many times their count give
+// up for a radix sort
+#define BROADPHASE_MAX_SORT_MOVES 16
+
+// Overlapping bounds, a comes before b on the x axis
+typedef struct {
+  EntityID a, b;
+} BroadphasePair;
+
+typedef struct {
+  struct Broadphase *broadphase;
+  pthread_t thread;
+  u32 index;
+
+  BroadphasePair *pairs;
+  u32 pair_count, pair_cap;
+} BroadphaseWorker;
+
+typedef struct Broadphase {
+  ECSQuery query;
+  ComponentID position, extent;
+  u32 position_offset, extent_offset;
+
+  // Gathered in archetype and row order
+  EntityID *entities;
+  float *min_x, *max_x, *min_y, *max_y;
+  u32 body_count, body_cap;
+
+  // Sorted by lower x bound: body indices, their entities and their bounds
+  // padded for vector loads past the end
+  u32 *order, *scratch_order;
+  EntityID *sorted_entities;
+  float *sorted_min_x, *sorted_max_x, *sorted_min_y, *sorted_max_y;
+  u32 *keys, *scratch_keys;
+
+  BroadphasePair *pairs;
+  u32 pair_count, pair_cap;
+
+  // Workers, the first one is the thread calling broadphaseUpdate
+  BroadphaseWorker workers[BROADPHASE_MAX_THREADS];
+  u32 thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  u64 generation;
+  u32 running;
+  bool quit;
+
+  u32 radix_sorts, insertion_sorts;
+  u64 sort_moves;
+} Broadphase;
+
+void broadphaseInit(
+    Broadphase *broadphase, ComponentID position, u32 position_offset,
+    ComponentID extent, u32 extent_offset, u32 thread_count);
+void broadphaseDeinit(Broadphase *broadphase);
+
+#define broadphaseInitFor(broadphase, PosType, pos_field, ExtType, ext_field, thread_count) \
+  broadphaseInit( \
+      broadphase, PosType##ID, offsetof(PosType, pos_field), \
+      ExtType##ID, offsetof(ExtType, ext_field), thread_count)
+
+// Finds every overlapping pair of the scene's bodies into broadphase->pairs,
+// returns how many there are. Bounds touching at an edge overlap.
+u32 broadphaseUpdate(Broadphase *broadphase, Scene *scene);
+
+#endif
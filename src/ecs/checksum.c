@@ -0,0 +1,322 @@
+#include "checksum.h"
+
+#define CHECKSUM_STRIPE 64
+#define CHECKSUM_LANES 8
+#define CHECKSUM_SCRAMBLE_STRIPES 16
+
+#define CHECKSUM_PRIME32 0x9E3779B1u
+#define CHECKSUM_PRIME64_1 0x9E3779B185EBCA87ull
+#define CHECKSUM_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define CHECKSUM_AVALANCHE 0x165667919E3779F9ull
+
+static const u64 checksum_key[CHECKSUM_LANES] __attribute__((aligned(16))) = {
+  0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull,
+  0x78E5C0CC4EE679CBull, 0x2172FFCC7DD05A82ull, 0x8E2443F7744608B8ull, 0x4C263A81E69035E0ull
+};
+
+// Every lane adds its neighbour's data and the product of its keyed halves
+#ifdef __SSE2__
+static void checksumAccumulate(u64 *acc, const u8 *stripe) {
+  __m128i *lanes = (__m128i*)acc;
+  for (u32 i = 0; i < CHECKSUM_LANES / 2; i++) {
+    __m128i data = _mm_loadu_si128((const __m128i*)stripe + i);
+    __m128i keyed = _mm_xor_si128(data, _mm_load_si128((const __m128i*)checksum_key + i));
+    __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+    __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+    lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+  }
+}
+
+static void checksumScramble(u64 *acc) {
+  __m128i *lanes = (__m128i*)acc;
+  __m128i prime = _mm_set1_epi32((int)CHECKSUM_PRIME32);
+  for (u32 i = 0; i < CHECKSUM_LANES / 2; i++) {
+    __m128i lane = lanes[i];
+    lane = _mm_xor_si128(lane, _mm_srli_epi64(lane, 47));
+    lane = _mm_xor_si128(lane, _mm_load_si128((const __m128i*)checksum_key + i));
+    __m128i low = _mm_mul_epu32(lane, prime);
+    __m128i high = _mm_mul_epu32(_mm_srli_epi64(lane, 32), prime);
+    lanes[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+  }
+}
+#else
+static void checksumAccumulate(u64 *acc, const u8 *stripe) {
+  for (u32 i = 0; i < CHECKSUM_LANES; i++) {
+    u64 data;
+    memcpy(&data, stripe + sizeof(u64) * i, sizeof(u64));
+    u64 keyed = data ^ checksum_key[i];
+    acc[i ^ 1] += data;
+    acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+  }
+}
+
+static void checksumScramble(u64 *acc) {
+  for (u32 i = 0; i < CHECKSUM_LANES; i++) {
+    u64 lane = acc[i];
+    lane ^= lane >> 47;
+    lane ^= checksum_key[i];
+    acc[i] = lane * CHECKSUM_PRIME32;
+  }
+}
+#endif
+
+static u64 checksumFold(u64 a, u64 b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (u64)product ^ (u64)(product >> 64);
+}
+
+static u64 checksumAvalanche(u64 hash) {
+  hash ^= hash >> 37;
+  hash *= CHECKSUM_AVALANCHE;
+  return hash ^ (hash >> 32);
+}
+
+u64 checksumHash(const void *data, size_t bytesize, u64 seed) {
+  u64 acc[CHECKSUM_LANES] __attribute__((aligned(16))) = {
+    CHECKSUM_PRIME32 + seed, CHECKSUM_PRIME64_1 - seed, CHECKSUM_PRIME64_2 + seed,
+    CHECKSUM_AVALANCHE - seed, CHECKSUM_PRIME64_1 + seed, CHECKSUM_PRIME64_2 - seed,
+    CHECKSUM_AVALANCHE + seed, CHECKSUM_PRIME32 - seed
+  };
+  const u8 *bytes = data;
+  size_t stripes = bytesize / CHECKSUM_STRIPE;
+
+  for (size_t i = 0; i < stripes; i++) {
+    checksumAccumulate(acc, bytes + CHECKSUM_STRIPE * i);
+    if (i % CHECKSUM_SCRAMBLE_STRIPES == CHECKSUM_SCRAMBLE_STRIPES - 1) {
+      checksumScramble(acc);
+    }
+  }
+  // Last partial stripe zero padded, the length tells them apart
+  size_t tail = bytesize % CHECKSUM_STRIPE;
+  if (tail) {
+    u8 last[CHECKSUM_STRIPE] = {0};
+    memcpy(last, bytes + CHECKSUM_STRIPE * stripes, tail);
+    checksumAccumulate(acc, last);
+  }
+
+  u64 hash = bytesize * CHECKSUM_PRIME64_1 ^ seed;
+  for (u32 i = 0; i < CHECKSUM_LANES; i += 2) {
+    hash += checksumFold(acc[i] ^ checksum_key[i], acc[i + 1] ^ checksum_key[i + 1]);
+  }
+  return checksumAvalanche(hash);
+}
+
+static u64 checksumCombine(u64 left, u64 right) {
+  return checksumAvalanche(
+      checksumFold(left ^ CHECKSUM_PRIME64_1, right ^ CHECKSUM_PRIME64_2) + left);
+}
+
+static u64 checksumChunk(Archetype *type, u32 chunk_index) {
+  ArchetypeChunk *chunk = archetypeThawChunk(type, chunk_index);
+  u32 rows = archetypeChunkRows(type, chunk_index);
+
+  u64 hash = checksumHash(chunkGetEntities(chunk), sizeof(EntityID) * rows, rows);
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t component_size = component_sizes[type->component_id[i]];
+    hash = checksumHash(chunkGetColumn(type, chunk, i), component_size * rows, hash);
+  }
+  return hash;
+}
+
+// Hash trees
+static u64 treeRoot(const ChecksumTree *tree) {
+  return tree->leaf_cap ? tree->nodes[1] : 0;
+}
+
+static void treeRebuild(ChecksumTree *tree) {
+  for (u32 i = tree->leaf_cap - 1; i >= 1; i--) {
+    tree->nodes[i] = checksumCombine(tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+  }
+}
+
+static void treeUpdatePath(ChecksumTree *tree, u32 leaf) {
+  for (u32 i = (tree->leaf_cap + leaf) / 2; i >= 1; i /= 2) {
+    tree->nodes[i] = checksumCombine(tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+  }
+}
+
+// Keeps the first leaves, returns true when the leaf count changed. Leaves
+// past the count are zero.
+static bool treeResize(ChecksumTree *tree, u32 leaf_count) {
+  if (leaf_count == tree->leaf_count) {
+    return false;
+  }
+  u32 leaf_cap = leaf_count ? 1 : 0;
+  while (leaf_cap < leaf_count) {
+    leaf_cap *= 2;
+  }
+  u32 kept = leaf_count < tree->leaf_count ? leaf_count : tree->leaf_count;
+
+  if (leaf_cap != tree->leaf_cap) {
+    u64 *nodes = leaf_cap ? calloc(2 * leaf_cap, sizeof(u64)) : NULL;
+    if (kept) {
+      memcpy(nodes + leaf_cap, tree->nodes + tree->leaf_cap, sizeof(u64) * kept);
+    }
+    free(tree->nodes);
+    tree->nodes = nodes;
+    tree->leaf_cap = leaf_cap;
+  } else {
+    memset(tree->nodes + leaf_cap + kept, 0, sizeof(u64) * (leaf_cap - kept));
+  }
+  tree->leaf_count = leaf_count;
+  return true;
+}
+
+// First leaf where two trees differ, the trees have the same shape
+static u32 treeFindDivergence(const ChecksumTree *a, const ChecksumTree *b) {
+  u32 i = 1;
+  while (i < a->leaf_cap) {
+    i = a->nodes[2 * i] != b->nodes[2 * i] ? 2 * i : 2 * i + 1;
+  }
+  return i - a->leaf_cap;
+}
+
+void checksumInit(SceneChecksum *checksum) {
+  *checksum = (SceneChecksum) {
+    .types = {0},
+      .chunks = NULL,
+      .type_cap = 0,
+      .hash = 0,
+      .source_id = 0,
+      .source_version = 0
+  };
+}
+
+void checksumDeinit(SceneChecksum *checksum) {
+  for (u32 i = 0; i < checksum->type_cap; i++) {
+    free(checksum->chunks[i].nodes);
+  }
+  free(checksum->chunks);
+  free(checksum->types.nodes);
+  checksum->chunks = NULL;
+  checksum->types = (ChecksumTree) {0};
+  checksum->type_cap = 0;
+}
+
+// Entity allocation state, decides which ids get handed out next
+static u64 checksumAllocation(Scene *scene) {
+  u64 hash = checksumHash(&scene->max_entity_id, sizeof(EntityID), scene->type_count);
+  for (u64 i = scene->id_queue_tail; i < scene->id_queue_head; i++) {
+    hash = checksumCombine(hash, scene->id_queue[i % scene->id_queue_cap]);
+  }
+  return hash;
+}
+
+u64 checksumUpdate(SceneChecksum *checksum, Scene *scene) {
+  bool same_source = checksum->source_id == scene->id;
+  u64 source_version = checksum->source_version;
+
+  if (scene->type_count > checksum->type_cap) {
+    u32 type_cap = checksum->type_cap ? checksum->type_cap * 2 : 16;
+    while (type_cap < scene->type_count) {
+      type_cap *= 2;
+    }
+    checksum->chunks = realloc(checksum->chunks, sizeof(ChecksumTree) * type_cap);
+    memset(
+        checksum->chunks + checksum->type_cap, 0,
+        sizeof(ChecksumTree) * (type_cap - checksum->type_cap));
+    checksum->type_cap = type_cap;
+  }
+  bool types_resized = treeResize(&checksum->types, scene->type_count);
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    ChecksumTree *tree = &checksum->chunks[i];
+    u32 chunk_count = archetypeActiveChunks(type);
+    bool resized = treeResize(tree, chunk_count);
+
+    // Row count changes stamp chunks too, clean chunks keep their leaves
+    for (u32 j = 0; j < chunk_count; j++) {
+      if (same_source && type->chunks[j].version <= source_version) {
+        continue;
+      }
+      tree->nodes[tree->leaf_cap + j] = checksumChunk(type, j);
+      if (!resized) {
+        treeUpdatePath(tree, j);
+      }
+    }
+    if (resized && tree->leaf_cap) {
+      treeRebuild(tree);
+    }
+
+    // Cheap enough to redo for every archetype
+    u64 *leaf = &checksum->types.nodes[checksum->types.leaf_cap + i];
+    u64 hash = checksumCombine(
+        checksumHash(&type->component_mask, sizeof(Bitmask), type->size), treeRoot(tree));
+    if (*leaf != hash) {
+      *leaf = hash;
+      if (!types_resized) {
+        treeUpdatePath(&checksum->types, i);
+      }
+    }
+  }
+  if (types_resized && checksum->types.leaf_cap) {
+    treeRebuild(&checksum->types);
+  }
+
+  checksum->source_id = scene->id;
+  checksum->source_version = scene->version;
+  checksum->hash = checksumCombine(treeRoot(&checksum->types), checksumAllocation(scene));
+  return checksum->hash;
+}
+
+u64 sceneChecksum(Scene *scene) {
+  SceneChecksum checksum;
+  checksumInit(&checksum);
+  u64 hash = checksumUpdate(&checksum, scene);
+  checksumDeinit(&checksum);
+  return hash;
+}
+
+bool checksumFindDivergence(
+    const SceneChecksum *a, const SceneChecksum *b, u32 *type_index, u32 *chunk_index) {
+
+  if (a->hash == b->hash) {
+    return false;
+  }
+  const ChecksumTree *a_types = &a->types, *b_types = &b->types;
+  u32 type_count = a_types->leaf_count < b_types->leaf_count ?
+    a_types->leaf_count : b_types->leaf_count;
+
+  // Trees of different shapes are compared leaf by leaf
+  u32 type = ENTITY_NO_TYPE;
+  if (a_types->leaf_cap == b_types->leaf_cap) {
+    if (treeRoot(a_types) != treeRoot(b_types)) {
+      type = treeFindDivergence(a_types, b_types);
+    }
+  } else {
+    for (u32 i = 0; i < type_count && type == ENTITY_NO_TYPE; i++) {
+      if (a_types->nodes[a_types->leaf_cap + i] != b_types->nodes[b_types->leaf_cap + i]) {
+        type = i;
+      }
+    }
+    if (type == ENTITY_NO_TYPE && a_types->leaf_count != b_types->leaf_count) {
+      type = type_count;
+    }
+  }
+  *type_index = type;
+  *chunk_index = 0;
+  if (type == ENTITY_NO_TYPE || type >= type_count) {
+    return true;
+  }
+
+  const ChecksumTree *a_chunks = &a->chunks[type], *b_chunks = &b->chunks[type];
+  u32 chunk_count = a_chunks->leaf_count < b_chunks->leaf_count ?
+    a_chunks->leaf_count : b_chunks->leaf_count;
+
+  if (a_chunks->leaf_cap == b_chunks->leaf_cap && treeRoot(a_chunks) != treeRoot(b_chunks)) {
+    u32 chunk = treeFindDivergence(a_chunks, b_chunks);
+    if (chunk < chunk_count) {
+      *chunk_index = chunk;
+      return true;
+    }
+  }
+  *chunk_index = chunk_count;
+  for (u32 i = 0; i < chunk_count; i++) {
+    if (a_chunks->nodes[a_chunks->leaf_cap + i] != b_chunks->nodes[b_chunks->leaf_cap + i]) {
+      *chunk_index = i;
+      break;
+    }
+  }
+  return true;
+}
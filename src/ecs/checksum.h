@@ -0,0 +1,49 @@
+#ifndef ECS_CHECKSUM_H
+#define ECS_CHECKSUM_H
+#include "ecs/ecs.h"
+
+// World checksums for desync detection. Every chunk's entity ids and columns
+// are streamed through a 64 bit hash that works on 64 byte stripes, 8 lanes
+// wide (SSE2 when available, the scalar fallback gives the same values).
+// Chunk hashes are the leaves of a binary hash tree per archetype, archetype
+// hashes the leaves of the scene's tree, and the scene hash adds the entity
+// allocation state. Components are hashed as raw bytes, padding in them must
+// be written deterministically too.
+typedef struct {
+  // Heap order, the root at 1 and leaves from leaf_cap on. leaf_cap is the
+  // leaf count rounded up to a power of two so equal leaves give equal roots.
+  u64 *nodes;
+  u32 leaf_count, leaf_cap;
+} ChecksumTree;
+
+// Keeps the trees between updates, chunks the source scene hasn't written
+// since the last update aren't hashed again
+typedef struct {
+  ChecksumTree types;
+  ChecksumTree *chunks; // Per archetype
+  u32 type_cap;
+  u64 hash;
+
+  // Id of the scene last hashed, 0 before the first update
+  u64 source_id;
+  u64 source_version;
+} SceneChecksum;
+
+u64 checksumHash(const void *data, size_t bytesize, u64 seed);
+
+// One shot, same value as checksumUpdate
+u64 sceneChecksum(Scene *scene);
+
+void checksumInit(SceneChecksum *checksum);
+void checksumDeinit(SceneChecksum *checksum);
+u64 checksumUpdate(SceneChecksum *checksum, Scene *scene);
+
+// Walks both trees down to the first archetype and chunk that differ, false if
+// the checksums match. chunk_index is the archetype's chunk count when only
+// its mask or size differ. type_index is the smaller archetype count when
+// only one side has the archetype, ENTITY_NO_TYPE when only the entity
+// allocation state differs.
+bool checksumFindDivergence(
+    const SceneChecksum *a, const SceneChecksum *b, u32 *type_index, u32 *chunk_index);
+
+#endif
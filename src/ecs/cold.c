@@ -0,0 +1,271 @@
+#include "cold.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Run length encoding, a control byte c < 128 is followed by c + 1 literal
+// bytes, c >= 128 by one byte repeated c - 125 times
+#define COLD_MAX_LITERALS 128
+#define COLD_MIN_RUN 3
+#define COLD_MAX_RUN (127 + COLD_MIN_RUN)
+
+static size_t coldEncodeBound(size_t bytesize) {
+  return bytesize + bytesize / COLD_MAX_LITERALS + 1;
+}
+
+static size_t coldFlushLiterals(const u8 *literals, size_t count, u8 *out) {
+  size_t written = 0;
+  while (count) {
+    size_t step = count < COLD_MAX_LITERALS ? count : COLD_MAX_LITERALS;
+    out[written++] = step - 1;
+    memcpy(out + written, literals, step);
+    written += step;
+    literals += step;
+    count -= step;
+  }
+  return written;
+}
+
+static size_t coldEncode(const u8 *in, size_t bytesize, u8 *out) {
+  size_t written = 0, literals = 0, i = 0;
+  while (i < bytesize) {
+    size_t run = 1;
+    while (i + run < bytesize && run < COLD_MAX_RUN && in[i + run] == in[i]) {
+      run++;
+    }
+    if (run < COLD_MIN_RUN) {
+      i++;
+      continue;
+    }
+    written += coldFlushLiterals(in + literals, i - literals, out + written);
+    out[written++] = 128 + run - COLD_MIN_RUN;
+    out[written++] = in[i];
+    i += run;
+    literals = i;
+  }
+  return written + coldFlushLiterals(in + literals, i - literals, out + written);
+}
+
+// False on a corrupt stream, one that doesn't decode to exactly bytesize bytes
+static bool coldDecode(const u8 *in, size_t in_bytesize, u8 *out, size_t bytesize) {
+  const u8 *end = in + in_bytesize;
+  u8 *out_end = out + bytesize;
+  while (in < end) {
+    u8 control = *in++;
+    if (control < 128) {
+      size_t count = control + 1;
+      if (count > (size_t)(end - in) || count > (size_t)(out_end - out)) {
+        return false;
+      }
+      memcpy(out, in, count);
+      in += count;
+      out += count;
+    } else {
+      size_t run = control - 128 + COLD_MIN_RUN;
+      if (in == end || run > (size_t)(out_end - out)) {
+        return false;
+      }
+      memset(out, *in++, run);
+      out += run;
+    }
+  }
+  return out == out_end;
+}
+
+// Thaws have no way to report errors (reads go through archetypeReadChunk),
+// and carrying on would put garbage in live chunks
+static void coldFail(Archetype *type, u32 chunk_index, const char *reason) {
+  fprintf(stderr, "ecs: can't thaw chunk %u of archetype %u: %s\n",
+      chunk_index, type->scene_index, reason);
+  abort();
+}
+
+// Byte planes of count elements of size bytes, byte b of every element together
+static void coldShuffle(const u8 *in, u32 count, size_t size, u8 *out) {
+  for (size_t b = 0; b < size; b++) {
+    for (u32 i = 0; i < count; i++) {
+      *out++ = in[i * size + b];
+    }
+  }
+}
+
+static void coldUnshuffle(const u8 *in, u32 count, size_t size, u8 *out) {
+  for (size_t b = 0; b < size; b++) {
+    for (u32 i = 0; i < count; i++) {
+      out[i * size + b] = *in++;
+    }
+  }
+}
+
+bool coldSpillOpen(ColdSpill *spill, const char *path) {
+  *spill = (ColdSpill) {
+    .fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644),
+      .end = 0
+  };
+  return spill->fd >= 0;
+}
+
+void coldSpillClose(ColdSpill *spill) {
+  if (spill->fd >= 0) {
+    close(spill->fd);
+  }
+  spill->fd = -1;
+}
+
+static bool coldCanFreeze(Scene *scene, ArchetypeChunk *chunk) {
+  u8 *mapping = scene->mapping;
+  return
+    chunk->data && !chunk->share &&
+    !(mapping && chunk->data >= mapping && chunk->data < mapping + scene->mapping_bytesize);
+}
+
+// Packs a chunk's rows, returns NULL if they don't get any smaller
+static ColdChunk *coldPack(Archetype *type, ArchetypeChunk *chunk, u32 rows, u8 *planes, u8 *packed) {
+  u8 *out = planes;
+  coldShuffle(chunk->data, rows, sizeof(EntityID), out);
+  out += sizeof(EntityID) * rows;
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t component_size = component_sizes[type->component_id[i]];
+    coldShuffle(chunkGetColumn(type, chunk, i), rows, component_size, out);
+    out += component_size * rows;
+  }
+
+  size_t bytesize = coldEncode(planes, out - planes, packed);
+  if (bytesize >= (size_t)chunk->cap * type->row_bytesize) {
+    return NULL;
+  }
+  ColdChunk *cold = malloc(sizeof(ColdChunk) + bytesize);
+  *cold = (ColdChunk) {
+    .rows = rows,
+      .bytesize = bytesize,
+      .fd = -1,
+      .offset = 0
+  };
+  memcpy(cold->bytes, packed, bytesize);
+  return cold;
+}
+
+// Moves the packed bytes to the spill file, keeps them in memory if that fails
+static ColdChunk *coldSpill(ColdChunk *cold, ColdSpill *spill) {
+  if (pwrite(spill->fd, cold->bytes, cold->bytesize, spill->end) != (ssize_t)cold->bytesize) {
+    return cold;
+  }
+  ColdChunk *spilled = malloc(sizeof(ColdChunk));
+  *spilled = (ColdChunk) {
+    .rows = cold->rows,
+      .bytesize = cold->bytesize,
+      .fd = spill->fd,
+      .offset = spill->end
+  };
+  spill->end += cold->bytesize;
+  free(cold);
+  return spilled;
+}
+
+u32 sceneFreezeCold(Scene *scene, u64 now, u64 idle, ColdSpill *spill) {
+  scene->clock = now;
+  u32 frozen = 0;
+
+  // Scratch for the byte planes and the packed bytes, sized for a full chunk
+  u8 *planes = NULL, *packed = NULL;
+  size_t scratch_bytesize = 0;
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      ArchetypeChunk *chunk = &type->chunks[j];
+      if (chunk->cold || chunk->access + idle > now || !coldCanFreeze(scene, chunk)) {
+        continue;
+      }
+
+      size_t bytesize = (size_t)chunk->cap * type->row_bytesize;
+      if (bytesize > scratch_bytesize) {
+        scratch_bytesize = (size_t)CHUNK_ROWS * type->row_bytesize;
+        planes = realloc(planes, scratch_bytesize);
+        packed = realloc(packed, coldEncodeBound(scratch_bytesize));
+      }
+
+      ColdChunk *cold = coldPack(type, chunk, archetypeChunkRows(type, j), planes, packed);
+      if (!cold) {
+        continue;
+      }
+      if (spill) {
+        cold = coldSpill(cold, spill);
+      }
+      sceneFreeChunkData(scene, chunk->data, bytesize);
+      chunk->data = NULL;
+      chunk->cold = cold;
+      scene->cold_count++;
+      frozen++;
+    }
+  }
+  free(planes);
+  free(packed);
+  return frozen;
+}
+
+ArchetypeChunk *archetypeThawChunk(Archetype *type, u32 chunk_index) {
+  ArchetypeChunk *chunk = &type->chunks[chunk_index];
+  ColdChunk *cold = chunk->cold;
+  if (!cold) {
+    return chunk;
+  }
+  Scene *scene = type->scene;
+
+  u8 *bytes = cold->bytes;
+  if (cold->fd >= 0) {
+    bytes = malloc(cold->bytesize);
+    if (pread(cold->fd, bytes, cold->bytesize, cold->offset) != (ssize_t)cold->bytesize) {
+      coldFail(type, chunk_index, "short read from the spill file");
+    }
+  }
+
+  u32 rows = cold->rows;
+  size_t planes_bytesize = (size_t)rows * type->row_bytesize;
+  u8 *planes = malloc(planes_bytesize);
+  if (!coldDecode(bytes, cold->bytesize, planes, planes_bytesize)) {
+    coldFail(type, chunk_index, "corrupt packed rows");
+  }
+
+  chunk->data = sceneAllocChunkData(scene, (size_t)chunk->cap * type->row_bytesize);
+  const u8 *in = planes;
+  coldUnshuffle(in, rows, sizeof(EntityID), chunk->data);
+  in += sizeof(EntityID) * rows;
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t component_size = component_sizes[type->component_id[i]];
+    coldUnshuffle(in, rows, component_size, chunkGetColumn(type, chunk, i));
+    in += component_size * rows;
+  }
+
+  free(planes);
+  if (bytes != cold->bytes) {
+    free(bytes);
+  }
+  free(cold);
+  chunk->cold = NULL;
+  scene->cold_count--;
+  return chunk;
+}
+
+void sceneColdUsage(Scene *scene, size_t *in_memory, size_t *spilled) {
+  *in_memory = *spilled = 0;
+  for (u32 i = 0; scene->cold_count && i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    for (u32 j = 0; j < type->chunk_count; j++) {
+      ColdChunk *cold = type->chunks[j].cold;
+      if (cold) {
+        *(cold->fd >= 0 ? spilled : in_memory) += cold->bytesize;
+      }
+    }
+  }
+}
+
+void coldRelease(Scene *scene) {
+  for (u32 i = 0; scene->cold_count && i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    for (u32 j = 0; j < type->chunk_count; j++) {
+      free(type->chunks[j].cold);
+      type->chunks[j].cold = NULL;
+    }
+  }
+  scene->cold_count = 0;
+}
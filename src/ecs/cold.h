@@ -0,0 +1,44 @@
+#ifndef ECS_COLD_H
+#define ECS_COLD_H
+#include "ecs/ecs.h"
+
+// Cold storage for chunks nothing has accessed for a while. Every chunk read
+// or write stamps the scene clock on the chunk, a freeze packs the chunks
+// left idle for long enough: each column is split into byte planes (the high
+// bytes of ids, counters and most floats repeat a lot) and run length encoded.
+// Packed rows stay in memory or are spilled to a file, either way the first
+// access through the scene unpacks them again, aborting with a message if the
+// spill file comes up short or the packed rows are corrupt. Chunks shared with
+// a fork or living in a mapped snapshot are never packed.
+typedef struct ColdChunk {
+  u32 rows;
+  u64 bytesize;
+
+  // -1 while the packed bytes are held in memory
+  int fd;
+  u64 offset;
+  u8 bytes[];
+} ColdChunk;
+
+// Append only spill file, space of thawed chunks isn't reused. Must stay open
+// while chunks spilled to it are cold.
+typedef struct {
+  int fd;
+  u64 end;
+} ColdSpill;
+
+bool coldSpillOpen(ColdSpill *spill, const char *path);
+void coldSpillClose(ColdSpill *spill);
+
+// Sets the scene clock to now (any monotonic unit, frames or milliseconds) and
+// packs chunks last accessed idle or more ago, spilling them when spill isn't
+// NULL. Call between frames. Returns how many chunks were packed.
+u32 sceneFreezeCold(Scene *scene, u64 now, u64 idle, ColdSpill *spill);
+
+// Bytes held by cold chunks in memory and in spill files
+void sceneColdUsage(Scene *scene, size_t *in_memory, size_t *spilled);
+
+// Frees all packed rows, called by the scene on sceneClear and sceneDestroy
+void coldRelease(Scene *scene);
+
+#endif
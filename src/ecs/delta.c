@@ -0,0 +1,608 @@
+#include "delta.h"
+#include "ecs/trace.h"
+
+void deltaRecorderInit(DeltaRecorder *recorder, size_t arena_block_size) {
+  sceneInit(&recorder->baseline, arena_block_size);
+  recorder->delta = NULL;
+  recorder->delta_bytesize = 0;
+  recorder->delta_cap = 0;
+  recorder->source_id = 0;
+  recorder->source_version = 0;
+  recorder->source_id_tail = 0;
+  recorder->source_id_head = 0;
+}
+
+void deltaRecorderDeinit(DeltaRecorder *recorder) {
+  sceneDestroy(&recorder->baseline);
+  free(recorder->delta);
+  recorder->delta = NULL;
+}
+
+static void *deltaPut(DeltaRecorder *recorder, const void *data, size_t bytesize) {
+  if (recorder->delta_bytesize + bytesize > recorder->delta_cap) {
+    recorder->delta_cap = (recorder->delta_bytesize + bytesize) * 2;
+    recorder->delta = realloc(recorder->delta, recorder->delta_cap);
+  }
+  void *ptr = recorder->delta + recorder->delta_bytesize;
+  if (data) {
+    memcpy(ptr, data, bytesize);
+  }
+  recorder->delta_bytesize += bytesize;
+  return ptr;
+}
+
+// Run count, runs each followed by their XORed bytes, then the raw tail
+static void deltaEncodeBlock(
+    DeltaRecorder *recorder, const u8 *data, u64 bytesize,
+    const u8 *baseline, u64 baseline_bytesize) {
+
+  u64 common = bytesize < baseline_bytesize ? bytesize : baseline_bytesize;
+  u64 chunk_count = (common + DELTA_CHUNK_BYTES - 1) / DELTA_CHUNK_BYTES;
+
+  size_t run_count_offset = recorder->delta_bytesize;
+  deltaPut(recorder, NULL, sizeof(u32));
+  u32 run_count = 0;
+
+  u64 chunk = 0;
+  while (chunk < chunk_count) {
+    // Skip unchanged chunks
+    u64 offset = chunk * DELTA_CHUNK_BYTES;
+    u64 length = common - offset < DELTA_CHUNK_BYTES ? common - offset : DELTA_CHUNK_BYTES;
+    if (!memcmp(data + offset, baseline + offset, length)) {
+      chunk++;
+      continue;
+    }
+
+    DeltaRun run = {.first_chunk = chunk, .chunk_count = 0};
+    while (chunk < chunk_count) {
+      offset = chunk * DELTA_CHUNK_BYTES;
+      length = common - offset < DELTA_CHUNK_BYTES ? common - offset : DELTA_CHUNK_BYTES;
+      if (!memcmp(data + offset, baseline + offset, length)) {
+        break;
+      }
+      run.chunk_count++;
+      chunk++;
+    }
+    deltaPut(recorder, &run, sizeof(run));
+
+    u64 run_offset = (u64)run.first_chunk * DELTA_CHUNK_BYTES;
+    u64 run_end = offset + length;
+    if (chunk < chunk_count) {
+      run_end = (u64)chunk * DELTA_CHUNK_BYTES;
+    }
+    u8 *out = deltaPut(recorder, NULL, run_end - run_offset);
+    for (u64 i = run_offset; i < run_end; i++) {
+      out[i - run_offset] = data[i] ^ baseline[i];
+    }
+    run_count++;
+  }
+  memcpy(recorder->delta + run_count_offset, &run_count, sizeof(u32));
+
+  if (bytesize > common) {
+    deltaPut(recorder, data + common, bytesize - common);
+  }
+}
+
+// Block with no runs and no tail, the size is unchanged
+static void deltaPutEmpty(DeltaRecorder *recorder) {
+  u32 run_count = 0;
+  deltaPut(recorder, &run_count, sizeof(u32));
+}
+
+// Whether scene->types starts with baseline->types, so type indices agree
+static bool deltaBaselineMatches(Scene *baseline, Scene *scene) {
+  if (baseline->type_count > scene->type_count) {
+    return false;
+  }
+  for (u32 i = 0; i < baseline->type_count; i++) {
+    if (!bitmaskEquals(baseline->types[i]->component_mask, scene->types[i]->component_mask)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether a page holds the same records as the baseline's, not written since
+// the last capture of the same scene
+static bool deltaPageUnchanged(DeltaRecorder *recorder, Scene *scene, u32 page_index) {
+  u32 records = sceneEntityPageRecords(scene, page_index);
+  return records &&
+    records == sceneEntityPageRecords(&recorder->baseline, page_index) &&
+    scene->entity_pages[page_index].version <= recorder->source_version;
+}
+
+// How many ids of the baseline's free queue are still at the front of the
+// scene's, going by the queue counts at the last capture. Checked against
+// the baseline since rollbacks and loads restart the counts.
+static u32 deltaKeptFreeIds(DeltaRecorder *recorder, Scene *scene) {
+  Scene *baseline = &recorder->baseline;
+  u64 base_count = baseline->id_queue_head - baseline->id_queue_tail;
+  if (scene->id_queue_tail < recorder->source_id_tail ||
+      scene->id_queue_head < recorder->source_id_head) {
+    return 0;
+  }
+  u64 dequeued = scene->id_queue_tail - recorder->source_id_tail;
+  if (dequeued >= base_count || base_count - dequeued > scene->id_queue_head - scene->id_queue_tail) {
+    return 0;
+  }
+
+  // Compared a span at a time, spans end where either ring wraps
+  u64 kept = base_count - dequeued;
+  for (u64 i = 0; i < kept;) {
+    u64 at = (scene->id_queue_tail + i) % scene->id_queue_cap;
+    u64 base_at = (baseline->id_queue_tail + dequeued + i) % baseline->id_queue_cap;
+    u64 span = kept - i;
+    span = span < scene->id_queue_cap - at ? span : scene->id_queue_cap - at;
+    span = span < baseline->id_queue_cap - base_at ? span : baseline->id_queue_cap - base_at;
+
+    if (memcmp(scene->id_queue + at, baseline->id_queue + base_at, sizeof(EntityID) * span)) {
+      return 0;
+    }
+    i += span;
+  }
+  return kept;
+}
+
+void deltaCapture(DeltaRecorder *recorder, Scene *scene) {
+  Scene *baseline = &recorder->baseline;
+  recorder->delta_bytesize = 0;
+
+  bool keyframe = !baseline->type_count || !deltaBaselineMatches(baseline, scene);
+  if (keyframe) {
+    sceneClear(baseline);
+  }
+
+  // Pages and chunks not written since the last capture of this scene
+  // match the baseline and are stored as empty blocks without comparing
+  bool same_source = !keyframe && recorder->source_id == scene->id;
+  u64 source_version = recorder->source_version;
+
+  Bitmask used = {0};
+  for (u32 i = 0; i < scene->type_count; i++) {
+    for (u32 j = 0; j < BITMASK_WORDS; j++) {
+      used.bits[j] |= scene->types[i]->component_mask.bits[j];
+    }
+  }
+
+  DeltaHeader header = {
+    .magic = DELTA_MAGIC,
+    .keyframe = keyframe,
+    .component_count = bitmaskFlagCount(&used),
+    .type_count = scene->type_count,
+    .max_entity_id = scene->max_entity_id,
+    .free_id_count = scene->id_queue_head - scene->id_queue_tail,
+    .free_kept_count = same_source ? deltaKeptFreeIds(recorder, scene) : 0,
+    .spawned_count = 0,
+    .killed_count = 0
+  };
+  size_t header_offset = recorder->delta_bytesize;
+  deltaPut(recorder, &header, sizeof(header));
+
+  for (u32 id = 0; id < MAX_COMPONENTS; id++) {
+    if (getBit(used, id)) {
+      SnapshotComponent component;
+      memset(&component, 0, sizeof(component));
+      component.id = id;
+      component.size = component_sizes[id];
+      deltaPut(recorder, &component, sizeof(component));
+    }
+  }
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    SnapshotArchetype type = {
+      .component_mask = scene->types[i]->component_mask,
+      .size = scene->types[i]->size
+    };
+    deltaPut(recorder, &type, sizeof(type));
+  }
+
+  // Spawned then killed, an entity is alive while it has a type. Only pages
+  // written since the last capture can have either.
+  EntityID id_count = scene->max_entity_id > baseline->max_entity_id ?
+    scene->max_entity_id : baseline->max_entity_id;
+  u32 id_page_count = ((u64)id_count + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+
+  for (u32 pass = 0; pass < 2; pass++) {
+    u32 count = 0;
+    for (u32 i = 0; i < id_page_count; i++) {
+      if (same_source && deltaPageUnchanged(recorder, scene, i)) {
+        continue;
+      }
+      u64 end = ((u64)i + 1) << ENTITY_PAGE_SHIFT;
+      end = end < id_count ? end : id_count;
+
+      for (EntityID entity = i << ENTITY_PAGE_SHIFT; entity < end; entity++) {
+        bool alive = entity < scene->max_entity_id &&
+          sceneGetRecord(scene, entity)->type != ENTITY_NO_TYPE;
+        bool was_alive = entity < baseline->max_entity_id &&
+          sceneGetRecord(baseline, entity)->type != ENTITY_NO_TYPE;
+
+        if (pass == 0 ? (alive && !was_alive) : (!alive && was_alive)) {
+          deltaPut(recorder, &entity, sizeof(EntityID));
+          count++;
+        }
+      }
+    }
+    if (pass == 0) {
+      header.spawned_count = count;
+    } else {
+      header.killed_count = count;
+    }
+  }
+  memcpy(recorder->delta + header_offset, &header, sizeof(header));
+
+  // Free ids queued since the baseline's, after the ones it still has
+  for (u32 i = header.free_kept_count; i < header.free_id_count; i++) {
+    deltaPut(
+        recorder, &scene->id_queue[(scene->id_queue_tail + i) % scene->id_queue_cap],
+        sizeof(EntityID));
+  }
+
+  u32 page_count = ((u64)scene->max_entity_id + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+  for (u32 i = 0; i < page_count; i++) {
+    EntityPage *page = &scene->entity_pages[i];
+    u32 base_records = sceneEntityPageRecords(baseline, i);
+
+    if (same_source && deltaPageUnchanged(recorder, scene, i)) {
+      deltaPutEmpty(recorder);
+      continue;
+    }
+    deltaEncodeBlock(
+        recorder, (u8*)page->records, sizeof(EntityRecord) * sceneEntityPageRecords(scene, i),
+        base_records ? (u8*)baseline->entity_pages[i].records : NULL,
+        sizeof(EntityRecord) * base_records);
+  }
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    Archetype *base_type = i < baseline->type_count ? baseline->types[i] : NULL;
+
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      ArchetypeChunk *chunk = &type->chunks[j];
+      u32 rows = archetypeChunkRows(type, j);
+      u32 base_rows = base_type ? archetypeChunkRows(base_type, j) : 0;
+      ArchetypeChunk *base_chunk = base_rows ? &base_type->chunks[j] : NULL;
+
+      if (same_source && chunk->version <= source_version) {
+        for (u8 k = 0; k <= type->component_count; k++) {
+          deltaPutEmpty(recorder);
+        }
+        continue;
+      }
+      archetypeThawChunk(type, j);
+
+      deltaEncodeBlock(
+          recorder, (u8*)chunkGetEntities(chunk), sizeof(EntityID) * rows,
+          base_chunk ? (u8*)chunkGetEntities(base_chunk) : NULL, sizeof(EntityID) * base_rows);
+
+      for (u8 k = 0; k < type->component_count; k++) {
+        size_t component_size = component_sizes[type->component_id[k]];
+        deltaEncodeBlock(
+            recorder, chunkGetColumn(type, chunk, k), component_size * rows,
+            base_chunk ? chunkGetColumn(base_type, base_chunk, k) : NULL,
+            component_size * base_rows);
+      }
+    }
+  }
+  recorder->source_id = scene->id;
+  recorder->source_version = scene->version;
+  recorder->source_id_tail = scene->id_queue_tail;
+  recorder->source_id_head = scene->id_queue_head;
+
+  // Move the baseline up to the captured state
+  bool applied = sceneApplyDelta(baseline, recorder->delta, recorder->delta_bytesize);
+  assert(applied && "Delta failed to apply to its own baseline.");
+  (void)applied;
+}
+
+// Bounds checked reads over a delta
+typedef struct {
+  const u8 *data;
+  size_t offset, bytesize;
+  bool ok;
+} DeltaCursor;
+
+static const void *cursorRead(DeltaCursor *cursor, size_t bytesize) {
+  if (!cursor->ok || cursor->offset + bytesize > cursor->bytesize) {
+    cursor->ok = false;
+    return NULL;
+  }
+  const void *ptr = cursor->data + cursor->offset;
+  cursor->offset += bytesize;
+  return ptr;
+}
+
+// Empty blocks are skipped so applying them doesn't copy shared chunks
+static bool deltaSkipEmptyBlock(DeltaCursor *cursor, u64 bytesize, u64 baseline_bytesize) {
+  u32 run_count;
+  if (bytesize > baseline_bytesize || cursor->offset + sizeof(u32) > cursor->bytesize) {
+    return false;
+  }
+  memcpy(&run_count, cursor->data + cursor->offset, sizeof(u32));
+  if (run_count) {
+    return false;
+  }
+  cursor->offset += sizeof(u32);
+  return true;
+}
+
+// Without data the block is only checked, the cursor moves the same
+static void deltaApplyBlock(DeltaCursor *cursor, u8 *data, u64 bytesize, u64 baseline_bytesize) {
+  u64 common = bytesize < baseline_bytesize ? bytesize : baseline_bytesize;
+
+  // Runs follow byte sized payloads so they are copied out unaligned
+  u32 run_count = 0;
+  const void *run_count_ptr = cursorRead(cursor, sizeof(u32));
+  if (run_count_ptr) {
+    memcpy(&run_count, run_count_ptr, sizeof(u32));
+  }
+
+  for (u32 i = 0; cursor->ok && i < run_count; i++) {
+    DeltaRun run;
+    const void *run_ptr = cursorRead(cursor, sizeof(DeltaRun));
+    if (!run_ptr) {
+      return;
+    }
+    memcpy(&run, run_ptr, sizeof(DeltaRun));
+
+    u64 run_offset = (u64)run.first_chunk * DELTA_CHUNK_BYTES;
+    u64 run_end = run_offset + (u64)run.chunk_count * DELTA_CHUNK_BYTES;
+    if (run_end > common) {
+      run_end = common;
+    }
+    const u8 *xor = run_offset < run_end ?
+      cursorRead(cursor, run_end - run_offset) : NULL;
+    cursor->ok = cursor->ok && run_offset < run_end;
+
+    for (u64 j = run_offset; data && cursor->ok && j < run_end; j++) {
+      data[j] ^= xor[j - run_offset];
+    }
+  }
+
+  if (cursor->ok && bytesize > common) {
+    const u8 *tail = cursorRead(cursor, bytesize - common);
+    if (data && tail) {
+      memcpy(data + common, tail, bytesize - common);
+    }
+  }
+}
+
+static int deltaCompareMasks(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(Bitmask));
+}
+
+// Whether the archetype masks of a delta are all different, a repeated one
+// would make getOrCreateArchetype return an earlier archetype
+static bool deltaMasksDistinct(const SnapshotArchetype *types, u32 type_count) {
+  Bitmask *masks = malloc(sizeof(Bitmask) * type_count);
+  if (!masks) {
+    return false;
+  }
+  for (u32 i = 0; i < type_count; i++) {
+    masks[i] = types[i].component_mask;
+  }
+  qsort(masks, type_count, sizeof(Bitmask), deltaCompareMasks);
+
+  bool distinct = true;
+  for (u32 i = 1; distinct && i < type_count; i++) {
+    distinct = !bitmaskEquals(masks[i - 1], masks[i]);
+  }
+  free(masks);
+  return distinct;
+}
+
+// Walks the page and chunk blocks the way sceneApplyDelta does without
+// writing anything, so a delta is known to be whole before the scene changes.
+// Rows before the delta are the scene's, none for keyframes.
+static bool deltaCheckBlocks(
+    DeltaCursor cursor, Scene *scene, const DeltaHeader *header, const SnapshotArchetype *types) {
+  u32 page_count = ((u64)header->max_entity_id + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+  for (u32 i = 0; cursor.ok && i < page_count; i++) {
+    u32 old_records = header->keyframe ? 0 : sceneEntityPageRecords(scene, i);
+    u64 records = header->max_entity_id - ((u64)i << ENTITY_PAGE_SHIFT);
+    if (records > ENTITY_PAGE_SIZE) {
+      records = ENTITY_PAGE_SIZE;
+    }
+    if (!deltaSkipEmptyBlock(
+          &cursor, sizeof(EntityRecord) * records, sizeof(EntityRecord) * old_records)) {
+      deltaApplyBlock(
+          &cursor, NULL, sizeof(EntityRecord) * records, sizeof(EntityRecord) * old_records);
+    }
+  }
+
+  // Sizes come from the delta, so chunks are counted in 64 bits until a
+  // missing block stops the walk
+  for (u32 i = 0; cursor.ok && i < header->type_count; i++) {
+    u64 old_size = !header->keyframe && i < scene->type_count ? scene->types[i]->size : 0;
+    u64 size = types[i].size;
+    Bitmask mask = types[i].component_mask;
+
+    for (u64 j = 0; cursor.ok && j << CHUNK_SHIFT < size; j++) {
+      u64 first = j << CHUNK_SHIFT;
+      u64 rows = size - first < CHUNK_ROWS ? size - first : CHUNK_ROWS;
+      u64 old_rows = old_size > first ? old_size - first : 0;
+      old_rows = old_rows < CHUNK_ROWS ? old_rows : CHUNK_ROWS;
+
+      if (!deltaSkipEmptyBlock(&cursor, sizeof(EntityID) * rows, sizeof(EntityID) * old_rows)) {
+        deltaApplyBlock(&cursor, NULL, sizeof(EntityID) * rows, sizeof(EntityID) * old_rows);
+      }
+      // Columns are in component id order
+      for (u32 k = 0; cursor.ok && k < MAX_COMPONENTS; k++) {
+        if (!getBit(mask, k)) {
+          continue;
+        }
+        size_t component_size = component_sizes[k];
+        if (!deltaSkipEmptyBlock(&cursor, component_size * rows, component_size * old_rows)) {
+          deltaApplyBlock(&cursor, NULL, component_size * rows, component_size * old_rows);
+        }
+      }
+    }
+  }
+  return cursor.ok;
+}
+
+bool sceneApplyDelta(Scene *scene, const u8 *delta, size_t bytesize) {
+  DeltaCursor cursor = {.data = delta, .offset = 0, .bytesize = bytesize, .ok = true};
+
+  const DeltaHeader *header = cursorRead(&cursor, sizeof(DeltaHeader));
+  if (!header || header->magic != DELTA_MAGIC) {
+    return false;
+  }
+
+  // Components have to be registered with the captured sizes
+  for (u32 i = 0; cursor.ok && i < header->component_count; i++) {
+    const SnapshotComponent *component = cursorRead(&cursor, sizeof(SnapshotComponent));
+    cursor.ok = component && component->id < MAX_COMPONENTS &&
+      component_sizes[component->id] && component_sizes[component->id] == component->size;
+  }
+
+  // Archetypes only ever get appended, the existing ones must line up
+  u32 kept_type_count = header->keyframe ? 0 : scene->type_count;
+  const SnapshotArchetype *types = cursorRead(
+      &cursor, sizeof(SnapshotArchetype) * header->type_count);
+  if (!cursor.ok || kept_type_count > header->type_count) {
+    return false;
+  }
+  for (u32 i = 0; i < header->type_count; i++) {
+    Bitmask mask = types[i].component_mask;
+    if (i < kept_type_count ?
+        !bitmaskEquals(scene->types[i]->component_mask, mask) : !snapshotCheckMask(mask)) {
+      return false;
+    }
+  }
+  if (kept_type_count < header->type_count &&
+      !deltaMasksDistinct(types, header->type_count)) {
+    return false;
+  }
+
+  cursorRead(&cursor, sizeof(EntityID) * (header->spawned_count + header->killed_count));
+
+  // Entity allocation state, the kept ids are the last ones of the current
+  // queue and stay where they are in the ring
+  u64 queued = header->keyframe ? 0 : scene->id_queue_head - scene->id_queue_tail;
+  if (header->free_kept_count > header->free_id_count || header->free_kept_count > queued) {
+    return false;
+  }
+  u32 pushed_count = header->free_id_count - header->free_kept_count;
+  const EntityID *free_ids = cursorRead(&cursor, sizeof(EntityID) * pushed_count);
+  if (!cursor.ok || !deltaCheckBlocks(cursor, scene, header, types)) {
+    return false;
+  }
+
+  // The delta is whole, nothing below fails
+  if (scene->trace) {
+    traceUntraced(scene->trace);
+  }
+  if (header->keyframe) {
+    sceneClear(scene);
+  }
+  for (u32 i = scene->type_count; i < header->type_count; i++) {
+    getOrCreateArchetype(scene, types[i].component_mask);
+  }
+
+  scene->id_queue_tail = scene->id_queue_head - header->free_kept_count;
+
+  if (header->free_id_count > scene->id_queue_cap) {
+    u64 new_cap = header->free_id_count > scene->id_queue_cap * 2 ?
+      header->free_id_count : scene->id_queue_cap * 2;
+    EntityID *new_queue = arenaAlloc(&scene->arena, sizeof(EntityID) * new_cap);
+    for (u32 i = 0; i < header->free_kept_count; i++) {
+      new_queue[i] = scene->id_queue[(scene->id_queue_tail + i) % scene->id_queue_cap];
+    }
+    scene->id_queue = new_queue;
+    scene->id_queue_cap = new_cap;
+    scene->id_queue_tail = 0;
+    scene->id_queue_head = header->free_kept_count;
+  }
+  for (u32 i = 0; i < pushed_count; i++) {
+    scene->id_queue[scene->id_queue_head % scene->id_queue_cap] = free_ids[i];
+    scene->id_queue_head++;
+  }
+
+  // Pages are only written when their block has changes, records past the
+  // old end are covered by the raw tails
+  sceneReserveEntities(scene, header->max_entity_id);
+
+  u32 page_count = ((u64)header->max_entity_id + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+  for (u32 i = 0; cursor.ok && i < page_count; i++) {
+    u32 old_records = sceneEntityPageRecords(scene, i);
+    u64 first = (u64)i << ENTITY_PAGE_SHIFT;
+    u64 records = header->max_entity_id - first;
+    if (records > ENTITY_PAGE_SIZE) {
+      records = ENTITY_PAGE_SIZE;
+    }
+
+    if (!deltaSkipEmptyBlock(
+          &cursor, sizeof(EntityRecord) * records, sizeof(EntityRecord) * old_records)) {
+      deltaApplyBlock(
+          &cursor, (u8*)sceneWriteRecord(scene, first),
+          sizeof(EntityRecord) * records, sizeof(EntityRecord) * old_records);
+    }
+  }
+  scene->max_entity_id = header->max_entity_id;
+
+  // Chunks, written on their first changed block. Chunks whose row count
+  // changes are stamped even when unchanged otherwise.
+  for (u32 i = 0; cursor.ok && i < header->type_count; i++) {
+    Archetype *type = scene->types[i];
+    u64 size = types[i].size;
+    archetypeReserve(type, size);
+
+    u32 old_chunk_count = archetypeActiveChunks(type);
+    u32 chunk_count = (size + CHUNK_ROWS - 1) >> CHUNK_SHIFT;
+
+    for (u32 j = 0; cursor.ok && j < chunk_count; j++) {
+      u32 old_rows = archetypeChunkRows(type, j);
+      u64 rows = size - ((u64)j << CHUNK_SHIFT);
+      if (rows > CHUNK_ROWS) {
+        rows = CHUNK_ROWS;
+      }
+      ArchetypeChunk *chunk = NULL;
+
+      if (!deltaSkipEmptyBlock(&cursor, sizeof(EntityID) * rows, sizeof(EntityID) * old_rows)) {
+        chunk = archetypeWriteChunk(type, j);
+        deltaApplyBlock(
+            &cursor, (u8*)chunkGetEntities(chunk),
+            sizeof(EntityID) * rows, sizeof(EntityID) * old_rows);
+      }
+
+      for (u8 k = 0; cursor.ok && k < type->component_count; k++) {
+        size_t component_size = component_sizes[type->component_id[k]];
+        if (deltaSkipEmptyBlock(&cursor, component_size * rows, component_size * old_rows)) {
+          continue;
+        }
+        chunk = chunk ? chunk : archetypeWriteChunk(type, j);
+        deltaApplyBlock(
+            &cursor, chunkGetColumn(type, chunk, k),
+            component_size * rows, component_size * old_rows);
+      }
+
+      if (!chunk && rows != old_rows) {
+        archetypeTouchChunk(type, j);
+      }
+    }
+    for (u32 j = chunk_count; j < old_chunk_count; j++) {
+      archetypeTouchChunk(type, j);
+    }
+    type->size = size;
+  }
+  return cursor.ok;
+}
+
+const EntityID *deltaGetSpawned(const u8 *delta, u32 *count) {
+  const DeltaHeader *header = (const DeltaHeader*)delta;
+  *count = header->spawned_count;
+
+  return (const EntityID*)(
+      delta + sizeof(DeltaHeader) +
+      sizeof(SnapshotComponent) * header->component_count +
+      sizeof(SnapshotArchetype) * header->type_count);
+}
+
+const EntityID *deltaGetKilled(const u8 *delta, u32 *count) {
+  u32 spawned_count;
+  const EntityID *spawned = deltaGetSpawned(delta, &spawned_count);
+  *count = ((const DeltaHeader*)delta)->killed_count;
+
+  return spawned + spawned_count;
+}
@@ -0,0 +1,65 @@
+#ifndef ECS_DELTA_H
+#define ECS_DELTA_H
+#include "ecs/snapshot.h"
+
+// Delta snapshots, a scene's changes since the previous capture. Every entity
+// page and chunk column is compared in DELTA_CHUNK_BYTES chunks against a
+// baseline copy of the scene; runs of changed chunks are stored XORed with the
+// baseline, rows past the baseline's end are stored raw. Entities spawned and
+// killed since the baseline are listed for tools like replay recorders. The
+// free id queue is stored as the baseline queue's ids still queued plus the
+// ids queued since. The first capture has nothing to compare against and is
+// a keyframe.
+#define DELTA_MAGIC 0x44534345 // "ECSD"
+#define DELTA_CHUNK_BYTES 64
+
+typedef struct {
+  u32 magic;
+  u32 keyframe;
+  u32 component_count, type_count;
+  EntityID max_entity_id;
+  u32 free_id_count, free_kept_count;
+  u32 spawned_count, killed_count;
+  u32 padding; // Keeps the archetype table 8 byte aligned
+} DeltaHeader;
+_Static_assert(sizeof(DeltaHeader) % 8 == 0, "Delta archetype tables would be misaligned.");
+
+typedef struct {
+  u32 first_chunk, chunk_count;
+} DeltaRun;
+
+// Keeps the baseline scene, delta/delta_bytesize hold the last capture.
+// Pages and chunks the source scene hasn't written since its version at the
+// last capture are skipped without comparing.
+typedef struct {
+  Scene baseline;
+  u8 *delta;
+  size_t delta_bytesize, delta_cap;
+
+  // Scene id (see Scene) and version at the last capture, with the counts
+  // of its free id queue
+  u64 source_id;
+  u64 source_version;
+  u64 source_id_tail, source_id_head;
+} DeltaRecorder;
+
+void deltaRecorderInit(DeltaRecorder *recorder, size_t arena_block_size);
+void deltaRecorderDeinit(DeltaRecorder *recorder);
+
+// Encodes the changes of scene since the last capture and moves the baseline
+// up to it. Starts over with a keyframe when the scene's archetypes no longer
+// extend the baseline's (e.g. after sceneClear).
+void deltaCapture(DeltaRecorder *recorder, Scene *scene);
+
+// Brings a scene holding the capture's baseline state up to the captured one.
+// Keyframes apply to any scene. Returns false on malformed deltas, deltas of
+// components not registered with the captured sizes, or ones that don't
+// extend the scene, leaving the scene as it was: deltas are checked whole
+// before anything is written.
+bool sceneApplyDelta(Scene *scene, const u8 *delta, size_t bytesize);
+
+// Spawned and killed entity lists of a capture
+const EntityID *deltaGetSpawned(const u8 *delta, u32 *count);
+const EntityID *deltaGetKilled(const u8 *delta, u32 *count);
+
+#endif
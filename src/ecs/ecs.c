@@ -1,10 +1,22 @@
 #include "ecs.h"
+#include "ecs/rollback.h"
+#include "ecs/trace.h"
+#include "ecs/cold.h"
+#include "ecs/profile.h"
+#include <pthread.h>
+#include <sys/mman.h>
 
 // Globals
 size_t component_sizes[MAX_COMPONENTS] = {0};
-Scene *current_scene = NULL;
-Bitmask lcl_bitmask;
+_Thread_local Scene *current_scene = NULL;
 Arena ecs_arena;
+u64 scene_id_counter = 0;
+
+// Archetype registry, every distinct component mask is laid out once and the
+// layout is shared by all scenes. Guarded since scenes may live on other threads.
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+Archetype **registry_map = NULL;
+u32 registry_count = 0, registry_map_cap = 0;
 
 // Archetypes
 void archetypeInit(Arena *arena, Archetype *type, Bitmask mask) {
@@ -13,16 +25,16 @@ void archetypeInit(Arena *arena, Archetype *type, Bitmask mask) {
   u8 component_id_range = bitmaskHighestFlag(&mask) - lowest_component_id + 1;
 
   *type = (Archetype) {
-    .arena = arena,
-      .component_arrays = arenaAlloc(arena, sizeof(void*) * component_count),
-      .entity_index = arenaAlloc(arena, sizeof(u32) * MAX_ENTITIES),
+    .scene = NULL,
+      .chunks = NULL,
+      .chunk_count = 0,
+      .chunk_cap = 0,
       .component_id = arenaAlloc(arena, sizeof(ComponentID) * component_count),
       .component_index = arenaAlloc(arena, sizeof(u8) * component_id_range),
-      .entities = NULL,
+      .column_offsets = arenaAlloc(arena, sizeof(u32) * component_count),
 
       .component_count = component_count,
       .lowest_component_id = lowest_component_id,
-      .cap = 0,
       .size = 0
   };
 
@@ -36,76 +48,334 @@ void archetypeInit(Arena *arena, Archetype *type, Bitmask mask) {
     component_id++;
   }
 
-  bitmaskInitCpy(arena, &type->component_mask, &mask);
+  // Entity ids first, then the columns, offsets are per row of capacity
+  u32 offset = sizeof(EntityID);
+  for (i = 0; i < component_count; i++) {
+    type->column_offsets[i] = offset;
+    offset += component_sizes[type->component_id[i]];
+  }
+  type->row_bytesize = offset;
+
+  type->component_mask = mask;
 }
 
-void archetypeResize(Archetype *type) {
-  Arena *arena = type->arena;
+// Open addressing insert, map capacity is a power of two
+void archetypeMapInsert(Archetype **map, u32 map_cap, Archetype *type) {
+  u64 hash = bitmaskHash(&type->component_mask);
+  while (map[hash & (map_cap - 1)]) {
+    hash++;
+  }
+  map[hash & (map_cap - 1)] = type;
+}
 
-  size_t old_cap = type->cap;
-  if (old_cap) {
-    type->cap *= 2;
-  } else {
-    type->cap = 1;
+Archetype *archetypeMapFind(Archetype **map, u32 map_cap, Bitmask *mask) {
+  if (!map_cap) {
+    return NULL;
   }
+  u64 hash = bitmaskHash(mask);
+  Archetype *type;
 
-  // Copying over required
-  if (old_cap) {
-    ComponentID component_id;
-    for (u8 i = 0; i < type->component_count; i++) {
-      component_id = type->component_id[i];
+  while ((type = map[hash & (map_cap - 1)])) {
+    if (bitmaskEquals(type->component_mask, *mask)) {
+      return type;
+    }
+    hash++;
+  }
+  return NULL;
+}
 
-      void *new_arr = arenaAlloc(
-          arena, component_sizes[component_id] * type->cap);
+// Rehashes into a map twice the size when over half full
+Archetype **archetypeMapReserve(
+    Arena *arena, Archetype **map, u32 *map_cap, u32 count) {
 
-      memcpy(
-          new_arr, type->component_arrays[i],
-          component_sizes[component_id] * old_cap);
+  if ((count + 1) * 2 <= *map_cap) {
+    return map;
+  }
+  u32 new_cap = *map_cap ? *map_cap * 2 : 16;
+  Archetype **new_map = arenaAlloc(arena, sizeof(Archetype*) * new_cap);
+  memset(new_map, 0, sizeof(Archetype*) * new_cap);
+
+  for (u32 i = 0; i < *map_cap; i++) {
+    if (map[i]) {
+      archetypeMapInsert(new_map, new_cap, map[i]);
+    }
+  }
+  *map_cap = new_cap;
+  return new_map;
+}
+
+Archetype *registryGetLayout(Bitmask mask) {
+  pthread_mutex_lock(&registry_lock);
+
+  Archetype *layout = archetypeMapFind(registry_map, registry_map_cap, &mask);
+  if (!layout) {
+    registry_map = archetypeMapReserve(
+        &ecs_arena, registry_map, &registry_map_cap, registry_count);
 
-      type->component_arrays[i] = new_arr;
+    layout = arenaAlloc(&ecs_arena, sizeof(Archetype));
+    archetypeInit(&ecs_arena, layout, mask);
+    archetypeMapInsert(registry_map, registry_map_cap, layout);
+    registry_count++;
+  }
+
+  pthread_mutex_unlock(&registry_lock);
+  return layout;
+}
+
+// Freed blocks are kept in a list threaded through the blocks themselves
+typedef struct {
+  u8 *next;
+  size_t bytesize;
+} FreeChunk;
+
+void sceneFreeChunkData(Scene *scene, u8 *data, size_t bytesize);
+
+u8 *sceneAllocChunkData(Scene *scene, size_t bytesize) {
+  if (__atomic_load_n(&scene->returned_chunks, __ATOMIC_RELAXED)) {
+    u8 *returned = __atomic_exchange_n(&scene->returned_chunks, NULL, __ATOMIC_ACQUIRE);
+    while (returned) {
+      FreeChunk *block = (FreeChunk*)returned;
+      returned = block->next;
+      sceneFreeChunkData(scene, (u8*)block, block->bytesize);
     }
-    EntityID *new_arr = arenaAlloc(arena, sizeof(EntityID) * type->cap);
-    memcpy(new_arr, type->entities, sizeof(EntityID) * old_cap);
-    type->entities = new_arr;
+  }
 
-    // Copying over not required
+  u8 **link = &scene->free_chunks;
+  while (*link) {
+    FreeChunk *block = (FreeChunk*)*link;
+    if (block->bytesize == bytesize) {
+      u8 *data = *link;
+      *link = block->next;
+      return data;
+    }
+    link = &block->next;
+  }
+  return arenaAlloc(&scene->arena, bytesize);
+}
+
+void sceneFreeChunkData(Scene *scene, u8 *data, size_t bytesize) {
+  // Blocks inside a mapped snapshot aren't the arena's
+  u8 *mapping = scene->mapping;
+  if (!data || bytesize < sizeof(FreeChunk) ||
+      (mapping && data >= mapping && data < mapping + scene->mapping_bytesize)) {
+    return;
+  }
+  *(FreeChunk*)data = (FreeChunk) {.next = scene->free_chunks, .bytesize = bytesize};
+  scene->free_chunks = data;
+}
+
+u32 sceneFreeChunkStats(Scene *scene, size_t *bytesize) {
+  u32 count = 0;
+  *bytesize = 0;
+  for (u8 *block = scene->free_chunks; block; block = ((FreeChunk*)block)->next) {
+    *bytesize += ((FreeChunk*)block)->bytesize;
+    count++;
+  }
+  // Other threads only ever push in front of the head read here
+  u8 *returned = __atomic_load_n(&scene->returned_chunks, __ATOMIC_ACQUIRE);
+  for (u8 *block = returned; block; block = ((FreeChunk*)block)->next) {
+    *bytesize += ((FreeChunk*)block)->bytesize;
+    count++;
+  }
+  return count;
+}
+
+// Hands a block back to the scene whose arena holds it, from any thread
+static void sceneReturnChunkData(Scene *home, u8 *data, size_t bytesize) {
+  if (!data || bytesize < sizeof(FreeChunk)) {
+    return;
+  }
+  FreeChunk *block = (FreeChunk*)data;
+  block->bytesize = bytesize;
+  block->next = __atomic_load_n(&home->returned_chunks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(
+        &home->returned_chunks, &block->next, data, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Counts one more owner of a block, the first fork creates the share
+static ChunkShare *shareAcquire(ChunkShare **link, Scene *home) {
+  if (!*link) {
+    *link = malloc(sizeof(ChunkShare));
+    **link = (ChunkShare) {.owners = 1, .home = home};
+  }
+  __atomic_add_fetch(&(*link)->owners, 1, __ATOMIC_RELAXED);
+  return *link;
+}
+
+// Whether scene is the last owner left so it can write in place, the share
+// is dropped once the block is in its own arena too
+static bool shareSole(Scene *scene, ChunkShare **link) {
+  ChunkShare *share = *link;
+  if (__atomic_load_n(&share->owners, __ATOMIC_ACQUIRE) != 1) {
+    return false;
+  }
+  if (share->home == scene) {
+    free(share);
+    *link = NULL;
+  }
+  return true;
+}
+
+// Lets go of a block, the last owner frees it into its home scene
+static void shareRelease(Scene *scene, ChunkShare *share, u8 *data, size_t bytesize) {
+  if (!share) {
+    sceneFreeChunkData(scene, data, bytesize);
+    return;
+  }
+  if (__atomic_sub_fetch(&share->owners, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  Scene *home = share->home;
+  free(share);
+  if (home == scene) {
+    sceneFreeChunkData(scene, data, bytesize);
   } else {
-    ComponentID component_id;
+    sceneReturnChunkData(home, data, bytesize);
+  }
+}
+
+// Gives a chunk a new block with room for cap rows, moving its first rows over.
+// The old block is freed once no other scene shares it. A growing chunk that
+// is the arena's last allocation grows in place, columns move up from the last
+// one down so none overwrites the next.
+static void chunkRelocate(Archetype *type, ArchetypeChunk *chunk, u32 rows, u32 cap) {
+  Scene *scene = type->scene;
+  if (!chunk->share && arenaExtend(
+        &scene->arena, chunk->data,
+        (size_t)chunk->cap * type->row_bytesize, (size_t)cap * type->row_bytesize)) {
+    for (u8 i = type->component_count; i-- > 0;) {
+      memmove(
+          chunk->data + (size_t)cap * type->column_offsets[i],
+          chunkGetColumn(type, chunk, i),
+          component_sizes[type->component_id[i]] * rows);
+    }
+    chunk->cap = cap;
+    return;
+  }
+
+  u8 *data = sceneAllocChunkData(scene, (size_t)cap * type->row_bytesize);
+
+  if (rows) {
+    memcpy(data, chunk->data, sizeof(EntityID) * rows);
     for (u8 i = 0; i < type->component_count; i++) {
-      component_id = type->component_id[i];
+      memcpy(
+          data + (size_t)cap * type->column_offsets[i],
+          chunkGetColumn(type, chunk, i),
+          component_sizes[type->component_id[i]] * rows);
+    }
+  }
+  shareRelease(scene, chunk->share, chunk->data, (size_t)chunk->cap * type->row_bytesize);
+  chunk->data = data;
+  chunk->cap = cap;
+  chunk->share = NULL;
+}
+
+void archetypeTouchChunk(Archetype *type, u32 chunk_index) {
+  Scene *scene = type->scene;
+  if (scene->history) {
+    historyRecordChunk(scene->history, type, chunk_index);
+  }
+  type->chunks[chunk_index].version = ++scene->version;
+}
+
+ArchetypeChunk *archetypeWriteChunk(Archetype *type, u32 chunk_index) {
+  ArchetypeChunk *chunk = archetypeReadChunk(type, chunk_index);
+  if (chunk->share && !shareSole(type->scene, &chunk->share)) {
+    chunkRelocate(type, chunk, archetypeChunkRows(type, chunk_index), chunk->cap);
+  }
+  archetypeTouchChunk(type, chunk_index);
+  return chunk;
+}
+
+static void archetypeReserveChunks(Archetype *type, u32 chunk_count) {
+  if (chunk_count > type->chunk_cap) {
+    u32 new_cap = type->chunk_cap ? type->chunk_cap * 2 : 1;
+    if (new_cap < chunk_count) {
+      new_cap = chunk_count;
+    }
+    type->chunks = arenaRealloc(
+        &type->scene->arena, type->chunks,
+        sizeof(ArchetypeChunk) * type->chunk_cap, sizeof(ArchetypeChunk) * new_cap);
+    type->chunk_cap = new_cap;
+  }
+
+  while (type->chunk_count < chunk_count) {
+    type->chunks[type->chunk_count++] = (ArchetypeChunk) {0};
+  }
+}
+
+// Only the first chunk grows gradually, later ones start out full sized
+void archetypeReserve(Archetype *type, u64 cap) {
+  u32 chunk_count = (cap + CHUNK_ROWS - 1) >> CHUNK_SHIFT;
+  archetypeReserveChunks(type, chunk_count);
+
+  // Chunks before the one holding the last row are already full sized
+  for (u32 i = type->size >> CHUNK_SHIFT; i < chunk_count; i++) {
+    ArchetypeChunk *chunk = &type->chunks[i];
+    u64 rows = cap - ((u64)i << CHUNK_SHIFT);
+    if (rows > CHUNK_ROWS) {
+      rows = CHUNK_ROWS;
+    }
+    if (chunk->cap >= rows) {
+      continue;
+    }
 
-      type->component_arrays[i] = arenaAlloc(
-          arena, component_sizes[component_id] * type->cap);
+    // Doubling covers rows added one at a time, bulk reserves get the rows
+    // asked for rounded up to CHUNK_MIN_CAP
+    u32 new_cap = i ? CHUNK_ROWS : (chunk->cap ? chunk->cap * 2 : CHUNK_MIN_CAP);
+    if (new_cap < rows) {
+      new_cap = (rows + CHUNK_MIN_CAP - 1) & ~(CHUNK_MIN_CAP - 1);
     }
-    type->entities = arenaAlloc(arena, sizeof(EntityID) * type->cap);
+    if (new_cap > CHUNK_ROWS) {
+      new_cap = CHUNK_ROWS;
+    }
+    archetypeThawChunk(type, i);
+    chunkRelocate(type, chunk, archetypeChunkRows(type, i), new_cap);
+    archetypeTouchChunk(type, i);
   }
 }
 
-void archetypeRemoveEntity(Archetype *type, EntityID entity) {
+void archetypeSetChunk(Archetype *type, u32 chunk_index, u8 *data, u32 cap) {
+  archetypeReserveChunks(type, chunk_index + 1);
+  type->chunks[chunk_index] = (ArchetypeChunk) {
+    .data = data,
+      .cap = cap,
+      .share = NULL,
+      .version = ++type->scene->version,
+      .access = type->scene->clock
+  };
+}
+
+// Swap removes the row, the caller fixes the index of the entity moved into it
+void archetypeRemoveEntity(Archetype *type, u32 to_index) {
   // Overwrite all data by last entity and decrement type->size
-  u32 to_index = type->entity_index[entity];
   u32 from_index = type->size - 1; // Last entity
-  EntityID from_entity = type->entities[from_index];
+  ArchetypeChunk *from = archetypeReadChunk(type, from_index >> CHUNK_SHIFT);
 
-  // Last entity, no need for moving memory
+  // Last entity, no need for moving memory. The chunk shrinks so it still
+  // counts as written.
   if (to_index == from_index) {
+    archetypeTouchChunk(type, from_index >> CHUNK_SHIFT);
     type->size--;
     return;
   }
 
-  for (u8 i = 0; i < type->component_count; i++) {
-    void *component_arr = type->component_arrays[i];
-    ComponentID component_id = type->component_id[i];
-    size_t component_size = component_sizes[component_id];
+  ArchetypeChunk *to = archetypeWriteChunk(type, to_index >> CHUNK_SHIFT);
+  if (from != to) {
+    archetypeTouchChunk(type, from_index >> CHUNK_SHIFT);
+  }
+  u32 from_row = from_index & (CHUNK_ROWS - 1), to_row = to_index & (CHUNK_ROWS - 1);
 
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t component_size = component_sizes[type->component_id[i]];
 
     memcpy(
-        component_arr + component_size * to_index,
-        component_arr + component_size * from_index,
+        chunkGetColumn(type, to, i) + component_size * to_row,
+        chunkGetColumn(type, from, i) + component_size * from_row,
         component_size);
   }
-  type->entities[to_index] = type->entities[from_index];
-  type->entity_index[from_entity] = to_index;
+  chunkGetEntities(to)[to_row] = chunkGetEntities(from)[from_row];
   type->size--;
 }
 
@@ -113,21 +383,27 @@ u8 archetypeGetComponentIndex(Archetype *type, ComponentID id) {
   return type->component_index[id - type->lowest_component_id];
 }
 
-void archetypeInsertEntityID(Archetype *type, EntityID entity) {
-  if (type->size >= type->cap) {
-    archetypeResize(type);
+u32 archetypeInsertEntityID(Archetype *type, EntityID entity) {
+  u32 chunk_index = type->size >> CHUNK_SHIFT;
+  if (chunk_index >= type->chunk_count
+      || (type->size & (CHUNK_ROWS - 1)) >= type->chunks[chunk_index].cap) {
+    archetypeReserve(type, type->size + 1);
   }
-  type->entities[type->size] = entity;
-  type->entity_index[entity] = type->size;
+  ArchetypeChunk *chunk = archetypeWriteChunk(type, chunk_index);
+  chunkGetEntities(chunk)[type->size & (CHUNK_ROWS - 1)] = entity;
 
-  type->size++;
+  return type->size++;
 }
 
-void archetypeMoveEntity(Archetype *from, Archetype *to, EntityID entity) {
-  archetypeInsertEntityID(to, entity);
+// Returns the index of the entity in the new type
+u32 archetypeMoveEntity(Archetype *from, Archetype *to, u32 entity_index_from) {
+  ArchetypeChunk *from_chunk = archetypeReadChunk(from, entity_index_from >> CHUNK_SHIFT);
+  u32 from_row = entity_index_from & (CHUNK_ROWS - 1);
 
-  u32 entity_index_from = from->entity_index[entity],
-  entity_index_to = to->entity_index[entity];
+  u32 entity_index_to = archetypeInsertEntityID(
+      to, chunkGetEntities(from_chunk)[from_row]);
+  ArchetypeChunk *to_chunk = &to->chunks[entity_index_to >> CHUNK_SHIFT];
+  u32 to_row = entity_index_to & (CHUNK_ROWS - 1);
 
   // Copy over shared components (function assumes the bigger type has all the components of smaller type)
   Archetype *smaller_type = from->component_count < to->component_count ?
@@ -140,119 +416,458 @@ void archetypeMoveEntity(Archetype *from, Archetype *to, EntityID entity) {
     size_t comp_size = component_sizes[component_id];
 
     memcpy(
-        to->component_arrays[comp_index_to] + comp_size * entity_index_to,
-        from->component_arrays[comp_index_from] + comp_size * entity_index_from,
+        chunkGetColumn(to, to_chunk, comp_index_to) + comp_size * to_row,
+        chunkGetColumn(from, from_chunk, comp_index_from) + comp_size * from_row,
         comp_size);
   }
 
   // Remove entity from old type
-  archetypeRemoveEntity(from, entity);
+  archetypeRemoveEntity(from, entity_index_from);
+  return entity_index_to;
 }
 
 // Scenes
-void sceneInit(Scene *scene) {
+void sceneInit(Scene *scene, size_t arena_block_size) {
+  arenaInit(&scene->arena, arena_block_size);
+  scene->mapping = NULL;
+  scene->history = NULL;
+  scene->trace = NULL;
+  scene->version = 0;
+  scene->id = __atomic_add_fetch(&scene_id_counter, 1, __ATOMIC_RELAXED);
+  scene->clock = 0;
+  scene->cold_count = 0;
+  scene->type_count = 0;
+  scene->entity_page_count = 0;
+  sceneClear(scene);
+}
+
+// Lets go of every chunk and page still shared with other scenes
+static void sceneReleaseShares(Scene *scene) {
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    for (u32 j = 0; j < type->chunk_count; j++) {
+      ArchetypeChunk *chunk = &type->chunks[j];
+      if (chunk->share) {
+        shareRelease(scene, chunk->share, chunk->data, (size_t)chunk->cap * type->row_bytesize);
+      }
+    }
+  }
+  for (u32 i = 0; i < scene->entity_page_count; i++) {
+    EntityPage *page = &scene->entity_pages[i];
+    if (page->share) {
+      shareRelease(scene, page->share, (u8*)page->records, sizeof(EntityRecord) * page->cap);
+    }
+  }
+}
+
+// Drops every entity and archetype in O(1), arena memory is kept for reuse.
+// Queries are global so they stay valid. The version keeps counting so
+// chunks written after a clear are never mistaken for older ones, history
+// stays enabled but loses its frames and traces keep recording.
+void sceneClear(Scene *scene) {
+  coldRelease(scene);
+  sceneReleaseShares(scene);
+  arenaReset(&scene->arena);
+  if (scene->mapping) {
+    munmap(scene->mapping, scene->mapping_bytesize);
+  }
+  if (scene->history) {
+    historyClear(scene->history);
+  }
+  if (scene->trace) {
+    traceClear(scene->trace);
+  }
+
   (*scene) = (Scene) {
-    .arena = &ecs_arena,
+    .arena = scene->arena,
+      .current_archetype = NULL,
+      .current_chunk = 0,
+      .version = scene->version,
+      .id = scene->id,
+      .history = scene->history,
+      .trace = scene->trace,
+      .clock = scene->clock,
+      .cold_count = 0,
+      .free_chunks = NULL,
+      .returned_chunks = NULL,
+
+      .types = NULL,
+      .type_map = NULL,
+      .type_count = 0,
+      .type_cap = 0,
+      .type_map_cap = 0,
+
+      .component_types = NULL,
+      .component_types_cap = 0,
+
+      .entity_pages = NULL,
+      .entity_page_count = 0,
+      .entity_page_cap = 0,
+      .max_entity_id = 0,
+
+      .id_queue = NULL,
       .id_queue_tail = 0,
       .id_queue_head = 0,
-      .type_count = 0,
-      .max_entity_id = 0
+      .id_queue_cap = 0,
+
+      .mapping = NULL,
+      .mapping_bytesize = 0
   };
+}
 
-  for (u32 i = 0; i < MAX_ARCHETYPES; i++) {
-    scene->type_map[i] = NULL;
+// Returns all memory, the scene must be initialized again before reuse
+void sceneDestroy(Scene *scene) {
+  coldRelease(scene);
+  sceneReleaseShares(scene);
+  sceneDisableHistory(scene);
+  sceneTraceEnd(scene);
+  arenaFree(&scene->arena);
+  if (scene->mapping) {
+    munmap(scene->mapping, scene->mapping_bytesize);
+    scene->mapping = NULL;
   }
-  for (u32 i = 0; i < MAX_ENTITIES; i++) {
-    scene->entity_type[i] = NULL;
+  if (current_scene == scene) {
+    current_scene = NULL;
   }
+}
 
+// Pages come from the chunk block allocator so freed ones get reused
+static void entityPageRelocate(Scene *scene, EntityPage *page, u32 records, u32 cap) {
+  if (!page->share && arenaExtend(
+        &scene->arena, page->records,
+        sizeof(EntityRecord) * page->cap, sizeof(EntityRecord) * cap)) {
+    page->cap = cap;
+    return;
+  }
+  EntityRecord *new_records = (EntityRecord*)sceneAllocChunkData(scene, sizeof(EntityRecord) * cap);
+  if (records) {
+    memcpy(new_records, page->records, sizeof(EntityRecord) * records);
+  }
+  shareRelease(scene, page->share, (u8*)page->records, sizeof(EntityRecord) * page->cap);
+  page->records = new_records;
+  page->cap = cap;
+  page->share = NULL;
 }
 
-EntityID newEntity() {
-  // Queue empty
-  if (current_scene->id_queue_head == current_scene->id_queue_tail) {
-    return current_scene->max_entity_id++;
+static void sceneTouchPage(Scene *scene, u32 page_index) {
+  if (scene->history) {
+    historyRecordPage(scene->history, scene, page_index);
   }
+  scene->entity_pages[page_index].version = ++scene->version;
+}
 
-  return current_scene->id_queue[(current_scene->id_queue_tail++) % MAX_FREE_IDS];
+EntityRecord *sceneWriteRecord(Scene *scene, EntityID entity) {
+  u32 page_index = entity >> ENTITY_PAGE_SHIFT;
+  EntityPage *page = &scene->entity_pages[page_index];
+
+  if (page->share && !shareSole(scene, &page->share)) {
+    entityPageRelocate(scene, page, sceneEntityPageRecords(scene, page_index), page->cap);
+  }
+  sceneTouchPage(scene, page_index);
+  return &page->records[entity & (ENTITY_PAGE_SIZE - 1)];
 }
 
-Archetype *createArchetype(Scene *scene, Bitmask mask) {
-  Archetype *type = &scene->types[scene->type_count];
-  archetypeInit(scene->arena, type, mask);
+static void sceneReserveEntityPages(Scene *scene, u32 page_count) {
+  if (page_count > scene->entity_page_cap) {
+    u32 new_cap = scene->entity_page_cap ? scene->entity_page_cap * 2 : 4;
+    if (new_cap < page_count) {
+      new_cap = page_count;
+    }
+    scene->entity_pages = arenaRealloc(
+        &scene->arena, scene->entity_pages,
+        sizeof(EntityPage) * scene->entity_page_cap, sizeof(EntityPage) * new_cap);
+    scene->entity_page_cap = new_cap;
+  }
 
-  // Insert into map
-  u64 hash = mask.bits[0];
-  while (scene->type_map[hash % MAX_ARCHETYPES]) {
-    hash++;
+  while (scene->entity_page_count < page_count) {
+    scene->entity_pages[scene->entity_page_count++] = (EntityPage) {0};
   }
+}
 
-  scene->type_map[hash] = type;
-  scene->type_count++;
-  return type;
+// Same growth as chunks, only the first page grows gradually
+void sceneReserveEntities(Scene *scene, EntityID count) {
+  u32 page_count = ((u64)count + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+  sceneReserveEntityPages(scene, page_count);
+
+  for (u32 i = scene->max_entity_id >> ENTITY_PAGE_SHIFT; i < page_count; i++) {
+    EntityPage *page = &scene->entity_pages[i];
+    u64 records = (u64)count - ((u64)i << ENTITY_PAGE_SHIFT);
+    if (records > ENTITY_PAGE_SIZE) {
+      records = ENTITY_PAGE_SIZE;
+    }
+    if (page->cap >= records) {
+      continue;
+    }
+
+    u32 new_cap = i ? ENTITY_PAGE_SIZE : (page->cap ? page->cap * 2 : ENTITY_PAGE_MIN_CAP);
+    if (new_cap < records) {
+      new_cap = (records + ENTITY_PAGE_MIN_CAP - 1) & ~(ENTITY_PAGE_MIN_CAP - 1);
+    }
+    if (new_cap > ENTITY_PAGE_SIZE) {
+      new_cap = ENTITY_PAGE_SIZE;
+    }
+    entityPageRelocate(scene, page, sceneEntityPageRecords(scene, i), new_cap);
+    sceneTouchPage(scene, i);
+  }
 }
 
-Archetype *getOrCreateArchetype(Scene *scene, Bitmask mask) {
-  // Check if archetype is in map
-  u32 hash = mask.bits[0];
-  Archetype *type;
+void sceneSetEntityPage(Scene *scene, u32 page_index, EntityRecord *records, u32 cap) {
+  sceneReserveEntityPages(scene, page_index + 1);
+  scene->entity_pages[page_index] = (EntityPage) {
+    .records = records,
+      .cap = cap,
+      .share = NULL,
+      .version = ++scene->version
+  };
+}
 
-  while ((type = scene->type_map[hash % MAX_ARCHETYPES])) {
-    // Found the type, return it
-    if (bitmaskEquals(type->component_mask, mask)) {
-      return type;
+EntityID sceneNewEntity(Scene *scene) {
+  EntityID entity;
+
+  // Queue not empty, recycle
+  if (scene->id_queue_head != scene->id_queue_tail) {
+    entity = scene->id_queue[(scene->id_queue_tail++) % scene->id_queue_cap];
+  } else {
+    sceneReserveEntities(scene, scene->max_entity_id + 1);
+    *sceneWriteRecord(scene, scene->max_entity_id) =
+      (EntityRecord) {.type = ENTITY_NO_TYPE, .index = 0};
+    entity = scene->max_entity_id++;
+  }
+
+  if (scene->trace) {
+    traceNewEntity(scene->trace, entity);
+  }
+  return entity;
+}
+
+Archetype *createArchetype(Scene *scene, Bitmask mask) {
+  PROFILE_ZONE_BEGIN(create);
+  Arena *arena = &scene->arena;
+  Archetype *layout = registryGetLayout(mask);
+
+  // Shares the layout, owns the chunks
+  Archetype *type = arenaAlloc(arena, sizeof(Archetype));
+  *type = *layout;
+  type->scene = scene;
+
+  if (scene->type_count == scene->type_cap) {
+    u32 new_cap = scene->type_cap ? scene->type_cap * 2 : 8;
+    scene->types = arenaRealloc(
+        arena, scene->types,
+        sizeof(Archetype*) * scene->type_cap, sizeof(Archetype*) * new_cap);
+    scene->type_cap = new_cap;
+  }
+  scene->type_map = archetypeMapReserve(
+      arena, scene->type_map, &scene->type_map_cap, scene->type_count);
+
+  archetypeMapInsert(scene->type_map, scene->type_map_cap, type);
+  type->scene_index = scene->type_count;
+  scene->types[scene->type_count++] = type;
+
+  // Inverted index, component -> archetypes
+  u32 highest_component_id = type->component_id[type->component_count - 1];
+  if (highest_component_id >= scene->component_types_cap) {
+    u32 new_cap = scene->component_types_cap * 2;
+    if (new_cap <= highest_component_id) {
+      new_cap = highest_component_id + 1;
     }
-    // Continue search
-    hash++;
+    scene->component_types = arenaRealloc(
+        arena, scene->component_types,
+        sizeof(ArchetypeList) * scene->component_types_cap,
+        sizeof(ArchetypeList) * new_cap);
+    memset(
+        scene->component_types + scene->component_types_cap, 0,
+        sizeof(ArchetypeList) * (new_cap - scene->component_types_cap));
+    scene->component_types_cap = new_cap;
+  }
+
+  for (u8 i = 0; i < type->component_count; i++) {
+    ArchetypeList *list = &scene->component_types[type->component_id[i]];
+
+    if (list->count == list->cap) {
+      u32 new_cap = list->cap ? list->cap * 2 : 4;
+      list->types = arenaRealloc(
+          arena, list->types,
+          sizeof(Archetype*) * list->cap, sizeof(Archetype*) * new_cap);
+      list->cap = new_cap;
+    }
+    list->types[list->count++] = type;
+  }
+  PROFILE_ZONE_END(create, PROFILE_STRUCTURAL, "createArchetype", type->scene_index, 0);
+  return type;
+}
+
+inline Archetype *sceneGetEntityType(Scene *scene, EntityID entity) {
+  u32 type = sceneGetRecord(scene, entity)->type;
+  return type == ENTITY_NO_TYPE ? NULL : scene->types[type];
+}
+
+ArchetypeList *_sceneGetComponentTypes(Scene *scene, ComponentID component_id) {
+  static const ArchetypeList empty = {0};
+  if (component_id >= scene->component_types_cap) {
+    return (ArchetypeList*)&empty;
+  }
+  return &scene->component_types[component_id];
+}
+
+Archetype *getOrCreateArchetype(Scene *scene, Bitmask mask) {
+  Archetype *type = archetypeMapFind(scene->type_map, scene->type_map_cap, &mask);
+  if (type) {
+    return type;
   }
   return createArchetype(scene, mask);
 }
 
+// Entity id stored at a row, for fixing records after swap removes
+static EntityID archetypeGetEntity(Archetype *type, u32 index) {
+  return chunkGetEntities(archetypeReadChunk(type, index >> CHUNK_SHIFT))[index & (CHUNK_ROWS - 1)];
+}
+
 void _addComponent(Scene *scene, EntityID entity, ComponentID component_id) {
-  Archetype *old_type = scene->entity_type[entity];
+  PROFILE_ZONE_BEGIN(add);
+  if (scene->trace) {
+    traceAddComponent(scene->trace, entity, component_id);
+  }
+  EntityRecord record = *sceneGetRecord(scene, entity);
+  Archetype *old_type = sceneGetEntityType(scene, entity);
 
-  // Copy old type component mask if there is one
-  if (old_type) {
-    memcpy(
-        lcl_bitmask.bits, old_type->component_mask.bits,
-        lcl_bitmask.bytesize);
+  // Copy old type component mask if there is one, otherwise empty
+  Bitmask mask = old_type ? old_type->component_mask : (Bitmask) {0};
+  addBit(mask, component_id);
 
-    // No previous type, empty
-  } else {
-    memset(lcl_bitmask.bits, 0, lcl_bitmask.bytesize);
+  Archetype *new_type = getOrCreateArchetype(scene, mask);
+  if (new_type == old_type) {
+    return;
   }
-  addBit(lcl_bitmask, component_id);
-
-  Archetype *new_type = getOrCreateArchetype(scene, lcl_bitmask);
 
   // Move type from old to new if needed
   if (old_type) {
-    archetypeMoveEntity(old_type, new_type, entity);
+    u32 old_index = record.index;
+    record.index = archetypeMoveEntity(old_type, new_type, old_index);
 
+    // Fix up the entity swapped into the vacated row
+    if (old_index < old_type->size) {
+      sceneWriteRecord(scene, archetypeGetEntity(old_type, old_index))->index = old_index;
+    }
   } else {
-    archetypeInsertEntityID(new_type, entity);
+    record.index = archetypeInsertEntityID(new_type, entity);
   }
-  scene->entity_type[entity] = new_type;
+  record.type = new_type->scene_index;
+  *sceneWriteRecord(scene, entity) = record;
+  PROFILE_ZONE_END(add, PROFILE_STRUCTURAL, "addComponent", entity, component_id);
 }
 
 void *_getComponent(Scene *scene, EntityID entity, ComponentID component_id) {
-  Archetype *type = scene->entity_type[entity];
+  EntityRecord record = *sceneGetRecord(scene, entity);
+  Archetype *type = scene->types[record.type];
+  ArchetypeChunk *chunk = archetypeWriteChunk(type, record.index >> CHUNK_SHIFT);
 
   u8 comp_index = archetypeGetComponentIndex(type, component_id);
-  void *comp_arr = type->component_arrays[comp_index];
+  size_t component_size = component_sizes[component_id];
+
+  return chunkGetColumn(type, chunk, comp_index)
+    + component_size * (record.index & (CHUNK_ROWS - 1));
+}
 
+const void *_readComponent(Scene *scene, EntityID entity, ComponentID component_id) {
+  EntityRecord record = *sceneGetRecord(scene, entity);
+  Archetype *type = scene->types[record.type];
+  ArchetypeChunk *chunk = archetypeReadChunk(type, record.index >> CHUNK_SHIFT);
+
+  u8 comp_index = archetypeGetComponentIndex(type, component_id);
   size_t component_size = component_sizes[component_id];
-  u32 entity_index = type->entity_index[entity];
 
-  return comp_arr + component_size * entity_index;
+  return chunkGetColumn(type, chunk, comp_index)
+    + component_size * (record.index & (CHUNK_ROWS - 1));
+}
+
+void sceneKillEntity(Scene *scene, EntityID entity) {
+  PROFILE_ZONE_BEGIN(kill);
+  EntityRecord record = *sceneGetRecord(scene, entity);
+  Archetype *type = sceneGetEntityType(scene, entity);
+
+  if (type) {
+    archetypeRemoveEntity(type, record.index);
+    if (record.index < type->size) {
+      sceneWriteRecord(scene, archetypeGetEntity(type, record.index))->index = record.index;
+    }
+  }
+  sceneReleaseEntity(scene, entity);
+  PROFILE_ZONE_END(kill, PROFILE_STRUCTURAL, "killEntity", entity, 0);
+}
+
+void sceneReleaseEntity(Scene *scene, EntityID entity) {
+  if (scene->trace) {
+    traceKillEntity(scene->trace, entity);
+  }
+  *sceneWriteRecord(scene, entity) = (EntityRecord) {.type = ENTITY_NO_TYPE, .index = 0};
+
+  // Grow the free id ring, keeping queue order and the head and tail counts
+  // (delta captures tell queued and dequeued ids apart by them)
+  if (scene->id_queue_head - scene->id_queue_tail == scene->id_queue_cap) {
+    u64 new_cap = scene->id_queue_cap ? scene->id_queue_cap * 2 : 64;
+    EntityID *new_queue = arenaAlloc(&scene->arena, sizeof(EntityID) * new_cap);
+
+    for (u64 i = scene->id_queue_tail; i < scene->id_queue_head; i++) {
+      new_queue[i % new_cap] = scene->id_queue[i % scene->id_queue_cap];
+    }
+    scene->id_queue = new_queue;
+    scene->id_queue_cap = new_cap;
+  }
+
+  scene->id_queue[scene->id_queue_head % scene->id_queue_cap] = entity;
+  scene->id_queue_head++;
 }
 
-void killEntity(EntityID entity) {
-  archetypeRemoveEntity(current_scene->entity_type[entity], entity);
-  current_scene->entity_type[entity] = NULL;
+void sceneFork(Scene *fork, Scene *parent, size_t arena_block_size) {
+  sceneInit(fork, arena_block_size);
+  Arena *arena = &fork->arena;
+
+  // Same archetypes in the same order so records stay valid
+  for (u32 i = 0; i < parent->type_count; i++) {
+    Archetype *parent_type = parent->types[i];
+    Archetype *type = createArchetype(fork, parent_type->component_mask);
+
+    // Packed rows belong to one scene, cold chunks are unpacked to be shared
+    u32 chunk_count = archetypeActiveChunks(parent_type);
+    for (u32 j = 0; parent->cold_count && j < chunk_count; j++) {
+      archetypeThawChunk(parent_type, j);
+    }
+    if (chunk_count) {
+      type->chunks = arenaAlloc(arena, sizeof(ArchetypeChunk) * chunk_count);
+      memcpy(type->chunks, parent_type->chunks, sizeof(ArchetypeChunk) * chunk_count);
+    }
+    type->chunk_count = type->chunk_cap = chunk_count;
+    type->size = parent_type->size;
+
+    for (u32 j = 0; j < chunk_count; j++) {
+      type->chunks[j].share = shareAcquire(&parent_type->chunks[j].share, parent);
+    }
+  }
+
+  u32 page_count = (parent->max_entity_id + ENTITY_PAGE_SIZE - 1) >> ENTITY_PAGE_SHIFT;
+  if (page_count) {
+    fork->entity_pages = arenaAlloc(arena, sizeof(EntityPage) * page_count);
+    memcpy(fork->entity_pages, parent->entity_pages, sizeof(EntityPage) * page_count);
+  }
+  fork->entity_page_count = fork->entity_page_cap = page_count;
+  fork->max_entity_id = parent->max_entity_id;
+
+  for (u32 i = 0; i < page_count; i++) {
+    fork->entity_pages[i].share = shareAcquire(&parent->entity_pages[i].share, parent);
+  }
+
+  // Free ids are copied unrolled, the queue is small next to the pages
+  u64 free_count = parent->id_queue_head - parent->id_queue_tail;
+  if (free_count) {
+    fork->id_queue = arenaAlloc(arena, sizeof(EntityID) * free_count);
+    for (u64 i = 0; i < free_count; i++) {
+      fork->id_queue[i] = parent->id_queue[(parent->id_queue_tail + i) % parent->id_queue_cap];
+    }
+    fork->id_queue_cap = fork->id_queue_head = free_count;
+  }
 
-  current_scene->id_queue[current_scene->id_queue_head % MAX_FREE_IDS] = entity;
-  current_scene->id_queue_head++;
+  fork->version = parent->version;
 }
 
 void setCurrentScene(Scene *scene) {
@@ -263,54 +878,146 @@ Scene *getCurrentScene() {
   return current_scene;
 }
 
-// Queries
+// Queries (not tied to a scene, one query can be run on many scenes)
 void queryInit(ECSQuery *query) {
-  (*query) = (ECSQuery) {
-    .scene = current_scene,
-  };
-  bitmaskInit(current_scene->arena, &query->mask, MAX_COMPONENTS);
+  bitmaskClear(&query->mask);
 }
 
 void _queryRequire(ECSQuery *query, ComponentID component_id) {
   addBit(query->mask, component_id);
 }
 
-Archetype *current_archetype;
-inline void *_getComponentArray(ComponentID id) {
-  return current_archetype->component_arrays[
-    archetypeGetComponentIndex(current_archetype, id)];
+void queryIterInit(ECSQueryIter *iter, Scene *scene, ECSQuery *query) {
+  *iter = (ECSQueryIter) {
+    .scene = scene,
+      .query = query,
+      .rarest_component = MAX_COMPONENTS,
+      .index = 0
+  };
+
+  // Empty queries match everything and scan scene->types instead
+  u32 rarest_count = -1;
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    u64 word = query->mask.bits[i];
+
+    while (word) {
+      ComponentID component_id = i * 64 + __builtin_ctzll(word);
+      u32 count = _sceneGetComponentTypes(scene, component_id)->count;
+
+      if (count < rarest_count) {
+        rarest_count = count;
+        iter->rarest_component = component_id;
+      }
+      word &= word - 1;
+    }
+  }
 }
 
-inline u32 getEntityArraySize() {
-  return current_archetype->size;
+Archetype *queryIterNext(ECSQueryIter *iter) {
+  Scene *scene = iter->scene;
+
+  // Lists are re-read every call since steps may create archetypes
+  while (true) {
+    Archetype *type;
+    if (iter->rarest_component == MAX_COMPONENTS) {
+      if (iter->index >= scene->type_count) {
+        return NULL;
+      }
+      type = scene->types[iter->index++];
+
+    } else {
+      ArchetypeList *list = _sceneGetComponentTypes(scene, iter->rarest_component);
+      if (iter->index >= list->count) {
+        return NULL;
+      }
+      type = list->types[iter->index++];
+    }
+
+    if (bitmaskContains(&type->component_mask, &iter->query->mask)) {
+      return type;
+    }
+  }
 }
 
-inline EntityID *getEntityArray() {
-  return current_archetype->entities;
+inline Archetype *sceneGetCurrentArchetype(Scene *scene) {
+  return scene->current_archetype;
 }
 
-void runSystem(ECSSystem *sys) {
-  if (sys->begin) {
-    sys->begin();
+inline void *_getComponentArray(Scene *scene, ComponentID id) {
+  Archetype *current_archetype = scene->current_archetype;
+  ArchetypeChunk *chunk = archetypeWriteChunk(current_archetype, scene->current_chunk);
+  return chunkGetColumn(
+      current_archetype, chunk, archetypeGetComponentIndex(current_archetype, id));
+}
+
+inline const void *_readComponentArray(Scene *scene, ComponentID id) {
+  Archetype *current_archetype = scene->current_archetype;
+  ArchetypeChunk *chunk = archetypeReadChunk(current_archetype, scene->current_chunk);
+  return chunkGetColumn(
+      current_archetype, chunk, archetypeGetComponentIndex(current_archetype, id));
+}
+
+inline u32 sceneGetEntityArraySize(Scene *scene) {
+  return archetypeChunkRows(scene->current_archetype, scene->current_chunk);
+}
+
+inline const EntityID *sceneGetEntityArray(Scene *scene) {
+  return chunkGetEntities(archetypeReadChunk(scene->current_archetype, scene->current_chunk));
+}
+
+void sceneRunSystem(Scene *scene, ECSSystem *sys) {
+  if (scene->trace) {
+    traceRunSystem(scene->trace, sys);
   }
 
-  if (!sys->step) {
-    return;
+  // Shorthands used inside begin/step refer to the scene being run
+  Scene *prev_scene = current_scene;
+  current_scene = scene;
+  PROFILE_COUNTED_BEGIN(system);
+  PROFILE_ONLY(const char *name = sys->name ? sys->name : "system"; u32 matched = 0; u64 rows = 0;)
+
+  if (sys->begin) {
+    sys->begin(scene);
   }
-  for (u16 i = 0; i < current_scene->type_count; i++) {
-    current_archetype = &current_scene->types[i];
 
-    if (bitmaskContains(&current_archetype->component_mask, &sys->query->mask)) {
-      sys->step();
+  if (sys->step) {
+    ECSQueryIter iter;
+    queryIterInit(&iter, scene, sys->query);
+
+    Archetype *type;
+    while ((type = queryIterNext(&iter))) {
+      PROFILE_ONLY(matched++;)
+      // Chunk count is re-read since steps may add rows
+      for (u32 chunk = 0; chunk < archetypeActiveChunks(type); chunk++) {
+        scene->current_archetype = type;
+        scene->current_chunk = chunk;
+        PROFILE_ONLY(u32 step_rows = archetypeChunkRows(type, chunk); rows += step_rows;)
+        PROFILE_COUNTED_BEGIN(step);
+        sys->step(scene);
+        PROFILE_COUNTED_END(step, PROFILE_STEP, name, type->scene_index, step_rows);
+      }
     }
+    scene->current_archetype = NULL;
   }
+  PROFILE_COUNTED_END(system, PROFILE_SYSTEM, name, matched, rows);
+  current_scene = prev_scene;
 }
 
 // Init/deinit
-void ecsInit(size_t arena_byte_size) {
-  arenaInit(&ecs_arena, arena_byte_size);
-  bitmaskInit(&ecs_arena, &lcl_bitmask, MAX_COMPONENTS);
+void ecsInit(size_t arena_block_size) {
+  arenaInit(&ecs_arena, arena_block_size);
 }
 void ecsDeinit() {
   arenaFree(&ecs_arena);
+  registry_map = NULL;
+  registry_count = 0;
+  registry_map_cap = 0;
+}
+
+void registryMemoryStats(u32 *layout_count, size_t *reserved, size_t *allocated) {
+  pthread_mutex_lock(&registry_lock);
+  *layout_count = registry_count;
+  *reserved = arenaReserved(&ecs_arena);
+  *allocated = ecs_arena.allocated;
+  pthread_mutex_unlock(&registry_lock);
 }
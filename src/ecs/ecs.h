@@ -2,10 +2,8 @@
 #define ECS_H
 #include "ecs/utils.h"
 
-#define MAX_ARCHETYPES 256
 #define MAX_COMPONENTS 128
-#define MAX_ENTITIES 100000
-#define MAX_FREE_IDS 10000
+_Static_assert(MAX_COMPONENTS <= BITMASK_BITS, "Component masks are too narrow.");
 
 
 typedef u32 EntityID;
@@ -18,72 +16,291 @@ extern size_t component_sizes[MAX_COMPONENTS];
 #define USING_COMPONENT(TypeName) \
   const ComponentID TypeName##ID = __COUNTER__
 
+// Only writes the first time, register components before ticking scenes on
+// multiple threads. An expression so it stays safe inside unbraced ifs, the
+// registry caches column offsets from these sizes.
 #define registerComponentSize(TypeName) \
-  component_sizes[TypeName##ID] = sizeof(TypeName)
+  ((void)(component_sizes[TypeName##ID] != sizeof(TypeName) && \
+    (component_sizes[TypeName##ID] = sizeof(TypeName))))
+
+struct Scene;
+
+// Archetype rows live in chunks of up to CHUNK_ROWS rows, every chunk but the
+// last one is full. A chunk is one block holding its entity ids followed by
+// each component column, column i starting at cap * column_offsets[i].
+// Chunks are the unit of copy-on-write between forked scenes and of cold
+// storage, and carry the scene version of their last write access.
+#define CHUNK_SHIFT 10
+#define CHUNK_ROWS (1 << CHUNK_SHIFT)
+#define CHUNK_MIN_CAP 16
+
+// Owners of a chunk block or entity page shared by forked scenes, NULL while
+// a scene owns the memory alone. Home is the scene whose arena holds it, the
+// last owner to let go hands it back there.
+typedef struct {
+  u32 owners;
+  struct Scene *home;
+} ChunkShare;
 
-// Archetypes
+typedef struct {
+  u8 *data;
+  u32 cap;
+  ChunkShare *share;
+  u64 version;
+
+  // Scene clock at the last access, packed rows while cold (data is NULL)
+  u64 access;
+  struct ColdChunk *cold;
+} ArchetypeChunk;
+
+// Archetypes, component layout (mask, ids, indices, column offsets) is shared
+// by every scene through the global archetype registry, chunks belong to a scene
 typedef struct {
   Bitmask component_mask;
 
-  Arena *arena;
-  EntityID *entities;
-  u32 *entity_index;
+  struct Scene *scene;
+  ArchetypeChunk *chunks;
+  u32 chunk_count, chunk_cap;
 
-  void **component_arrays;
   ComponentID *component_id;
   u8 *component_index;
+  u32 *column_offsets;
+  u32 row_bytesize;
 
-  u64 size, cap;
+  u64 size;
+  u32 scene_index;
   
   ComponentID lowest_component_id;
   u8 component_count;
 } Archetype;
 
-// Scene
+// Where an entity lives, type indexes scene->types. Plain indices so the
+// entity index can be saved and mapped back from snapshots as is.
+#define ENTITY_NO_TYPE 0xFFFFFFFF
+
 typedef struct {
-  Arena *arena;
-  Archetype types[MAX_ARCHETYPES];
-  Archetype *type_map[MAX_ARCHETYPES];
-  Archetype *entity_type[MAX_ENTITIES];
-  
+  u32 type;
+  u32 index;
+} EntityRecord;
+
+// The entity index is paged like archetype rows so forks share it too, only
+// the last page can be partially allocated. The first page starts at 128
+// records so small scenes fit their index and first chunk without regrowing
+// either around the other.
+#define ENTITY_PAGE_SHIFT 10
+#define ENTITY_PAGE_SIZE (1 << ENTITY_PAGE_SHIFT)
+#define ENTITY_PAGE_MIN_CAP 128
+
+typedef struct {
+  EntityRecord *records;
+  u32 cap;
+  ChunkShare *share;
+  u64 version;
+} EntityPage;
+
+// Archetypes holding a component, scenes keep one per ComponentID
+typedef struct {
+  Archetype **types;
+  u32 count, cap;
+} ArchetypeList;
+
+// Scene, owns all of its memory and scratch state so separate scenes
+// can be simulated on separate threads. Everything is allocated lazily so an
+// empty scene costs sizeof(Scene) and its size grows with its contents.
+typedef struct Scene {
+  Arena arena;
+  Archetype *current_archetype;
+  u32 current_chunk;
+
+  // Bumped on every write access, stamped on the chunks and pages written
+  u64 version;
+
+  // Unique per sceneInit and kept by sceneClear. Caches of scene data key on
+  // it since another scene initialized at the same address counts versions
+  // from 0 again.
+  u64 id;
+
+  // Rollback frames, NULL unless enabled (see rollback.h)
+  struct SceneHistory *history;
+
+  // Operation trace, NULL unless recording (see trace.h)
+  struct SceneTrace *trace;
+
+  // Stamped on chunk accesses, cold storage packs chunks idle for long enough
+  // (see cold.h). Freed chunk blocks are kept for chunks of the same size.
+  u64 clock;
+  u32 cold_count;
+  u8 *free_chunks;
+
+  // Blocks the last fork sharing them handed back, pushed from other threads
+  u8 *returned_chunks;
+
+  Archetype **types;
+  Archetype **type_map;
+  u32 type_count, type_cap, type_map_cap;
+
+  // ComponentID -> archetypes containing it, sized by the highest id seen
+  ArchetypeList *component_types;
+  u32 component_types_cap;
+
+  EntityPage *entity_pages;
+  u32 entity_page_count, entity_page_cap;
   EntityID max_entity_id;
-  u64 id_queue_tail, id_queue_head;
-  EntityID id_queue[MAX_FREE_IDS];
-  u32 type_count;
+
+  u64 id_queue_tail, id_queue_head, id_queue_cap;
+  EntityID *id_queue;
+
+  // Snapshot file mapped by sceneMap, released on clear/destroy
+  void *mapping;
+  size_t mapping_bytesize;
 } Scene;
 
+// Chunk access. Reads go through archetypeReadChunk so cold chunks get
+// unpacked and accesses stamped, writes through archetypeWriteChunk which
+// also copies shared chunks and stamps versions.
+static inline u32 archetypeChunkRows(Archetype *type, u32 chunk_index) {
+  u64 first_row = (u64)chunk_index << CHUNK_SHIFT;
+  if (first_row >= type->size) {
+    return 0;
+  }
+  u64 rows = type->size - first_row;
+  return rows < CHUNK_ROWS ? rows : CHUNK_ROWS;
+}
+
+static inline u32 archetypeActiveChunks(Archetype *type) {
+  return (type->size + CHUNK_ROWS - 1) >> CHUNK_SHIFT;
+}
+
+static inline EntityID *chunkGetEntities(ArchetypeChunk *chunk) {
+  return (EntityID*)chunk->data;
+}
+
+static inline void *chunkGetColumn(Archetype *type, ArchetypeChunk *chunk, u8 column) {
+  return chunk->data + (size_t)chunk->cap * type->column_offsets[column];
+}
+
+ArchetypeChunk *archetypeWriteChunk(Archetype *type, u32 chunk_index);
+
+// Unpacks a cold chunk without counting as an access (cold.c), for tools
+// like snapshots that shouldn't keep chunks warm
+ArchetypeChunk *archetypeThawChunk(Archetype *type, u32 chunk_index);
+
+static inline ArchetypeChunk *archetypeReadChunk(Archetype *type, u32 chunk_index) {
+  ArchetypeChunk *chunk = &type->chunks[chunk_index];
+  if (chunk->cold) {
+    archetypeThawChunk(type, chunk_index);
+  }
+  chunk->access = type->scene->clock;
+  return chunk;
+}
+
+// Chunk blocks of bytesize bytes, freed blocks are reused by later chunks
+u8 *sceneAllocChunkData(Scene *scene, size_t bytesize);
+void sceneFreeChunkData(Scene *scene, u8 *data, size_t bytesize);
+// Free blocks waiting for reuse, including ones forks handed back that the
+// scene hasn't taken in yet. Returns the block count, sets their bytes.
+u32 sceneFreeChunkStats(Scene *scene, size_t *bytesize);
+// Stamps a chunk as written without writing it, for row count changes
+void archetypeTouchChunk(Archetype *type, u32 chunk_index);
+
+// Entity index access, same read/write split as chunks
+static inline EntityRecord *sceneGetRecord(Scene *scene, EntityID entity) {
+  return &scene->entity_pages[entity >> ENTITY_PAGE_SHIFT]
+    .records[entity & (ENTITY_PAGE_SIZE - 1)];
+}
+
+EntityRecord *sceneWriteRecord(Scene *scene, EntityID entity);
+
+static inline u32 sceneEntityPageRecords(Scene *scene, u32 page_index) {
+  u64 first = (u64)page_index << ENTITY_PAGE_SHIFT;
+  if (first >= scene->max_entity_id) {
+    return 0;
+  }
+  u64 records = scene->max_entity_id - first;
+  return records < ENTITY_PAGE_SIZE ? records : ENTITY_PAGE_SIZE;
+}
+
+// Archetype and entity index storage, for code filling them directly
+// (e.g. snapshots). Reserving allocates chunks/pages with the given capacity
+// for all rows up to cap, chunks keep their data when they already have it.
+Archetype *getOrCreateArchetype(Scene *scene, Bitmask mask);
+void archetypeReserve(Archetype *type, u64 cap);
+// Column of a component the archetype has
+u8 archetypeGetComponentIndex(Archetype *type, ComponentID id);
+void archetypeSetChunk(Archetype *type, u32 chunk_index, u8 *data, u32 cap);
+void sceneReserveEntities(Scene *scene, EntityID count);
+void sceneSetEntityPage(Scene *scene, u32 page_index, EntityRecord *records, u32 cap);
+
 void _addComponent(Scene *scene, EntityID entity, ComponentID id);
 void *_getComponent(Scene *scene, EntityID entity, ComponentID id);
+const void *_readComponent(Scene *scene, EntityID entity, ComponentID id);
 
-EntityID newEntity();
-void killEntity(EntityID entity);
+// NULL for entities with no components
+Archetype *sceneGetEntityType(Scene *scene, EntityID entity);
 
-#define addComponent(entity, TypeName) \
-  registerComponentSize(TypeName); \
-  _addComponent(getCurrentScene(), entity, TypeName##ID)
+EntityID sceneNewEntity(Scene *scene);
+void sceneKillEntity(Scene *scene, EntityID entity);
+// Kill for callers removing rows in bulk, the entity's row is already gone:
+// clears its record and queues the id for reuse
+void sceneReleaseEntity(Scene *scene, EntityID entity);
 
-#define getComponent(entity, TypeName) \
-  (TypeName*)_getComponent(getCurrentScene(), entity, TypeName##ID)
+#define sceneAddComponent(scene, entity, TypeName) \
+  (registerComponentSize(TypeName), _addComponent(scene, entity, TypeName##ID))
 
-#define setComponent(entity, TypeName, ...) \
-  (*(TypeName*)_getComponent(getCurrentScene(), entity, TypeName##ID)) = (TypeName)__VA_ARGS__
+#define sceneGetComponent(scene, entity, TypeName) \
+  ((TypeName*)_getComponent(scene, entity, TypeName##ID))
+
+// Read only access, doesn't copy chunks shared with a forked scene
+#define sceneReadComponent(scene, entity, TypeName) \
+  ((const TypeName*)_readComponent(scene, entity, TypeName##ID))
+
+#define sceneSetComponent(scene, entity, TypeName, ...) \
+  (*(TypeName*)_getComponent(scene, entity, TypeName##ID)) = (TypeName)__VA_ARGS__
+
+void sceneInit(Scene *scene, size_t arena_block_size);
+void sceneClear(Scene *scene);
+void sceneDestroy(Scene *scene);
 
-void sceneInit(Scene *scene);
+// Copy-on-write fork, fork shares every chunk and entity page with parent and
+// either scene copies a chunk the first time it writes to it, so forks cost
+// what they touch. The archetype tables and the free id queue are copied.
+// Shared memory is counted, destroying a fork lets go of what it still
+// shares, so the last owner writes in place again and frees it when done.
+// Forking counts parent's chunks so it happens on parent's thread, forks
+// then tick independently (also on other threads). Parent must not be
+// cleared or destroyed while forks of it are alive.
+void sceneFork(Scene *fork, Scene *parent, size_t arena_block_size);
 
-// Scene swapping
+// Scene swapping (the current scene is per thread)
 void setCurrentScene(Scene *to);
 Scene *getCurrentScene();
 
+// Current scene shorthands
+#define newEntity() sceneNewEntity(getCurrentScene())
+#define killEntity(entity) sceneKillEntity(getCurrentScene(), entity)
+
+#define addComponent(entity, TypeName) \
+  sceneAddComponent(getCurrentScene(), entity, TypeName)
+
+#define getComponent(entity, TypeName) \
+  sceneGetComponent(getCurrentScene(), entity, TypeName)
+
+#define readComponent(entity, TypeName) \
+  sceneReadComponent(getCurrentScene(), entity, TypeName)
+
+#define setComponent(entity, TypeName, ...) \
+  sceneSetComponent(getCurrentScene(), entity, TypeName, __VA_ARGS__)
+
 // Queries and systems
 typedef struct {
   Bitmask mask;
-  Scene *scene;
 } ECSQuery;
 
 typedef struct {
+  const char *name; // For profiling, may be NULL
   ECSQuery *query;
-  void (*begin)();
-  void (*step)();
+  void (*begin)(Scene *scene);
+  void (*step)(Scene *scene);
 } ECSSystem;
 
 void queryInit(ECSQuery *query);
@@ -91,16 +308,53 @@ void _queryRequire(ECSQuery *query, ComponentID component_id);
 
 #define queryRequire(queryPtr, CompType) _queryRequire(queryPtr, CompType##ID)
 
-Archetype *getCurrentArchetype();
-void *_getComponentArray(ComponentID id);
-#define getComponentArray(CompType) (CompType*)_getComponentArray(CompType##ID)
-u32 getEntityArraySize();
-EntityID *getEntityArray();
+// Archetypes of a scene holding a component, for tooling and runtime queries
+ArchetypeList *_sceneGetComponentTypes(Scene *scene, ComponentID component_id);
+#define sceneGetComponentTypes(scene, CompType) \
+  _sceneGetComponentTypes(scene, CompType##ID)
 
-void runSystem(ECSSystem *sys);
+// Walks the archetypes matching a query by scanning the archetype list of its
+// rarest component. Archetypes created while iterating are visited too.
+typedef struct {
+  Scene *scene;
+  ECSQuery *query;
+  ComponentID rarest_component;
+  u32 index;
+} ECSQueryIter;
 
-// Init/deinit
-void ecsInit(size_t arena_byte_size);
+void queryIterInit(ECSQueryIter *iter, Scene *scene, ECSQuery *query);
+Archetype *queryIterNext(ECSQueryIter *iter);
+
+// Steps run once per chunk of every matching archetype, the arrays below
+// cover the current chunk
+Archetype *sceneGetCurrentArchetype(Scene *scene);
+void *_getComponentArray(Scene *scene, ComponentID id);
+const void *_readComponentArray(Scene *scene, ComponentID id);
+u32 sceneGetEntityArraySize(Scene *scene);
+const EntityID *sceneGetEntityArray(Scene *scene);
+
+#define sceneGetComponentArray(scene, CompType) \
+  ((CompType*)_getComponentArray(scene, CompType##ID))
+
+// Read only access, doesn't copy chunks shared with a forked scene
+#define sceneReadComponentArray(scene, CompType) \
+  ((const CompType*)_readComponentArray(scene, CompType##ID))
+
+void sceneRunSystem(Scene *scene, ECSSystem *sys);
+
+// Current scene shorthands, inside a step the current scene is the one being run
+#define getCurrentArchetype() sceneGetCurrentArchetype(getCurrentScene())
+#define getComponentArray(CompType) sceneGetComponentArray(getCurrentScene(), CompType)
+#define readComponentArray(CompType) sceneReadComponentArray(getCurrentScene(), CompType)
+#define getEntityArraySize() sceneGetEntityArraySize(getCurrentScene())
+#define getEntityArray() sceneGetEntityArray(getCurrentScene())
+#define runSystem(sys) sceneRunSystem(getCurrentScene(), sys)
+
+// Init/deinit, the global arena holds the archetype registry
+void ecsInit(size_t arena_block_size);
 void ecsDeinit();
 
+// Layouts in the registry and the global arena's bytes, for memory reports
+void registryMemoryStats(u32 *layout_count, size_t *reserved, size_t *allocated);
+
 #endif
@@ -0,0 +1,322 @@
+#include "filter.h"
+
+void filterInit(Filter *filter, ComponentID component, FilterMode mode) {
+  *filter = (Filter) {
+    .component = component,
+      .mode = mode,
+      .term_count = 0
+  };
+}
+
+static void filterAdd(Filter *filter, FilterTerm term) {
+  assert(filter->term_count < FILTER_MAX_TERMS && "Too many filter terms.");
+  assert(term.offset + sizeof(u32) <= component_sizes[filter->component] &&
+      "The field doesn't fit in the component, register its size first.");
+  filter->terms[filter->term_count++] = term;
+}
+
+void filterAddF32(Filter *filter, u32 offset, FilterOp op, float value) {
+  filterAdd(filter, (FilterTerm) {.offset = offset, .type = FILTER_F32, .op = op, .value.f = value});
+}
+
+void filterAddI32(Filter *filter, u32 offset, FilterOp op, i32 value) {
+  filterAdd(filter, (FilterTerm) {.offset = offset, .type = FILTER_I32, .op = op, .value.i = value});
+}
+
+void filterAddU32(Filter *filter, u32 offset, FilterOp op, u32 value) {
+  filterAdd(filter, (FilterTerm) {.offset = offset, .type = FILTER_U32, .op = op, .value.u = value});
+}
+
+// Every op is some of less, greater and equal, possibly inverted, so the
+// kernels compute all three and pick with lane masks instead of branching
+typedef struct {
+  u32 lt, gt, eq, invert;
+} FilterLanes;
+
+static FilterLanes filterLanes(FilterOp op, u32 lanes) {
+  switch (op) {
+    case FILTER_LT: return (FilterLanes) {lanes, 0, 0, 0};
+    case FILTER_LE: return (FilterLanes) {lanes, 0, lanes, 0};
+    case FILTER_GT: return (FilterLanes) {0, lanes, 0, 0};
+    case FILTER_GE: return (FilterLanes) {0, lanes, lanes, 0};
+    case FILTER_EQ: return (FilterLanes) {0, 0, lanes, 0};
+    case FILTER_NE: return (FilterLanes) {0, 0, lanes, lanes};
+  }
+  assert(false && "Unknown filter op.");
+  return (FilterLanes) {0, 0, 0, 0};
+}
+
+static inline u32 filterSelect(const FilterLanes *lanes, u32 lt, u32 gt, u32 eq) {
+  return ((lt & lanes->lt) | (gt & lanes->gt) | (eq & lanes->eq)) ^ lanes->invert;
+}
+
+static u32 filterTest(const FilterTerm *term, const FilterLanes *lanes, const u8 *field) {
+  bool lt, gt, eq;
+  switch (term->type) {
+    case FILTER_F32: {
+      float a;
+      memcpy(&a, field, sizeof(a));
+      lt = a < term->value.f, gt = a > term->value.f, eq = a == term->value.f;
+      break;
+    }
+    case FILTER_I32: {
+      i32 a;
+      memcpy(&a, field, sizeof(a));
+      lt = a < term->value.i, gt = a > term->value.i, eq = a == term->value.i;
+      break;
+    }
+    default: {
+      u32 a;
+      memcpy(&a, field, sizeof(a));
+      lt = a < term->value.u, gt = a > term->value.u, eq = a == term->value.u;
+      break;
+    }
+  }
+  return filterSelect(lanes, lt, gt, eq);
+}
+
+#if defined(__AVX2__)
+// Fields of 8 rows. Components of two fields (positions) are shuffled out of
+// two loads ending at the last row's field, others gathered.
+static inline __m256i filterLoad(const u8 *field, size_t stride, __m256i offsets) {
+  if (stride == sizeof(u32)) {
+    return _mm256_loadu_si256((const __m256i*)field);
+  }
+  if (stride == sizeof(u64)) {
+    __m256 low = _mm256_loadu_ps((const float*)field);
+    __m256 high = _mm256_loadu_ps((const float*)(field + 28));
+    __m256 fields = _mm256_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_permute4x64_epi64(_mm256_castps_si256(fields), _MM_SHUFFLE(3, 1, 2, 0));
+  }
+  return _mm256_i32gather_epi32((const int*)field, offsets, 1);
+}
+#elif defined(__SSE2__)
+static inline __m128i filterLoad(const u8 *field, size_t stride) {
+  if (stride == sizeof(u32)) {
+    return _mm_loadu_si128((const __m128i*)field);
+  }
+  if (stride == sizeof(u64)) {
+    __m128 low = _mm_loadu_ps((const float*)field);
+    __m128 high = _mm_loadu_ps((const float*)(field + 12));
+    return _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  // Built in registers, a store and reload of the lanes stalls forwarding
+  u32 a, b, c, d;
+  memcpy(&a, field, sizeof(u32));
+  memcpy(&b, field + stride, sizeof(u32));
+  memcpy(&c, field + stride * 2, sizeof(u32));
+  memcpy(&d, field + stride * 3, sizeof(u32));
+  return _mm_setr_epi32(a, b, c, d);
+}
+#endif
+
+// The term's result for each row into bits, which start zeroed
+static void filterTermBits(
+    const FilterTerm *term, const u8 *field, size_t stride, u32 row_count, u64 *bits) {
+  u32 r = 0;
+  // Words are built in a register and stored once full
+  u64 word = 0;
+
+#if defined(__AVX2__)
+  FilterLanes lanes = filterLanes(term->op, 0xFF);
+  __m256i offsets = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+
+  if (term->type == FILTER_F32) {
+    __m256 b = _mm256_set1_ps(term->value.f);
+    for (; r + 8 <= row_count; r += 8) {
+      __m256 a = _mm256_castsi256_ps(filterLoad(field + stride * r, stride, offsets));
+      u32 lt = _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+      u32 gt = _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ));
+      u32 eq = _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+      word |= (u64)filterSelect(&lanes, lt, gt, eq) << (r & 63);
+      if ((r & 63) == 64 - 8) {
+        bits[r >> 6] = word;
+        word = 0;
+      }
+    }
+  } else {
+    // Unsigned compares are signed ones with the sign bits flipped
+    __m256i flip = _mm256_set1_epi32(term->type == FILTER_U32 ? 0x80000000 : 0);
+    __m256i b = _mm256_xor_si256(_mm256_set1_epi32(term->value.i), flip);
+    for (; r + 8 <= row_count; r += 8) {
+      __m256i a = _mm256_xor_si256(filterLoad(field + stride * r, stride, offsets), flip);
+      u32 lt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)));
+      u32 gt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b)));
+      u32 eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+      word |= (u64)filterSelect(&lanes, lt, gt, eq) << (r & 63);
+      if ((r & 63) == 64 - 8) {
+        bits[r >> 6] = word;
+        word = 0;
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  FilterLanes lanes = filterLanes(term->op, 0xF);
+
+  if (term->type == FILTER_F32) {
+    __m128 b = _mm_set1_ps(term->value.f);
+    for (; r + 4 <= row_count; r += 4) {
+      __m128 a = _mm_castsi128_ps(filterLoad(field + stride * r, stride));
+      u32 lt = _mm_movemask_ps(_mm_cmplt_ps(a, b));
+      u32 gt = _mm_movemask_ps(_mm_cmpgt_ps(a, b));
+      u32 eq = _mm_movemask_ps(_mm_cmpeq_ps(a, b));
+      word |= (u64)filterSelect(&lanes, lt, gt, eq) << (r & 63);
+      if ((r & 63) == 64 - 4) {
+        bits[r >> 6] = word;
+        word = 0;
+      }
+    }
+  } else {
+    __m128i flip = _mm_set1_epi32(term->type == FILTER_U32 ? 0x80000000 : 0);
+    __m128i b = _mm_xor_si128(_mm_set1_epi32(term->value.i), flip);
+    for (; r + 4 <= row_count; r += 4) {
+      __m128i a = _mm_xor_si128(filterLoad(field + stride * r, stride), flip);
+      u32 lt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, b)));
+      u32 gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, b)));
+      u32 eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+      word |= (u64)filterSelect(&lanes, lt, gt, eq) << (r & 63);
+      if ((r & 63) == 64 - 4) {
+        bits[r >> 6] = word;
+        word = 0;
+      }
+    }
+  }
+#endif
+  if (r & 63) {
+    bits[r >> 6] = word;
+  }
+
+  FilterLanes row_lanes = filterLanes(term->op, 1);
+  for (; r < row_count; r++) {
+    bits[r >> 6] |= (u64)filterTest(term, &row_lanes, field + stride * r) << (r & 63);
+  }
+}
+
+u32 filterEvaluate(const Filter *filter, const void *array, u32 row_count, FilterSelection *selection) {
+  assert(row_count <= CHUNK_ROWS && "Filters run a chunk at a time.");
+  size_t stride = component_sizes[filter->component];
+  u32 words = (row_count + 63) >> 6;
+  bool all = filter->mode == FILTER_ALL;
+
+  u64 *bits = selection->bits;
+  for (u32 w = 0; w < FILTER_WORDS; w++) {
+    bits[w] = all ? ~0ull : 0;
+  }
+
+  u64 term_bits[FILTER_WORDS];
+  for (u32 t = 0; t < filter->term_count; t++) {
+    const FilterTerm *term = &filter->terms[t];
+    memset(term_bits, 0, sizeof(u64) * words);
+    filterTermBits(term, (const u8*)array + term->offset, stride, row_count, term_bits);
+    for (u32 w = 0; w < words; w++) {
+      bits[w] = all ? bits[w] & term_bits[w] : bits[w] | term_bits[w];
+    }
+  }
+
+  // Rows past the end are never selected
+  for (u32 w = words; w < FILTER_WORDS; w++) {
+    bits[w] = 0;
+  }
+  if (row_count & 63) {
+    bits[words - 1] &= (1ull << (row_count & 63)) - 1;
+  }
+
+  u32 count = 0;
+  for (u32 w = 0; w < words; w++) {
+    u64 word = bits[w];
+    while (word) {
+      selection->rows[count++] = (w << 6) + __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+  selection->count = count;
+  selection->row_count = row_count;
+  return count;
+}
+
+u32 filterChunk(const Filter *filter, Archetype *type, u32 chunk_index, FilterSelection *selection) {
+  ArchetypeChunk *chunk = archetypeReadChunk(type, chunk_index);
+  const void *column = chunkGetColumn(type, chunk, archetypeGetComponentIndex(type, filter->component));
+  return filterEvaluate(filter, column, archetypeChunkRows(type, chunk_index), selection);
+}
+
+u32 sceneFilterCurrentChunk(Scene *scene, const Filter *filter, FilterSelection *selection) {
+  return filterEvaluate(
+      filter, _readComponentArray(scene, filter->component), sceneGetEntityArraySize(scene), selection);
+}
+
+// Inlined with constant sizes below so the copies become plain moves
+static inline void filterGatherRows(
+    const FilterSelection *selection, const u8 *array, size_t size, u8 *out) {
+  for (u32 i = 0; i < selection->count; i++) {
+    memcpy(out + size * i, array + size * selection->rows[i], size);
+  }
+}
+
+static inline void filterScatterRows(
+    const FilterSelection *selection, const u8 *packed, size_t size, u8 *array) {
+  for (u32 i = 0; i < selection->count; i++) {
+    memcpy(array + size * selection->rows[i], packed + size * i, size);
+  }
+}
+
+u32 filterGather(const FilterSelection *selection, const void *array, size_t size, void *out) {
+#if defined(__AVX512F__)
+  // Compress stores straight from the bitmask, masked loads don't touch rows
+  // past the end
+  if (size == sizeof(u32) || size == sizeof(u64)) {
+    const u8 *in = array;
+    u8 *packed = out;
+    u32 lanes = 64 / size;
+    for (u32 r = 0; r < selection->row_count; r += lanes) {
+      u32 mask = (selection->bits[r >> 6] >> (r & 63)) & ((1u << lanes) - 1);
+      if (size == sizeof(u32)) {
+        __m512i values = _mm512_maskz_loadu_epi32(mask, in + size * r);
+        _mm512_mask_compressstoreu_epi32(packed, mask, values);
+      } else {
+        __m512i values = _mm512_maskz_loadu_epi64(mask, in + size * r);
+        _mm512_mask_compressstoreu_epi64(packed, mask, values);
+      }
+      packed += size * __builtin_popcount(mask);
+    }
+    return selection->count;
+  }
+#endif
+
+  switch (size) {
+    case sizeof(u32): filterGatherRows(selection, array, sizeof(u32), out); break;
+    case sizeof(u64): filterGatherRows(selection, array, sizeof(u64), out); break;
+    default: filterGatherRows(selection, array, size, out); break;
+  }
+  return selection->count;
+}
+
+u32 filterScatter(const FilterSelection *selection, const void *packed, size_t size, void *array) {
+#if defined(__AVX512F__)
+  if (size == sizeof(u32) || size == sizeof(u64)) {
+    const u8 *in = packed;
+    u8 *out = array;
+    u32 lanes = 64 / size;
+    for (u32 r = 0; r < selection->row_count; r += lanes) {
+      u32 mask = (selection->bits[r >> 6] >> (r & 63)) & ((1u << lanes) - 1);
+      if (size == sizeof(u32)) {
+        __m512i values = _mm512_maskz_expandloadu_epi32(mask, in);
+        _mm512_mask_storeu_epi32(out + size * r, mask, values);
+      } else {
+        __m512i values = _mm512_maskz_expandloadu_epi64(mask, in);
+        _mm512_mask_storeu_epi64(out + size * r, mask, values);
+      }
+      in += size * __builtin_popcount(mask);
+    }
+    return selection->count;
+  }
+#endif
+
+  switch (size) {
+    case sizeof(u32): filterScatterRows(selection, packed, sizeof(u32), array); break;
+    case sizeof(u64): filterScatterRows(selection, packed, sizeof(u64), array); break;
+    default: filterScatterRows(selection, packed, size, array); break;
+  }
+  return selection->count;
+}
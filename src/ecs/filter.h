@@ -0,0 +1,96 @@
+#ifndef ECS_FILTER_H
+#define ECS_FILTER_H
+#include "ecs/ecs.h"
+#include <stddef.h>
+
+// Predicate filters over a component column, evaluated a chunk at a time
+// into a bitmask and a selection vector of the matching rows. A filter is a
+// few comparisons of numeric fields of one component against constants,
+// combined with and (every term holds) or or (some term holds). Comparisons
+// run 8 (AVX2) or 4 (SSE2) rows at a time without branching on the values,
+// steps then act on the selected rows only, gathering them into packed
+// arrays and scattering results back. Float comparisons follow C, NaNs are
+// only selected by FILTER_NE.
+#define FILTER_MAX_TERMS 4
+#define FILTER_WORDS (CHUNK_ROWS / 64)
+
+typedef enum {
+  FILTER_F32,
+  FILTER_I32,
+  FILTER_U32
+} FilterFieldType;
+
+typedef enum {
+  FILTER_LT,
+  FILTER_LE,
+  FILTER_GT,
+  FILTER_GE,
+  FILTER_EQ,
+  FILTER_NE
+} FilterOp;
+
+typedef enum {
+  FILTER_ALL,
+  FILTER_ANY
+} FilterMode;
+
+typedef struct {
+  u32 offset;
+  FilterFieldType type;
+  FilterOp op;
+  union {
+    float f;
+    i32 i;
+    u32 u;
+  } value;
+} FilterTerm;
+
+typedef struct {
+  ComponentID component;
+  FilterMode mode;
+  FilterTerm terms[FILTER_MAX_TERMS];
+  u32 term_count;
+} Filter;
+
+void filterInit(Filter *filter, ComponentID component, FilterMode mode);
+void filterAddF32(Filter *filter, u32 offset, FilterOp op, float value);
+void filterAddI32(Filter *filter, u32 offset, FilterOp op, i32 value);
+void filterAddU32(Filter *filter, u32 offset, FilterOp op, u32 value);
+
+#define filterInitFor(filter, CompType, mode) filterInit(filter, CompType##ID, mode)
+#define filterAddF32For(filter, CompType, field, op, value) \
+  filterAddF32(filter, offsetof(CompType, field), op, value)
+#define filterAddI32For(filter, CompType, field, op, value) \
+  filterAddI32(filter, offsetof(CompType, field), op, value)
+#define filterAddU32For(filter, CompType, field, op, value) \
+  filterAddU32(filter, offsetof(CompType, field), op, value)
+
+// Matching rows of a chunk, bit r of the mask and rows in ascending order
+typedef struct {
+  u64 bits[FILTER_WORDS];
+  u16 rows[CHUNK_ROWS];
+  u32 count;
+  u32 row_count;
+} FilterSelection;
+
+// Evaluates the filter over the first row_count components of an array, as
+// laid out in a chunk column. Returns how many rows were selected.
+u32 filterEvaluate(const Filter *filter, const void *array, u32 row_count, FilterSelection *selection);
+
+// Same over a chunk of an archetype holding the component
+u32 filterChunk(const Filter *filter, Archetype *type, u32 chunk_index, FilterSelection *selection);
+
+// Same over the chunk a system step is running on
+u32 sceneFilterCurrentChunk(Scene *scene, const Filter *filter, FilterSelection *selection);
+
+// Copies the selected elements of size bytes of a chunk array packed into
+// out, and back from packed into the array. Returns the selection count.
+u32 filterGather(const FilterSelection *selection, const void *array, size_t size, void *out);
+u32 filterScatter(const FilterSelection *selection, const void *packed, size_t size, void *array);
+
+#define filterGatherArray(selection, array, out) \
+  filterGather(selection, array, sizeof(*(array)), out)
+#define filterScatterArray(selection, packed, array) \
+  filterScatter(selection, packed, sizeof(*(array)), array)
+
+#endif
@@ -0,0 +1,233 @@
+#include "memory.h"
+#include "ecs/cold.h"
+
+// Arena allocations are rounded to its alignment
+static size_t memoryAligned(size_t bytesize) {
+  return (bytesize + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static bool memoryMapped(Scene *scene, const void *data) {
+  const u8 *mapping = scene->mapping;
+  return mapping && (const u8*)data >= mapping &&
+    (const u8*)data < mapping + scene->mapping_bytesize;
+}
+
+void archetypeMemoryStats(Archetype *type, ArchetypeMemory *memory) {
+  *memory = (ArchetypeMemory) {
+    .rows = type->size,
+      .capacity = 0,
+      .chunk_count = type->chunk_count,
+      .table_bytesize =
+        memoryAligned(sizeof(Archetype)) + memoryAligned(sizeof(ArchetypeChunk) * type->chunk_cap)
+  };
+
+  for (u32 i = 0; i < type->chunk_count; i++) {
+    ArchetypeChunk *chunk = &type->chunks[i];
+    memory->capacity += chunk->cap;
+    memory->used_bytesize += (size_t)archetypeChunkRows(type, i) * type->row_bytesize;
+
+    if (chunk->cold) {
+      memory->cold_chunks++;
+      if (chunk->cold->fd >= 0) {
+        memory->spilled_bytesize += chunk->cold->bytesize;
+      } else {
+        memory->cold_bytesize += sizeof(ColdChunk) + chunk->cold->bytesize;
+      }
+      continue;
+    }
+    memory->chunk_bytesize += (size_t)chunk->cap * type->row_bytesize;
+    memory->shared_chunks += chunk->share != NULL;
+    memory->mapped_chunks += chunk->data && memoryMapped(type->scene, chunk->data);
+  }
+}
+
+void sceneMemoryStats(Scene *scene, SceneMemory *memory) {
+  *memory = (SceneMemory) {
+    .arena_reserved = arenaReserved(&scene->arena),
+      .arena_allocated = scene->arena.allocated,
+      .arena_high_water = scene->arena.high_water,
+      .archetype_count = scene->type_count
+  };
+
+  // Arena bytes live structures account for
+  size_t live = 0;
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    ArchetypeMemory type_memory;
+    archetypeMemoryStats(type, &type_memory);
+
+    memory->rows += type_memory.rows;
+    memory->capacity += type_memory.capacity;
+    memory->chunk_bytesize += type_memory.chunk_bytesize;
+    memory->used_bytesize += type_memory.used_bytesize;
+    memory->cold_bytesize += type_memory.cold_bytesize;
+    memory->spilled_bytesize += type_memory.spilled_bytesize;
+    memory->table_bytesize += type_memory.table_bytesize;
+    memory->small_archetype_count += type->size < MEMORY_SMALL_ROWS;
+
+    for (u32 j = 0; j < type->chunk_count; j++) {
+      ArchetypeChunk *chunk = &type->chunks[j];
+      if (!chunk->data) {
+        continue;
+      }
+      size_t bytesize = (size_t)chunk->cap * type->row_bytesize;
+      if (memoryMapped(scene, chunk->data)) {
+        memory->mapped_bytesize += bytesize;
+        continue;
+      }
+      if (chunk->share) {
+        memory->shared_bytesize += bytesize;
+      }
+      // Blocks shared from another scene live in that scene's arena
+      if (!chunk->share || chunk->share->home == scene) {
+        live += memoryAligned(bytesize);
+      }
+    }
+  }
+
+  sceneFreeChunkStats(scene, &memory->free_chunk_bytesize);
+  live += memory->free_chunk_bytesize;
+
+  for (u32 i = 0; i < scene->entity_page_count; i++) {
+    EntityPage *page = &scene->entity_pages[i];
+    size_t bytesize = sizeof(EntityRecord) * page->cap;
+    memory->entity_index_bytesize += bytesize;
+    memory->entity_index_used += sizeof(EntityRecord) * sceneEntityPageRecords(scene, i);
+    if (page->records && !memoryMapped(scene, page->records) &&
+        (!page->share || page->share->home == scene)) {
+      live += memoryAligned(bytesize);
+    }
+  }
+  memory->id_queue_bytesize = sizeof(EntityID) * scene->id_queue_cap;
+
+  memory->table_bytesize +=
+    memoryAligned(sizeof(EntityPage) * scene->entity_page_cap) +
+    memoryAligned(sizeof(Archetype*) * scene->type_cap) +
+    memoryAligned(sizeof(Archetype*) * scene->type_map_cap) +
+    memoryAligned(sizeof(ArchetypeList) * scene->component_types_cap);
+  for (u32 i = 0; i < scene->component_types_cap; i++) {
+    memory->table_bytesize += memoryAligned(sizeof(Archetype*) * scene->component_types[i].cap);
+  }
+  live += memory->table_bytesize + memoryAligned(memory->id_queue_bytesize);
+
+  memory->abandoned_bytesize =
+    memory->arena_allocated > live ? memory->arena_allocated - live : 0;
+  memory->fragmented =
+    scene->type_count >= MEMORY_FRAGMENTED_TYPES &&
+    memory->small_archetype_count * 2 >= scene->type_count;
+}
+
+static void memoryWriteText(Scene *scene, FILE *file, SceneMemory *memory) {
+  fprintf(
+      file,
+      "arena         %zu reserved, %zu allocated, %zu high water\n"
+      "chunks        %zu bytes for %llu/%llu rows, %zu used\n"
+      "              %zu shared, %zu mapped, %zu free for reuse\n"
+      "cold          %zu in memory, %zu spilled\n"
+      "entity index  %zu bytes, %zu used, free ids %zu\n"
+      "tables        %zu\n"
+      "abandoned     %zu\n"
+      "archetypes    %u, %u under %u rows%s\n",
+      memory->arena_reserved, memory->arena_allocated, memory->arena_high_water,
+      memory->chunk_bytesize, (unsigned long long)memory->rows,
+      (unsigned long long)memory->capacity, memory->used_bytesize,
+      memory->shared_bytesize, memory->mapped_bytesize, memory->free_chunk_bytesize,
+      memory->cold_bytesize, memory->spilled_bytesize,
+      memory->entity_index_bytesize, memory->entity_index_used, memory->id_queue_bytesize,
+      memory->table_bytesize, memory->abandoned_bytesize,
+      memory->archetype_count, memory->small_archetype_count, MEMORY_SMALL_ROWS,
+      memory->fragmented ? ", fragmented" : "");
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    ArchetypeMemory type_memory;
+    archetypeMemoryStats(type, &type_memory);
+
+    fprintf(
+        file, "\narchetype %u  %llu/%llu rows in %u chunks (%u cold), %zu bytes, %zu used\n",
+        i, (unsigned long long)type_memory.rows, (unsigned long long)type_memory.capacity,
+        type_memory.chunk_count, type_memory.cold_chunks,
+        type_memory.chunk_bytesize, type_memory.used_bytesize);
+    fprintf(
+        file, "  entity ids     %zu bytes, %zu used\n",
+        sizeof(EntityID) * type_memory.capacity, sizeof(EntityID) * type_memory.rows);
+    for (u8 j = 0; j < type->component_count; j++) {
+      size_t component_size = component_sizes[type->component_id[j]];
+      fprintf(
+          file, "  component %-4u %zu bytes, %zu used\n", type->component_id[j],
+          component_size * type_memory.capacity, component_size * type_memory.rows);
+    }
+  }
+}
+
+static void memoryWriteJson(Scene *scene, FILE *file, SceneMemory *memory) {
+  fprintf(
+      file,
+      "{\n  \"arena\": {\"reserved\": %zu, \"allocated\": %zu, \"high_water\": %zu},\n"
+      "  \"rows\": %llu, \"capacity\": %llu,\n"
+      "  \"chunks\": {\"bytesize\": %zu, \"used\": %zu, \"shared\": %zu, \"mapped\": %zu, "
+      "\"free\": %zu},\n"
+      "  \"cold\": {\"in_memory\": %zu, \"spilled\": %zu},\n"
+      "  \"entity_index\": {\"bytesize\": %zu, \"used\": %zu, \"id_queue\": %zu},\n"
+      "  \"tables\": %zu,\n  \"abandoned\": %zu,\n"
+      "  \"archetype_count\": %u, \"small_archetypes\": %u, \"fragmented\": %s,\n"
+      "  \"archetypes\": [",
+      memory->arena_reserved, memory->arena_allocated, memory->arena_high_water,
+      (unsigned long long)memory->rows, (unsigned long long)memory->capacity,
+      memory->chunk_bytesize, memory->used_bytesize, memory->shared_bytesize,
+      memory->mapped_bytesize, memory->free_chunk_bytesize,
+      memory->cold_bytesize, memory->spilled_bytesize,
+      memory->entity_index_bytesize, memory->entity_index_used, memory->id_queue_bytesize,
+      memory->table_bytesize, memory->abandoned_bytesize,
+      memory->archetype_count, memory->small_archetype_count,
+      memory->fragmented ? "true" : "false");
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    ArchetypeMemory type_memory;
+    archetypeMemoryStats(type, &type_memory);
+
+    fprintf(
+        file,
+        "%s\n    {\"index\": %u, \"rows\": %llu, \"capacity\": %llu, \"chunks\": %u, "
+        "\"cold_chunks\": %u, \"shared_chunks\": %u, \"bytesize\": %zu, \"used\": %zu, "
+        "\"cold\": %zu, \"spilled\": %zu, \"tables\": %zu, \"columns\": [",
+        i ? "," : "", i, (unsigned long long)type_memory.rows,
+        (unsigned long long)type_memory.capacity, type_memory.chunk_count,
+        type_memory.cold_chunks, type_memory.shared_chunks, type_memory.chunk_bytesize,
+        type_memory.used_bytesize, type_memory.cold_bytesize, type_memory.spilled_bytesize,
+        type_memory.table_bytesize);
+    for (u8 j = 0; j < type->component_count; j++) {
+      size_t component_size = component_sizes[type->component_id[j]];
+      fprintf(
+          file, "%s{\"component\": %u, \"size\": %zu, \"bytesize\": %zu, \"used\": %zu}",
+          j ? ", " : "", type->component_id[j], component_size,
+          component_size * type_memory.capacity, component_size * type_memory.rows);
+    }
+    fprintf(file, "]}");
+  }
+  fprintf(file, "\n  ]");
+}
+
+bool sceneWriteMemoryReport(Scene *scene, FILE *file, MemoryReportFormat format) {
+  SceneMemory memory;
+  sceneMemoryStats(scene, &memory);
+
+  u32 layout_count;
+  size_t registry_reserved, registry_allocated;
+  registryMemoryStats(&layout_count, &registry_reserved, &registry_allocated);
+
+  if (format == MEMORY_REPORT_JSON) {
+    memoryWriteJson(scene, file, &memory);
+    fprintf(
+        file, ",\n  \"registry\": {\"layouts\": %u, \"reserved\": %zu, \"allocated\": %zu}\n}\n",
+        layout_count, registry_reserved, registry_allocated);
+  } else {
+    fprintf(
+        file, "registry      %u layouts, %zu reserved, %zu allocated\n",
+        layout_count, registry_reserved, registry_allocated);
+    memoryWriteText(scene, file, &memory);
+  }
+  return !ferror(file);
+}
@@ -0,0 +1,62 @@
+#ifndef ECS_MEMORY_H
+#define ECS_MEMORY_H
+#include "ecs/ecs.h"
+
+// Memory accounting for scenes and their archetypes. Sizes are in bytes and
+// read from the scene's own bookkeeping, nothing is tracked per allocation.
+// The arena can't free, so arrays left behind when tables grow and blocks of
+// relocated chunks stay allocated: they show up as abandoned, the arena bytes
+// no live table, chunk, page or free list block accounts for.
+// Chunks shared with a fork are counted in both scenes, their arena bytes in
+// the scene holding them.
+
+// Archetypes with fewer rows than this count as small, a scene is flagged
+// fragmented when at least MEMORY_FRAGMENTED_TYPES archetypes exist and half
+// or more of them are small
+#define MEMORY_SMALL_ROWS 64
+#define MEMORY_FRAGMENTED_TYPES 16
+
+typedef struct {
+  u64 rows, capacity;
+  u32 chunk_count, cold_chunks, shared_chunks, mapped_chunks;
+
+  // Chunk blocks (capacity rows wide) and the part of them rows fill
+  size_t chunk_bytesize, used_bytesize;
+  // Packed rows of cold chunks, in memory and spilled
+  size_t cold_bytesize, spilled_bytesize;
+  // The archetype and its chunk table
+  size_t table_bytesize;
+} ArchetypeMemory;
+
+typedef struct {
+  size_t arena_reserved, arena_allocated, arena_high_water;
+
+  u64 rows, capacity;
+  size_t chunk_bytesize, used_bytesize, cold_bytesize, spilled_bytesize;
+  size_t shared_bytesize, mapped_bytesize; // Included in chunk_bytesize
+  size_t free_chunk_bytesize; // Including blocks forks handed back
+
+  // Entity index pages and their used records, and the free id queue
+  size_t entity_index_bytesize, entity_index_used;
+  size_t id_queue_bytesize;
+
+  // Archetypes, chunk tables, archetype lists and maps
+  size_t table_bytesize;
+  size_t abandoned_bytesize;
+
+  u32 archetype_count, small_archetype_count;
+  bool fragmented;
+} SceneMemory;
+
+void archetypeMemoryStats(Archetype *type, ArchetypeMemory *memory);
+void sceneMemoryStats(Scene *scene, SceneMemory *memory);
+
+typedef enum {
+  MEMORY_REPORT_TEXT,
+  MEMORY_REPORT_JSON
+} MemoryReportFormat;
+
+// Scene totals, then every archetype with its columns, false on I/O errors
+bool sceneWriteMemoryReport(Scene *scene, FILE *file, MemoryReportFormat format);
+
+#endif
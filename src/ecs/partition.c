@@ -0,0 +1,338 @@
+#include "partition.h"
+#include "ecs/trace.h"
+
+// Owner for plain splices, no column gets a tag
+#define PARTITION_NO_OWNER MAX_COMPONENTS
+
+void partitionInit(WorldPartition *partition, const char *path) {
+  *partition = (WorldPartition) {
+    .path = strdup(path),
+      .state = PARTITION_UNLOADED,
+      .next = NULL,
+      .owner = PARTITION_NO_OWNER,
+      .tag = 0,
+      .entity_count = 0
+  };
+}
+
+void partitionDeinit(WorldPartition *partition) {
+  assert(partition->state != PARTITION_LOADING && "Partition is still loading.");
+  if (partition->state == PARTITION_READY) {
+    sceneDestroy(&partition->staging);
+  }
+  free(partition->path);
+  partition->path = NULL;
+}
+
+// Copies len rows of src_type starting at src_index, all in one source chunk,
+// to the end of type as new entities. The rows must fit in type's last chunk.
+// Columns are matched by component, the owner column is filled with tag
+// whether src_type has one or not.
+static void appendRows(
+    Scene *scene, Archetype *type, Archetype *src_type, u64 src_index, u32 len,
+    EntityID *entities, ComponentID owner, u32 tag) {
+
+  u64 index = type->size;
+  ArchetypeChunk *chunk = archetypeWriteChunk(type, index >> CHUNK_SHIFT);
+  ArchetypeChunk *src_chunk = archetypeThawChunk(src_type, src_index >> CHUNK_SHIFT);
+  u32 row = index & (CHUNK_ROWS - 1), src_row = src_index & (CHUNK_ROWS - 1);
+
+  for (u8 i = 0; i < type->component_count; i++) {
+    ComponentID component = type->component_id[i];
+    size_t component_size = component_sizes[component];
+    u8 *column = chunkGetColumn(type, chunk, i) + component_size * row;
+
+    if (component == owner) {
+      for (u32 r = 0; r < len; r++) {
+        ((PartitionOwner*)column)[r] = (PartitionOwner) {.tag = tag};
+      }
+      continue;
+    }
+    u8 src_column = archetypeGetComponentIndex(src_type, component);
+    memcpy(
+        column,
+        chunkGetColumn(src_type, src_chunk, src_column) + component_size * src_row,
+        component_size * len);
+  }
+
+  EntityID *chunk_entities = chunkGetEntities(chunk);
+  for (u32 i = 0; i < len; i++) {
+    EntityID entity = sceneNewEntity(scene);
+    chunk_entities[row + i] = entity;
+    *sceneWriteRecord(scene, entity) = (EntityRecord) {
+      .type = type->scene_index,
+        .index = index + i
+    };
+    if (scene->trace) {
+      for (u8 c = 0; c < type->component_count; c++) {
+        traceAddComponent(scene->trace, entity, type->component_id[c]);
+      }
+    }
+    if (entities) {
+      entities[i] = entity;
+    }
+  }
+  type->size += len;
+}
+
+static u32 spliceRows(Scene *scene, Scene *src, EntityID *entities, ComponentID owner, u32 tag) {
+  u32 count = 0;
+
+  for (u32 i = 0; i < src->type_count; i++) {
+    Archetype *src_type = src->types[i];
+    if (!src_type->size) {
+      continue;
+    }
+    Bitmask mask = src_type->component_mask;
+    if (owner != PARTITION_NO_OWNER) {
+      addBit(mask, owner);
+    }
+    Archetype *type = getOrCreateArchetype(scene, mask);
+    archetypeReserve(type, type->size + src_type->size);
+
+    // Runs end at either side's chunk boundary
+    u64 done = 0;
+    while (done < src_type->size) {
+      u32 src_left = CHUNK_ROWS - (done & (CHUNK_ROWS - 1));
+      u32 left = CHUNK_ROWS - (type->size & (CHUNK_ROWS - 1));
+      u64 len = src_type->size - done;
+      len = len < src_left ? len : src_left;
+      len = len < left ? len : left;
+
+      appendRows(scene, type, src_type, done, len, entities ? entities + count : NULL, owner, tag);
+      done += len;
+      count += len;
+    }
+  }
+  return count;
+}
+
+u32 sceneSplice(Scene *scene, Scene *src, EntityID *entities) {
+  return spliceRows(scene, src, entities, PARTITION_NO_OWNER, 0);
+}
+
+bool partitionSave(Scene *scene, const EntityID *entities, u32 count, const char *path) {
+  Scene partition;
+  sceneInit(&partition, 64 kB);
+
+  for (u32 i = 0; i < count; i++) {
+    EntityRecord record = *sceneGetRecord(scene, entities[i]);
+    if (record.type == ENTITY_NO_TYPE) {
+      continue;
+    }
+    Archetype *src_type = scene->types[record.type];
+    Archetype *type = getOrCreateArchetype(&partition, src_type->component_mask);
+
+    archetypeReserve(type, type->size + 1);
+    appendRows(&partition, type, src_type, record.index, 1, NULL, PARTITION_NO_OWNER, 0);
+  }
+
+  bool ok = sceneSave(&partition, path);
+  sceneDestroy(&partition);
+  return ok;
+}
+
+// Streamer thread, reads one queued partition at a time
+static void *partitionStreamerRun(void *arg) {
+  PartitionStreamer *streamer = arg;
+
+  pthread_mutex_lock(&streamer->lock);
+  while (true) {
+    while (!streamer->quit && !streamer->pending_head) {
+      pthread_cond_wait(&streamer->wake, &streamer->lock);
+    }
+    if (streamer->quit) {
+      break;
+    }
+
+    WorldPartition *partition = streamer->pending_head;
+    streamer->pending_head = partition->next;
+    if (!streamer->pending_head) {
+      streamer->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&streamer->lock);
+
+    // Decoding happens here, into the partition's own staging scene
+    sceneInit(&partition->staging, 64 kB);
+    bool ok = sceneLoad(&partition->staging, partition->path);
+    if (!ok) {
+      sceneDestroy(&partition->staging);
+    }
+    __atomic_store_n(
+        &partition->state, ok ? PARTITION_READY : PARTITION_FAILED, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&streamer->lock);
+  }
+  pthread_mutex_unlock(&streamer->lock);
+  return NULL;
+}
+
+void partitionStreamerInit(PartitionStreamer *streamer, ComponentID owner) {
+  assert(component_sizes[owner] == sizeof(PartitionOwner) &&
+      "Register the PartitionOwner component before streaming.");
+  *streamer = (PartitionStreamer) {
+    .pending_head = NULL,
+      .pending_tail = NULL,
+      .quit = false,
+      .loading = NULL,
+      .loading_count = 0,
+      .loading_cap = 0,
+      .owner = owner,
+      .tag_count = 0
+  };
+  pthread_mutex_init(&streamer->lock, NULL);
+  pthread_cond_init(&streamer->wake, NULL);
+
+  int result = pthread_create(&streamer->thread, NULL, partitionStreamerRun, streamer);
+  assert(result == 0 && "Failed to start the partition streamer.");
+  (void)result;
+}
+
+void partitionStreamerDeinit(PartitionStreamer *streamer) {
+  pthread_mutex_lock(&streamer->lock);
+  streamer->quit = true;
+
+  // Never picked up, back to unloaded
+  for (WorldPartition *partition = streamer->pending_head; partition; partition = partition->next) {
+    partition->state = PARTITION_UNLOADED;
+  }
+  streamer->pending_head = streamer->pending_tail = NULL;
+  pthread_cond_signal(&streamer->wake);
+  pthread_mutex_unlock(&streamer->lock);
+
+  pthread_join(streamer->thread, NULL);
+  pthread_mutex_destroy(&streamer->lock);
+  pthread_cond_destroy(&streamer->wake);
+  free(streamer->loading);
+}
+
+bool partitionRequestLoad(PartitionStreamer *streamer, WorldPartition *partition) {
+  if (partition->state != PARTITION_UNLOADED && partition->state != PARTITION_FAILED) {
+    return false;
+  }
+  partition->state = PARTITION_LOADING;
+  partition->next = NULL;
+
+  if (streamer->loading_count == streamer->loading_cap) {
+    streamer->loading_cap = streamer->loading_cap ? streamer->loading_cap * 2 : 8;
+    streamer->loading = realloc(
+        streamer->loading, sizeof(WorldPartition*) * streamer->loading_cap);
+  }
+  streamer->loading[streamer->loading_count++] = partition;
+
+  // Only held for the queue, the streamer reads with it released
+  pthread_mutex_lock(&streamer->lock);
+  if (streamer->pending_tail) {
+    streamer->pending_tail->next = partition;
+  } else {
+    streamer->pending_head = partition;
+  }
+  streamer->pending_tail = partition;
+  pthread_cond_signal(&streamer->wake);
+  pthread_mutex_unlock(&streamer->lock);
+  return true;
+}
+
+u32 partitionStreamerSync(PartitionStreamer *streamer, Scene *scene) {
+  u32 spliced = 0;
+
+  for (u32 i = 0; i < streamer->loading_count;) {
+    WorldPartition *partition = streamer->loading[i];
+    u32 state = __atomic_load_n(&partition->state, __ATOMIC_ACQUIRE);
+
+    if (state == PARTITION_LOADING) {
+      i++;
+      continue;
+    }
+    streamer->loading[i] = streamer->loading[--streamer->loading_count];
+    if (state != PARTITION_READY) {
+      continue;
+    }
+
+    // Tags are never reused, so a partition loaded again gets a fresh one
+    partition->owner = streamer->owner;
+    partition->tag = ++streamer->tag_count;
+    partition->entity_count = spliceRows(
+        scene, &partition->staging, NULL, partition->owner, partition->tag);
+
+    sceneDestroy(&partition->staging);
+    partition->state = PARTITION_RESIDENT;
+    spliced++;
+  }
+  return spliced;
+}
+
+static bool partitionRowOwned(Archetype *type, u8 column, u64 index, u32 tag) {
+  ArchetypeChunk *chunk = archetypeReadChunk(type, index >> CHUNK_SHIFT);
+  const PartitionOwner *owners = chunkGetColumn(type, chunk, column);
+  return owners[index & (CHUNK_ROWS - 1)].tag == tag;
+}
+
+// Removes the rows carrying tag in one pass. Holes are filled from the end
+// of the archetype, so at most one row moves per removed row and rows spliced
+// at the end just come off. Returns the removed row count.
+static u32 partitionRemoveRows(Scene *scene, Archetype *type, u8 column, u32 tag) {
+  u64 low = 0, high = type->size;
+  u32 touched = archetypeActiveChunks(type), removed = 0;
+
+  while (true) {
+    while (low < high && !partitionRowOwned(type, column, low, tag)) {
+      low++;
+    }
+    // Chunks losing rows are touched once, before they change
+    while (low < high && partitionRowOwned(type, column, high - 1, tag)) {
+      high--;
+      if (high >> CHUNK_SHIFT < touched) {
+        touched = high >> CHUNK_SHIFT;
+        archetypeTouchChunk(type, touched);
+      }
+      ArchetypeChunk *chunk = &type->chunks[high >> CHUNK_SHIFT];
+      sceneReleaseEntity(scene, chunkGetEntities(chunk)[high & (CHUNK_ROWS - 1)]);
+      removed++;
+    }
+    if (low >= high) {
+      break;
+    }
+
+    // Owned row at low, kept row at high - 1 moves into it
+    high--;
+    if (high >> CHUNK_SHIFT < touched) {
+      touched = high >> CHUNK_SHIFT;
+      archetypeTouchChunk(type, touched);
+    }
+    ArchetypeChunk *to = archetypeWriteChunk(type, low >> CHUNK_SHIFT);
+    ArchetypeChunk *from = &type->chunks[high >> CHUNK_SHIFT];
+    u32 to_row = low & (CHUNK_ROWS - 1), from_row = high & (CHUNK_ROWS - 1);
+
+    sceneReleaseEntity(scene, chunkGetEntities(to)[to_row]);
+    removed++;
+    for (u8 i = 0; i < type->component_count; i++) {
+      size_t component_size = component_sizes[type->component_id[i]];
+      memcpy(
+          chunkGetColumn(type, to, i) + component_size * to_row,
+          chunkGetColumn(type, from, i) + component_size * from_row,
+          component_size);
+    }
+    EntityID moved = chunkGetEntities(from)[from_row];
+    chunkGetEntities(to)[to_row] = moved;
+    sceneWriteRecord(scene, moved)->index = low;
+    low++;
+  }
+  type->size = high;
+  return removed;
+}
+
+bool partitionUnload(Scene *scene, WorldPartition *partition) {
+  if (partition->state != PARTITION_RESIDENT) {
+    return false;
+  }
+  ArchetypeList *list = _sceneGetComponentTypes(scene, partition->owner);
+  for (u32 i = 0; i < list->count; i++) {
+    Archetype *type = list->types[i];
+    u8 column = archetypeGetComponentIndex(type, partition->owner);
+    partitionRemoveRows(scene, type, column, partition->tag);
+  }
+  partition->entity_count = 0;
+  partition->state = PARTITION_UNLOADED;
+  return true;
+}
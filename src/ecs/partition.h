@@ -0,0 +1,87 @@
+#ifndef ECS_PARTITION_H
+#define ECS_PARTITION_H
+#include "ecs/snapshot.h"
+
+// Streamed world partitions. A partition is a self-contained set of entities
+// saved as a snapshot file, which entities go together (a region, a level
+// section) is up to the game. A streamer thread reads and decodes requested
+// partitions into staging scenes, the main thread splices finished ones into
+// the live scene at a sync point with bulk row appends per archetype. Entity
+// ids are reassigned on splice, components referring to other entities by id
+// don't survive it. Register components before streaming.
+//
+// Spliced entities get an owner component tagged per splice, unloading
+// removes the rows carrying its tag in bulk per archetype. Ids are recycled,
+// so the tag rather than the ids tells which entities still belong to the
+// partition. The game declares the component with
+// USING_COMPONENT(PartitionOwner) and leaves it alone.
+typedef struct {
+  u32 tag;
+} PartitionOwner;
+
+typedef enum {
+  PARTITION_UNLOADED,
+  PARTITION_LOADING,
+  PARTITION_READY,
+  PARTITION_RESIDENT,
+  PARTITION_FAILED
+} PartitionState;
+
+typedef struct WorldPartition {
+  char *path;
+  u32 state;
+
+  // Filled by the streamer thread, owned by it while loading
+  Scene staging;
+  struct WorldPartition *next;
+
+  // Owner component and tag of the partition's entities while resident
+  ComponentID owner;
+  u32 tag;
+  u32 entity_count;
+} WorldPartition;
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  WorldPartition *pending_head, *pending_tail;
+  bool quit;
+
+  // Main thread only, partitions requested and not yet spliced
+  WorldPartition **loading;
+  u32 loading_count, loading_cap;
+
+  ComponentID owner;
+  u32 tag_count;
+} PartitionStreamer;
+
+void partitionInit(WorldPartition *partition, const char *path);
+void partitionDeinit(WorldPartition *partition);
+
+// Writes the given entities of scene as a partition file
+bool partitionSave(Scene *scene, const EntityID *entities, u32 count, const char *path);
+
+void partitionStreamerInit(PartitionStreamer *streamer, ComponentID owner);
+#define partitionStreamerInitFor(streamer) \
+  (registerComponentSize(PartitionOwner), partitionStreamerInit(streamer, PartitionOwnerID))
+// Waits for the read in flight, if any, partitions still queued are dropped
+void partitionStreamerDeinit(PartitionStreamer *streamer);
+
+// Queues an unloaded (or failed) partition for reading, never blocks on disk
+bool partitionRequestLoad(PartitionStreamer *streamer, WorldPartition *partition);
+
+// Sync point, splices every partition the streamer finished into scene.
+// Call between frames, returns how many became resident.
+u32 partitionStreamerSync(PartitionStreamer *streamer, Scene *scene);
+
+// Appends all of src's entities to scene, writing their new ids to entities
+// (src entity count long) when not NULL. Returns the entity count.
+u32 sceneSplice(Scene *scene, Scene *src, EntityID *entities);
+
+// Kills a resident partition's entities, false if it isn't resident. Rows
+// are found by tag in the archetypes holding the owner component, so entities
+// the game killed or moved to other archetypes meanwhile are handled.
+bool partitionUnload(Scene *scene, WorldPartition *partition);
+
+#endif
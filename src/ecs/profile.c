@@ -0,0 +1,421 @@
+#include "profile.h"
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+typedef struct ProfileRing {
+  ProfileEvent *events;
+  u64 count; // Events ever recorded, the newest are kept
+  u32 thread;
+  struct ProfileRing *next;
+
+  // Counter group of the thread, the cycle counter leads. Slots index the
+  // group read, -1 for counters that failed to open.
+  bool counters_opened;
+  int counter_fds[PROFILE_COUNTER_COUNT];
+  i32 counter_slots[PROFILE_COUNTER_COUNT];
+} ProfileRing;
+
+static _Thread_local ProfileRing *thread_ring = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProfileRing *rings = NULL;
+static u32 ring_count = 0;
+
+static const char *profile_kind_names[PROFILE_KIND_COUNT] = {
+  "system", "step", "structural", "arena"
+};
+static const char *profile_arg_names[PROFILE_KIND_COUNT][2] = {
+  {"archetypes", "rows"}, {"archetype", "rows"}, {"entity", "component"}, {"bytesize", NULL}
+};
+static const char *profile_counter_names[PROFILE_COUNTER_COUNT] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+static bool counters_enabled = false;
+
+// First event of a thread, the ring stays around after the thread exits
+static ProfileRing *profileThreadRing() {
+  ProfileRing *ring = malloc(sizeof(ProfileRing));
+  pthread_mutex_lock(&rings_lock);
+  *ring = (ProfileRing) {
+    .events = malloc(sizeof(ProfileEvent) * PROFILE_RING_EVENTS),
+      .count = 0,
+      .thread = ring_count++,
+      .next = rings,
+      .counters_opened = false
+  };
+  for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+    ring->counter_fds[i] = -1;
+  }
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+
+  thread_ring = ring;
+  return ring;
+}
+
+void profileRecord(u32 kind, const char *name, u64 start, u64 arg0, u64 arg1) {
+  u64 end = profileNow();
+  ProfileRing *ring = thread_ring ? thread_ring : profileThreadRing();
+
+  ring->events[ring->count & (PROFILE_RING_EVENTS - 1)] = (ProfileEvent) {
+    .name = name,
+      .start = start,
+      .end = end,
+      .kind = kind,
+      .thread = ring->thread,
+      .args = {arg0, arg1},
+      .counters = {0}
+  };
+  ring->count++;
+}
+
+// Hardware counters
+#ifdef __linux__
+static const struct {
+  u32 type;
+  u64 config;
+} profile_counter_events[PROFILE_COUNTER_COUNT] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+// Counts the calling thread in user space, -1 on failure
+static int profileOpenCounter(u32 counter, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = profile_counter_events[counter].type;
+  attr.config = profile_counter_events[counter].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void profileCloseCounters(ProfileRing *ring) {
+  for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+    if (ring->counter_fds[i] >= 0) {
+      close(ring->counter_fds[i]);
+    }
+    ring->counter_fds[i] = -1;
+  }
+  ring->counters_opened = false;
+}
+
+static void profileOpenCounters(ProfileRing *ring) {
+  ring->counters_opened = true;
+  for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+    ring->counter_slots[i] = -1;
+  }
+#ifdef __linux__
+  int group = profileOpenCounter(PROFILE_CYCLES, -1);
+  if (group < 0) {
+    return;
+  }
+  ring->counter_fds[PROFILE_CYCLES] = group;
+  ring->counter_slots[PROFILE_CYCLES] = 0;
+
+  i32 slot = 1;
+  for (u32 i = PROFILE_CYCLES + 1; i < PROFILE_COUNTER_COUNT; i++) {
+    ring->counter_fds[i] = profileOpenCounter(i, group);
+    if (ring->counter_fds[i] >= 0) {
+      ring->counter_slots[i] = slot++;
+    }
+  }
+#endif
+}
+
+bool profileEnableCounters() {
+#ifdef __linux__
+  int fd = profileOpenCounter(PROFILE_CYCLES, -1);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  __atomic_store_n(&counters_enabled, true, __ATOMIC_RELAXED);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void profileDisableCounters() {
+  __atomic_store_n(&counters_enabled, false, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&rings_lock);
+  for (ProfileRing *ring = rings; ring; ring = ring->next) {
+    profileCloseCounters(ring);
+  }
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void profileReadCounters(u64 *counters) {
+  memset(counters, 0, sizeof(u64) * PROFILE_COUNTER_COUNT);
+  if (!__atomic_load_n(&counters_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+  ProfileRing *ring = thread_ring ? thread_ring : profileThreadRing();
+  if (!ring->counters_opened) {
+    profileOpenCounters(ring);
+  }
+  if (ring->counter_fds[PROFILE_CYCLES] < 0) {
+    return;
+  }
+
+  // Group read, the number of counters followed by their values
+  u64 values[1 + PROFILE_COUNTER_COUNT];
+  if (read(ring->counter_fds[PROFILE_CYCLES], values, sizeof(values)) <= 0) {
+    return;
+  }
+  for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+    if (ring->counter_slots[i] >= 0 && (u64)ring->counter_slots[i] < values[0]) {
+      counters[i] = values[1 + ring->counter_slots[i]];
+    }
+  }
+}
+
+void profileSample(ProfileSample *sample) {
+  profileReadCounters(sample->counters);
+  sample->time = profileNow();
+}
+
+void profileRecordCounted(
+    u32 kind, const char *name, const ProfileSample *start, u64 arg0, u64 arg1) {
+
+  u64 end = profileNow();
+  u64 counters[PROFILE_COUNTER_COUNT];
+  profileReadCounters(counters);
+
+  ProfileRing *ring = thread_ring ? thread_ring : profileThreadRing();
+  ProfileEvent *event = &ring->events[ring->count & (PROFILE_RING_EVENTS - 1)];
+  *event = (ProfileEvent) {
+    .name = name,
+      .start = start->time,
+      .end = end,
+      .kind = kind,
+      .thread = ring->thread,
+      .args = {arg0, arg1}
+  };
+  for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+    event->counters[i] = counters[i] - start->counters[i];
+  }
+  ring->count++;
+}
+
+void profileClear() {
+  pthread_mutex_lock(&rings_lock);
+  for (ProfileRing *ring = rings; ring; ring = ring->next) {
+    ring->count = 0;
+  }
+  pthread_mutex_unlock(&rings_lock);
+}
+
+void profileDeinit() {
+  pthread_mutex_lock(&rings_lock);
+  while (rings) {
+    ProfileRing *next = rings->next;
+    profileCloseCounters(rings);
+    free(rings->events);
+    free(rings);
+    rings = next;
+  }
+  ring_count = 0;
+  pthread_mutex_unlock(&rings_lock);
+  thread_ring = NULL;
+}
+
+// Oldest kept event first
+static ProfileEvent *ringEvent(ProfileRing *ring, u64 i) {
+  u64 first = ring->count > PROFILE_RING_EVENTS ? ring->count - PROFILE_RING_EVENTS : 0;
+  return &ring->events[(first + i) & (PROFILE_RING_EVENTS - 1)];
+}
+
+static u64 ringSize(ProfileRing *ring) {
+  return ring->count < PROFILE_RING_EVENTS ? ring->count : PROFILE_RING_EVENTS;
+}
+
+// Writes name as a JSON string
+static void profileWriteString(FILE *file, const char *name) {
+  fputc('"', file);
+  for (const char *c = name; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+    }
+    if ((u8)*c >= 0x20) {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+bool profileWriteChromeTrace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+  bool first = true;
+  pthread_mutex_lock(&rings_lock);
+  for (ProfileRing *ring = rings; ring; ring = ring->next) {
+    for (u64 i = 0; i < ringSize(ring); i++) {
+      ProfileEvent *event = ringEvent(ring, i);
+      const char **arg_names = profile_arg_names[event->kind];
+
+      fprintf(file, "%s\n{\"name\": ", first ? "" : ",");
+      profileWriteString(file, event->name);
+      fprintf(
+          file, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+          "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"%s\": %llu",
+          profile_kind_names[event->kind], event->thread,
+          event->start / 1e3, (event->end - event->start) / 1e3,
+          arg_names[0], (unsigned long long)event->args[0]);
+      if (arg_names[1]) {
+        fprintf(file, ", \"%s\": %llu", arg_names[1], (unsigned long long)event->args[1]);
+      }
+      if (event->counters[PROFILE_CYCLES]) {
+        for (u32 j = 0; j < PROFILE_COUNTER_COUNT; j++) {
+          fprintf(
+              file, ", \"%s\": %llu",
+              profile_counter_names[j], (unsigned long long)event->counters[j]);
+        }
+      }
+      fprintf(file, "}}");
+      first = false;
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  fprintf(file, "\n]}\n");
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
+// System runs grouped by name, shortest first within a group
+static int profileCompareRuns(const void *a, const void *b) {
+  const ProfileEvent *run_a = *(ProfileEvent**)a, *run_b = *(ProfileEvent**)b;
+  int order = strcmp(run_a->name, run_b->name);
+  if (order) {
+    return order;
+  }
+  u64 duration_a = run_a->end - run_a->start, duration_b = run_b->end - run_b->start;
+  return (duration_a > duration_b) - (duration_a < duration_b);
+}
+
+static int profileCompareStats(const void *a, const void *b) {
+  const ProfileSystemStats *stats_a = a, *stats_b = b;
+  return (stats_a->total_ns < stats_b->total_ns) - (stats_a->total_ns > stats_b->total_ns);
+}
+
+u32 profileSystemStats(ProfileSystemStats *stats, u32 cap) {
+  pthread_mutex_lock(&rings_lock);
+  u64 run_count = 0;
+  for (ProfileRing *ring = rings; ring; ring = ring->next) {
+    for (u64 i = 0; i < ringSize(ring); i++) {
+      run_count += ringEvent(ring, i)->kind == PROFILE_SYSTEM;
+    }
+  }
+  ProfileEvent **runs = malloc(sizeof(ProfileEvent*) * (run_count ? run_count : 1));
+  run_count = 0;
+  for (ProfileRing *ring = rings; ring; ring = ring->next) {
+    for (u64 i = 0; i < ringSize(ring); i++) {
+      ProfileEvent *event = ringEvent(ring, i);
+      if (event->kind == PROFILE_SYSTEM) {
+        runs[run_count++] = event;
+      }
+    }
+  }
+  qsort(runs, run_count, sizeof(ProfileEvent*), profileCompareRuns);
+
+  // Every system gets stats, the caller only sees the first cap of them
+  u32 system_count = 0, system_cap = 16;
+  ProfileSystemStats *all = malloc(sizeof(ProfileSystemStats) * system_cap);
+  for (u64 first = 0, last; first < run_count; first = last) {
+    ProfileSystemStats system = {.name = runs[first]->name};
+    for (last = first; last < run_count && !strcmp(runs[last]->name, system.name); last++) {
+      system.total_ns += runs[last]->end - runs[last]->start;
+      system.archetypes += runs[last]->args[0];
+      system.rows += runs[last]->args[1];
+      for (u32 i = 0; i < PROFILE_COUNTER_COUNT; i++) {
+        system.counters[i] += runs[last]->counters[i];
+      }
+    }
+
+    // Misses per row over all runs, before rows become a per run average
+    u64 *counters = system.counters;
+    u64 rows = system.rows ? system.rows : 1;
+    system.ipc = counters[PROFILE_CYCLES] ?
+      (double)counters[PROFILE_INSTRUCTIONS] / counters[PROFILE_CYCLES] : 0;
+    system.l1d_misses_per_row = (double)counters[PROFILE_L1D_MISSES] / rows;
+    system.llc_misses_per_row = (double)counters[PROFILE_LLC_MISSES] / rows;
+    system.branch_misses_per_row = (double)counters[PROFILE_BRANCH_MISSES] / rows;
+
+    u64 count = last - first;
+    ProfileEvent *p50 = runs[first + (count - 1) * 50 / 100];
+    ProfileEvent *p99 = runs[first + (count - 1) * 99 / 100];
+    system.runs = count;
+    system.p50_ns = p50->end - p50->start;
+    system.p99_ns = p99->end - p99->start;
+    system.max_ns = runs[last - 1]->end - runs[last - 1]->start;
+    system.archetypes /= count;
+    system.rows /= count;
+
+    if (system_count == system_cap) {
+      system_cap *= 2;
+      all = realloc(all, sizeof(ProfileSystemStats) * system_cap);
+    }
+    all[system_count++] = system;
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  qsort(all, system_count, sizeof(ProfileSystemStats), profileCompareStats);
+  if (cap) {
+    memcpy(stats, all, sizeof(ProfileSystemStats) * (system_count < cap ? system_count : cap));
+  }
+  free(all);
+  free(runs);
+  return system_count;
+}
+
+void profilePrintSummary(FILE *file) {
+  u32 count = profileSystemStats(NULL, 0);
+  ProfileSystemStats *stats = malloc(sizeof(ProfileSystemStats) * (count ? count : 1));
+  count = profileSystemStats(stats, count);
+
+  bool counted = false;
+  for (u32 i = 0; i < count; i++) {
+    counted |= stats[i].counters[PROFILE_CYCLES] != 0;
+  }
+
+  fprintf(
+      file, "%-24s %8s %10s %10s %10s %10s %10s",
+      "system", "runs", "p50 us", "p99 us", "max us", "archetypes", "rows");
+  if (counted) {
+    fprintf(file, " %6s %10s %10s %10s", "ipc", "l1d/row", "llc/row", "branch/row");
+  }
+  fputc('\n', file);
+
+  for (u32 i = 0; i < count; i++) {
+    fprintf(
+        file, "%-24s %8u %10.2f %10.2f %10.2f %10llu %10llu",
+        stats[i].name, stats[i].runs, stats[i].p50_ns / 1e3, stats[i].p99_ns / 1e3,
+        stats[i].max_ns / 1e3, (unsigned long long)stats[i].archetypes,
+        (unsigned long long)stats[i].rows);
+    if (counted) {
+      fprintf(
+          file, " %6.2f %10.3f %10.3f %10.3f", stats[i].ipc, stats[i].l1d_misses_per_row,
+          stats[i].llc_misses_per_row, stats[i].branch_misses_per_row);
+    }
+    fputc('\n', file);
+  }
+  free(stats);
+}
@@ -0,0 +1,114 @@
+#ifndef ECS_PROFILE_H
+#define ECS_PROFILE_H
+#include "ecs/utils.h"
+#include <time.h>
+
+// Profiling zones, compiled in with ECS_PROFILE defined (the ECS_PROFILE cmake
+// option) and compiled out to nothing otherwise. The scene records a zone per
+// system run and per step, one per structural change (adding components,
+// kills, archetype creation) and one per arena block allocation. Zones go into
+// a ring buffer per thread, the oldest events are overwritten when it's full.
+// On Linux system and step zones can also sample hardware counters, see
+// profileEnableCounters.
+#define PROFILE_RING_SHIFT 16
+#define PROFILE_RING_EVENTS (1 << PROFILE_RING_SHIFT)
+
+typedef enum {
+  PROFILE_SYSTEM, // args: archetypes matched, rows processed
+  PROFILE_STEP, // args: archetype index, rows
+  PROFILE_STRUCTURAL, // args: entity, component
+  PROFILE_ARENA, // args: block bytesize
+  PROFILE_KIND_COUNT
+} ProfileKind;
+
+typedef enum {
+  PROFILE_CYCLES,
+  PROFILE_INSTRUCTIONS,
+  PROFILE_L1D_MISSES,
+  PROFILE_LLC_MISSES,
+  PROFILE_BRANCH_MISSES,
+  PROFILE_COUNTER_COUNT
+} ProfileCounter;
+
+typedef struct {
+  const char *name; // Must outlive the ring, usually a literal
+  u64 start, end; // Nanoseconds, CLOCK_MONOTONIC
+  u32 kind;
+  u32 thread;
+  u64 args[2];
+
+  // Counted over the zone, zero when counters are off or unsupported
+  u64 counters[PROFILE_COUNTER_COUNT];
+} ProfileEvent;
+
+// Clock and counter readings at the start of a counted zone
+typedef struct {
+  u64 time;
+  u64 counters[PROFILE_COUNTER_COUNT];
+} ProfileSample;
+
+static inline u64 profileNow() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void profileRecord(u32 kind, const char *name, u64 start, u64 arg0, u64 arg1);
+void profileSample(ProfileSample *sample);
+void profileRecordCounted(
+    u32 kind, const char *name, const ProfileSample *start, u64 arg0, u64 arg1);
+
+#ifdef ECS_PROFILE
+#define PROFILE_ONLY(...) __VA_ARGS__
+#define PROFILE_ZONE_BEGIN(zone) u64 zone##_profile_start = profileNow()
+#define PROFILE_ZONE_END(zone, kind, name, arg0, arg1) \
+  profileRecord(kind, name, zone##_profile_start, arg0, arg1)
+#define PROFILE_COUNTED_BEGIN(zone) \
+  ProfileSample zone##_profile_sample; \
+  profileSample(&zone##_profile_sample)
+#define PROFILE_COUNTED_END(zone, kind, name, arg0, arg1) \
+  profileRecordCounted(kind, name, &zone##_profile_sample, arg0, arg1)
+#else
+#define PROFILE_ONLY(...)
+#define PROFILE_ZONE_BEGIN(zone)
+#define PROFILE_ZONE_END(zone, kind, name, arg0, arg1)
+#define PROFILE_COUNTED_BEGIN(zone)
+#define PROFILE_COUNTED_END(zone, kind, name, arg0, arg1)
+#endif
+
+// Linux only (perf_event_open), false elsewhere or when the kernel refuses
+// the cycle counter. Each thread opens its own counter group on its next
+// counted zone, user space only so it works with perf_event_paranoid 2.
+// Counters the CPU lacks (common in VMs) read as zero. Reading a group is a
+// syscall, counted zones cost around a microsecond more.
+bool profileEnableCounters();
+void profileDisableCounters();
+
+// Everything below reads the rings of all threads, call it while no thread
+// records (between frames, with workers parked)
+
+// Drops all recorded events
+void profileClear();
+// Frees the rings, once no thread will record again
+void profileDeinit();
+
+// Chrome trace event JSON (chrome://tracing, Perfetto), false on I/O errors
+bool profileWriteChromeTrace(const char *path);
+
+typedef struct {
+  const char *name;
+  u32 runs;
+  u64 p50_ns, p99_ns, max_ns, total_ns;
+  u64 archetypes, rows; // Per run, averaged
+
+  // Summed over all runs
+  u64 counters[PROFILE_COUNTER_COUNT];
+  double ipc, l1d_misses_per_row, llc_misses_per_row, branch_misses_per_row;
+} ProfileSystemStats;
+
+// Per system stats over the recorded runs, most total time first. Returns how
+// many systems there are, fills up to cap of them.
+u32 profileSystemStats(ProfileSystemStats *stats, u32 cap);
+void profilePrintSummary(FILE *file);
+
+#endif
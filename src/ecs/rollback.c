@@ -0,0 +1,217 @@
+#include "rollback.h"
+#include "ecs/trace.h"
+
+void sceneEnableHistory(Scene *scene, u32 frame_count) {
+  assert(frame_count && "History needs at least one frame.");
+  sceneDisableHistory(scene);
+
+  SceneHistory *history = malloc(sizeof(SceneHistory));
+  *history = (SceneHistory) {
+    .frames = calloc(frame_count, sizeof(HistoryFrame)),
+      .frame_cap = frame_count,
+      .frame_count = 0,
+      .newest = frame_count - 1
+  };
+  scene->history = history;
+}
+
+void sceneDisableHistory(Scene *scene) {
+  SceneHistory *history = scene->history;
+  if (!history) {
+    return;
+  }
+  for (u32 i = 0; i < history->frame_cap; i++) {
+    free(history->frames[i].state);
+    free(history->frames[i].log);
+  }
+  free(history->frames);
+  free(history);
+  scene->history = NULL;
+}
+
+void historyClear(SceneHistory *history) {
+  history->frame_count = 0;
+  history->newest = history->frame_cap - 1;
+}
+
+// Frame saved `back` saves before the newest one
+static HistoryFrame *historyGetFrame(SceneHistory *history, u32 back) {
+  return &history->frames[(history->newest + history->frame_cap - back) % history->frame_cap];
+}
+
+static u8 *historyLogPut(HistoryFrame *frame, size_t bytesize) {
+  if (frame->log_bytesize + bytesize > frame->log_cap) {
+    frame->log_cap = (frame->log_bytesize + bytesize) * 2;
+    frame->log = realloc(frame->log, frame->log_cap);
+  }
+  u8 *ptr = frame->log + frame->log_bytesize;
+  frame->log_bytesize += bytesize;
+  return ptr;
+}
+
+void sceneSaveFrame(Scene *scene) {
+  SceneHistory *history = scene->history;
+  assert(history && "History isn't enabled for this scene.");
+
+  history->newest = (history->newest + 1) % history->frame_cap;
+  if (history->frame_count < history->frame_cap) {
+    history->frame_count++;
+  }
+
+  HistoryFrame *frame = &history->frames[history->newest];
+  frame->version = scene->version;
+  frame->max_entity_id = scene->max_entity_id;
+  frame->type_count = scene->type_count;
+  frame->free_id_count = scene->id_queue_head - scene->id_queue_tail;
+  frame->log_bytesize = 0;
+
+  size_t state_bytesize =
+    sizeof(u64) * frame->type_count + sizeof(EntityID) * frame->free_id_count;
+  if (state_bytesize > frame->state_cap) {
+    frame->state_cap = state_bytesize * 2;
+    frame->state = realloc(frame->state, frame->state_cap);
+  }
+
+  u64 *sizes = (u64*)frame->state;
+  for (u32 i = 0; i < frame->type_count; i++) {
+    sizes[i] = scene->types[i]->size;
+  }
+  EntityID *free_ids = (EntityID*)(sizes + frame->type_count);
+  for (u32 i = 0; i < frame->free_id_count; i++) {
+    free_ids[i] = scene->id_queue[(scene->id_queue_tail + i) % scene->id_queue_cap];
+  }
+}
+
+void historyRecordChunk(SceneHistory *history, Archetype *type, u32 chunk_index) {
+  if (!history->frame_count) {
+    return;
+  }
+  HistoryFrame *frame = &history->frames[history->newest];
+  ArchetypeChunk *chunk = &type->chunks[chunk_index];
+  u32 rows = archetypeChunkRows(type, chunk_index);
+
+  // Already saved this frame, or nothing to save
+  if (chunk->version > frame->version || !rows) {
+    return;
+  }
+  archetypeThawChunk(type, chunk_index);
+
+  HistoryEntry entry = {.type = type->scene_index, .index = chunk_index, .rows = rows};
+  u8 *out = historyLogPut(frame, sizeof(HistoryEntry) + (size_t)rows * type->row_bytesize);
+  memcpy(out, &entry, sizeof(HistoryEntry));
+  out += sizeof(HistoryEntry);
+
+  memcpy(out, chunkGetEntities(chunk), sizeof(EntityID) * rows);
+  out += sizeof(EntityID) * rows;
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t bytesize = component_sizes[type->component_id[i]] * rows;
+    memcpy(out, chunkGetColumn(type, chunk, i), bytesize);
+    out += bytesize;
+  }
+}
+
+void historyRecordPage(SceneHistory *history, Scene *scene, u32 page_index) {
+  if (!history->frame_count) {
+    return;
+  }
+  HistoryFrame *frame = &history->frames[history->newest];
+  EntityPage *page = &scene->entity_pages[page_index];
+  u32 rows = sceneEntityPageRecords(scene, page_index);
+
+  if (page->version > frame->version || !rows) {
+    return;
+  }
+
+  HistoryEntry entry = {.type = ENTITY_NO_TYPE, .index = page_index, .rows = rows};
+  u8 *out = historyLogPut(frame, sizeof(HistoryEntry) + sizeof(EntityRecord) * rows);
+  memcpy(out, &entry, sizeof(HistoryEntry));
+  memcpy(out + sizeof(HistoryEntry), page->records, sizeof(EntityRecord) * rows);
+}
+
+// Copies a frame's saved rows back, the scene must not record while undoing
+static void historyUndo(Scene *scene, HistoryFrame *frame) {
+  u8 *in = frame->log, *end = frame->log + frame->log_bytesize;
+
+  while (in < end) {
+    HistoryEntry entry;
+    memcpy(&entry, in, sizeof(HistoryEntry));
+    in += sizeof(HistoryEntry);
+
+    if (entry.type == ENTITY_NO_TYPE) {
+      EntityRecord *records = sceneWriteRecord(scene, entry.index << ENTITY_PAGE_SHIFT);
+      memcpy(records, in, sizeof(EntityRecord) * entry.rows);
+      in += sizeof(EntityRecord) * entry.rows;
+      continue;
+    }
+
+    Archetype *type = scene->types[entry.type];
+    ArchetypeChunk *chunk = archetypeWriteChunk(type, entry.index);
+
+    memcpy(chunkGetEntities(chunk), in, sizeof(EntityID) * entry.rows);
+    in += sizeof(EntityID) * entry.rows;
+    for (u8 i = 0; i < type->component_count; i++) {
+      size_t bytesize = component_sizes[type->component_id[i]] * entry.rows;
+      memcpy(chunkGetColumn(type, chunk, i), in, bytesize);
+      in += bytesize;
+    }
+  }
+}
+
+bool sceneRollback(Scene *scene, u32 frames) {
+  SceneHistory *history = scene->history;
+  if (!history || frames >= history->frame_count) {
+    return false;
+  }
+  if (scene->trace) {
+    traceUntraced(scene->trace);
+  }
+
+  scene->history = NULL;
+  for (u32 i = 0; i <= frames; i++) {
+    historyUndo(scene, historyGetFrame(history, i));
+  }
+  HistoryFrame *frame = historyGetFrame(history, frames);
+
+  // Archetype sizes, chunks whose row count changes count as written
+  u64 *sizes = (u64*)frame->state;
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    u64 size = i < frame->type_count ? sizes[i] : 0;
+    if (size == type->size) {
+      continue;
+    }
+
+    u32 first = (size < type->size ? size : type->size) >> CHUNK_SHIFT;
+    u32 last = archetypeActiveChunks(type);
+    type->size = size;
+    if (archetypeActiveChunks(type) > last) {
+      last = archetypeActiveChunks(type);
+    }
+    for (u32 j = first; j < last; j++) {
+      archetypeTouchChunk(type, j);
+    }
+  }
+
+  // Entity allocation state
+  scene->max_entity_id = frame->max_entity_id;
+
+  if (frame->free_id_count > scene->id_queue_cap) {
+    scene->id_queue_cap = frame->free_id_count;
+    scene->id_queue = arenaAlloc(&scene->arena, sizeof(EntityID) * scene->id_queue_cap);
+  }
+  if (frame->free_id_count) {
+    memcpy(
+        scene->id_queue, sizes + frame->type_count,
+        sizeof(EntityID) * frame->free_id_count);
+  }
+  scene->id_queue_tail = 0;
+  scene->id_queue_head = frame->free_id_count;
+
+  // The restored frame is the newest one again, recording from here
+  history->newest = (history->newest + history->frame_cap - frames) % history->frame_cap;
+  history->frame_count -= frames;
+  frame->log_bytesize = 0;
+  frame->version = scene->version;
+  scene->history = history;
+  return true;
+}
@@ -0,0 +1,55 @@
+#ifndef ECS_ROLLBACK_H
+#define ECS_ROLLBACK_H
+#include "ecs/ecs.h"
+
+// Rollback history, a ring of the last saved frames of a scene. Saving a frame
+// only stores the entity allocation state and archetype sizes. After a save the
+// first write to a chunk or entity page copies its rows into the newest frame's
+// undo log, so frames cost what the simulation touches and rolling back copies
+// just those rows back, newest frame first. Archetypes created since the
+// restored frame are kept, emptied.
+typedef struct {
+  u32 type; // ENTITY_NO_TYPE for entity pages
+  u32 index;
+  u32 rows;
+} HistoryEntry;
+
+typedef struct {
+  // Scene version at the save, chunks and pages stamped later are dirty
+  u64 version;
+  EntityID max_entity_id;
+  u32 type_count, free_id_count;
+
+  // Archetype sizes followed by the free ids
+  u8 *state;
+  size_t state_cap;
+
+  // HistoryEntry headers, each followed by the rows it saved
+  u8 *log;
+  size_t log_bytesize, log_cap;
+} HistoryFrame;
+
+typedef struct SceneHistory {
+  HistoryFrame *frames;
+  u32 frame_cap, frame_count, newest;
+} SceneHistory;
+
+// Keeps up to frame_count frames, replaces the history if there already is one
+void sceneEnableHistory(Scene *scene, u32 frame_count);
+void sceneDisableHistory(Scene *scene);
+
+// Saves the scene as the newest frame, dropping the oldest one when the ring
+// is full. Call between frames, not from inside systems.
+void sceneSaveFrame(Scene *scene);
+
+// Restores the frame saved `frames` saves before the newest one, 0 undoes
+// everything since the newest save. The restored frame becomes the newest,
+// later ones are dropped. False when the history doesn't reach back that far.
+bool sceneRollback(Scene *scene, u32 frames);
+
+// Called by the scene before stamping a chunk/page, and on sceneClear
+void historyRecordChunk(SceneHistory *history, Archetype *type, u32 chunk_index);
+void historyRecordPage(SceneHistory *history, Scene *scene, u32 page_index);
+void historyClear(SceneHistory *history);
+
+#endif
@@ -0,0 +1,495 @@
+#include "snapshot.h"
+#include "ecs/trace.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Blocks of a page or more start on a page, smaller ones are 16 byte aligned
+static u64 snapshotAlign(u64 offset, u64 bytesize) {
+  u64 alignment = bytesize >= SNAPSHOT_PAGE_SIZE ? SNAPSHOT_PAGE_SIZE : 16;
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Components have to be registered with the saved size. Loads never register
+// them, they may run on another thread and fail halfway through the file.
+static bool snapshotCheckComponent(const SnapshotComponent *component) {
+  return component->id < MAX_COMPONENTS && component_sizes[component->id] &&
+    component_sizes[component->id] == component->size;
+}
+
+bool snapshotCheckMask(Bitmask mask) {
+  if (!bitmaskFlagCount(&mask)) {
+    return false;
+  }
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    u64 word = mask.bits[i];
+    while (word) {
+      u32 id = i * 64 + __builtin_ctzll(word);
+      if (id >= MAX_COMPONENTS || !component_sizes[id]) {
+        return false;
+      }
+      word &= word - 1;
+    }
+  }
+  return true;
+}
+
+// Archetypes are created in the saved order so the type indices in the entity
+// index stay valid, a repeated mask would shift them
+static Archetype *snapshotCreateArchetype(Scene *scene, Bitmask mask, u32 index) {
+  if (!snapshotCheckMask(mask)) {
+    return NULL;
+  }
+  Archetype *type = getOrCreateArchetype(scene, mask);
+  return type->scene_index == index ? type : NULL;
+}
+
+// Streams track the offset for block alignment. Writes go to the file, or
+// to buffer when set, or are only counted when neither is. Reads know the
+// file's size.
+typedef struct {
+  FILE *file;
+  u8 *buffer;
+  u64 offset, file_bytesize;
+  bool ok;
+} SnapshotStream;
+
+static void streamWrite(SnapshotStream *stream, const void *data, size_t bytesize) {
+  if (stream->ok && bytesize) {
+    if (stream->file) {
+      stream->ok = fwrite(data, bytesize, 1, stream->file) == 1;
+    } else if (stream->buffer) {
+      memcpy(stream->buffer + stream->offset, data, bytesize);
+    }
+  }
+  stream->offset += bytesize;
+}
+
+static void streamWriteZeros(SnapshotStream *stream, size_t bytesize) {
+  static const u8 padding[SNAPSHOT_PAGE_SIZE] = {0};
+  while (bytesize) {
+    size_t step = bytesize < sizeof(padding) ? bytesize : sizeof(padding);
+    streamWrite(stream, padding, step);
+    bytesize -= step;
+  }
+}
+
+static void streamAlign(SnapshotStream *stream, size_t bytesize) {
+  streamWriteZeros(stream, snapshotAlign(stream->offset, bytesize) - stream->offset);
+}
+
+static void streamWriteBlock(SnapshotStream *stream, const void *data, size_t bytesize) {
+  streamAlign(stream, bytesize);
+  streamWrite(stream, data, bytesize);
+}
+
+// Saved chunks are trimmed to their rows, rounded up so columns stay aligned
+static u32 snapshotChunkCap(u32 rows) {
+  return (rows + CHUNK_MIN_CAP - 1) & ~(CHUNK_MIN_CAP - 1);
+}
+
+// Chunk image, the chunk's layout at the trimmed capacity
+static void streamWriteChunk(SnapshotStream *stream, Archetype *type, u32 chunk_index) {
+  ArchetypeChunk *chunk = archetypeThawChunk(type, chunk_index);
+  u32 rows = archetypeChunkRows(type, chunk_index);
+  u32 cap = snapshotChunkCap(rows);
+
+  streamAlign(stream, (size_t)cap * type->row_bytesize);
+  streamWrite(stream, chunkGetEntities(chunk), sizeof(EntityID) * rows);
+  streamWriteZeros(stream, sizeof(EntityID) * (cap - rows));
+
+  for (u8 i = 0; i < type->component_count; i++) {
+    size_t component_size = component_sizes[type->component_id[i]];
+    streamWrite(stream, chunkGetColumn(type, chunk, i), component_size * rows);
+    streamWriteZeros(stream, component_size * (cap - rows));
+  }
+}
+
+static void streamRead(SnapshotStream *stream, void *data, size_t bytesize) {
+  if (stream->ok && bytesize) {
+    stream->ok = fread(data, bytesize, 1, stream->file) == 1;
+  }
+  stream->offset += bytesize;
+}
+
+static void streamReadBlock(SnapshotStream *stream, void *data, size_t bytesize) {
+  u64 offset = snapshotAlign(stream->offset, bytesize);
+  if (stream->ok && offset != stream->offset) {
+    stream->ok = fseek(stream->file, offset, SEEK_SET) == 0;
+  }
+  stream->offset = offset;
+  streamRead(stream, data, bytesize);
+}
+
+// Whether a table, or a block when block is set, of bytesize is left in the
+// file. Counts read from the file are checked with it before allocating.
+static bool streamFits(SnapshotStream *stream, u64 bytesize, bool block) {
+  u64 offset = block ? snapshotAlign(stream->offset, bytesize) : stream->offset;
+  return stream->ok && offset <= stream->file_bytesize &&
+    bytesize <= stream->file_bytesize - offset;
+}
+
+static void snapshotWrite(SnapshotStream *stream, Scene *scene) {
+  // Every component used by some archetype gets its size recorded
+  Bitmask used = {0};
+  for (u32 i = 0; i < scene->type_count; i++) {
+    for (u32 j = 0; j < BITMASK_WORDS; j++) {
+      used.bits[j] |= scene->types[i]->component_mask.bits[j];
+    }
+  }
+
+  SnapshotHeader header = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .component_count = bitmaskFlagCount(&used),
+    .type_count = scene->type_count,
+    .max_entity_id = scene->max_entity_id,
+    .free_id_count = scene->id_queue_head - scene->id_queue_tail
+  };
+  streamWrite(stream, &header, sizeof(header));
+
+  for (u32 id = 0; id < MAX_COMPONENTS; id++) {
+    if (getBit(used, id)) {
+      // Zeroed first so the padding written out is too
+      SnapshotComponent component;
+      memset(&component, 0, sizeof(component));
+      component.id = id;
+      component.size = component_sizes[id];
+      streamWrite(stream, &component, sizeof(component));
+    }
+  }
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    SnapshotArchetype type = {
+      .component_mask = scene->types[i]->component_mask,
+      .size = scene->types[i]->size
+    };
+    streamWrite(stream, &type, sizeof(type));
+  }
+
+  // Free id ring, may wrap around so it's unrolled into one block first
+  EntityID *free_ids = scene->id_queue;
+  if (header.free_id_count && scene->id_queue_tail % scene->id_queue_cap) {
+    free_ids = malloc(sizeof(EntityID) * header.free_id_count);
+    for (u32 i = 0; i < header.free_id_count; i++) {
+      free_ids[i] = scene->id_queue[(scene->id_queue_tail + i) % scene->id_queue_cap];
+    }
+  }
+  streamWriteBlock(stream, free_ids, sizeof(EntityID) * header.free_id_count);
+  if (free_ids != scene->id_queue) {
+    free(free_ids);
+  }
+
+  // Entity pages, back to back as one block
+  streamAlign(stream, sizeof(EntityRecord) * scene->max_entity_id);
+  for (u32 i = 0; i < scene->entity_page_count; i++) {
+    streamWrite(
+        stream, scene->entity_pages[i].records,
+        sizeof(EntityRecord) * sceneEntityPageRecords(scene, i));
+  }
+
+  for (u32 i = 0; i < scene->type_count; i++) {
+    Archetype *type = scene->types[i];
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      streamWriteChunk(stream, type, j);
+    }
+  }
+}
+
+bool sceneSave(Scene *scene, const char *path) {
+  SnapshotStream stream = {.file = fopen(path, "wb"), .offset = 0, .ok = true};
+  if (!stream.file) {
+    return false;
+  }
+  snapshotWrite(&stream, scene);
+
+  return (fclose(stream.file) == 0) && stream.ok;
+}
+
+bool sceneLoad(Scene *scene, const char *path) {
+  if (scene->trace) {
+    traceUntraced(scene->trace);
+  }
+  sceneClear(scene);
+
+  SnapshotStream stream = {.file = fopen(path, "rb"), .offset = 0, .ok = true};
+  if (!stream.file) {
+    return false;
+  }
+  struct stat file_stat;
+  stream.ok = fstat(fileno(stream.file), &file_stat) == 0;
+  stream.file_bytesize = stream.ok ? file_stat.st_size : 0;
+
+  SnapshotHeader header;
+  stream.ok = streamFits(&stream, sizeof(header), false);
+  streamRead(&stream, &header, sizeof(header));
+  stream.ok = stream.ok &&
+    header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION &&
+    streamFits(&stream, sizeof(SnapshotComponent) * (u64)header.component_count, false);
+
+  for (u32 i = 0; i < header.component_count && stream.ok; i++) {
+    SnapshotComponent component;
+    streamRead(&stream, &component, sizeof(component));
+    stream.ok = stream.ok && snapshotCheckComponent(&component);
+  }
+
+  SnapshotArchetype *types = NULL;
+  stream.ok = streamFits(&stream, sizeof(SnapshotArchetype) * (u64)header.type_count, false);
+  if (stream.ok) {
+    types = malloc(sizeof(SnapshotArchetype) * header.type_count);
+    stream.ok = types || !header.type_count;
+    streamRead(&stream, types, sizeof(SnapshotArchetype) * header.type_count);
+  }
+
+  // Entity allocation state, the free ids and the index have to be in the
+  // file before the arena makes room for them
+  if (stream.ok) {
+    u64 ids_bytesize = sizeof(EntityID) * (u64)header.free_id_count;
+    u64 records_bytesize = sizeof(EntityRecord) * (u64)header.max_entity_id;
+    u64 records_offset = snapshotAlign(
+        snapshotAlign(stream.offset, ids_bytesize) + ids_bytesize, records_bytesize);
+    stream.ok = records_offset <= stream.file_bytesize &&
+      records_bytesize <= stream.file_bytesize - records_offset;
+  }
+  if (stream.ok) {
+    scene->id_queue_cap = header.free_id_count;
+    scene->id_queue_head = header.free_id_count;
+    scene->id_queue = arenaAlloc(&scene->arena, sizeof(EntityID) * header.free_id_count);
+    streamReadBlock(&stream, scene->id_queue, sizeof(EntityID) * header.free_id_count);
+
+    sceneReserveEntities(scene, header.max_entity_id);
+    u64 offset = snapshotAlign(stream.offset, sizeof(EntityRecord) * header.max_entity_id);
+    if (offset != stream.offset) {
+      stream.ok = fseek(stream.file, offset, SEEK_SET) == 0;
+      stream.offset = offset;
+    }
+    scene->max_entity_id = header.max_entity_id;
+
+    for (u32 i = 0; i < scene->entity_page_count; i++) {
+      streamRead(
+          &stream, scene->entity_pages[i].records,
+          sizeof(EntityRecord) * sceneEntityPageRecords(scene, i));
+    }
+  }
+
+  // Chunk images are read straight into chunks of the same capacity
+  for (u32 i = 0; i < header.type_count && stream.ok; i++) {
+    Archetype *type = snapshotCreateArchetype(scene, types[i].component_mask, i);
+    stream.ok = type;
+    if (!type) {
+      break;
+    }
+    // Every row takes row_bytesize in the file, which bounds the chunk count
+    stream.ok = types[i].size <= stream.file_bytesize / type->row_bytesize;
+    type->size = stream.ok ? types[i].size : 0;
+
+    for (u32 j = 0; j < archetypeActiveChunks(type) && stream.ok; j++) {
+      u32 cap = snapshotChunkCap(archetypeChunkRows(type, j));
+      size_t bytesize = (size_t)cap * type->row_bytesize;
+      if (!streamFits(&stream, bytesize, true)) {
+        stream.ok = false;
+        break;
+      }
+
+      u8 *data = arenaAlloc(&scene->arena, bytesize);
+      streamReadBlock(&stream, data, bytesize);
+      archetypeSetChunk(type, j, data, cap);
+    }
+  }
+
+  free(types);
+  fclose(stream.file);
+
+  if (!stream.ok) {
+    sceneClear(scene);
+  }
+  return stream.ok;
+}
+
+// Next table or block of a mapped snapshot, NULL past the end of the file
+static void *mapRead(u8 *base, u64 *offset, u64 bytesize, u64 file_bytesize) {
+  void *ptr = base + *offset;
+  *offset += bytesize;
+  return *offset <= file_bytesize ? ptr : NULL;
+}
+
+static void *mapBlock(u8 *base, u64 *offset, u64 bytesize, u64 file_bytesize) {
+  *offset = snapshotAlign(*offset, bytesize);
+  return mapRead(base, offset, bytesize, file_bytesize);
+}
+
+bool sceneMap(Scene *scene, const char *path) {
+  if (scene->trace) {
+    traceUntraced(scene->trace);
+  }
+  sceneClear(scene);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  bool ok = fstat(fd, &file_stat) == 0 && file_stat.st_size >= (off_t)sizeof(SnapshotHeader);
+
+  u64 file_bytesize = ok ? file_stat.st_size : 0;
+  u8 *base = ok ?
+    mmap(NULL, file_bytesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  scene->mapping = base;
+  scene->mapping_bytesize = file_bytesize;
+
+  SnapshotHeader *header = (SnapshotHeader*)base;
+  u64 offset = sizeof(SnapshotHeader);
+  ok = header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION;
+
+  SnapshotComponent *components = ok ? mapRead(
+      base, &offset, sizeof(SnapshotComponent) * header->component_count, file_bytesize) : NULL;
+  ok = ok && components;
+
+  for (u32 i = 0; i < header->component_count && ok; i++) {
+    ok = snapshotCheckComponent(&components[i]);
+  }
+
+  SnapshotArchetype *types = ok ? mapRead(
+      base, &offset, sizeof(SnapshotArchetype) * header->type_count, file_bytesize) : NULL;
+  ok = ok && types;
+
+  // Entity allocation state, used in place until it needs to grow
+  if (ok) {
+    scene->id_queue = mapBlock(
+        base, &offset, sizeof(EntityID) * header->free_id_count, file_bytesize);
+    scene->id_queue_cap = header->free_id_count;
+    scene->id_queue_head = header->free_id_count;
+
+    EntityRecord *records = mapBlock(
+        base, &offset, sizeof(EntityRecord) * header->max_entity_id, file_bytesize);
+    ok = scene->id_queue && records;
+
+    scene->max_entity_id = ok ? header->max_entity_id : 0;
+    for (u32 i = 0; ok && (u64)i << ENTITY_PAGE_SHIFT < scene->max_entity_id; i++) {
+      sceneSetEntityPage(
+          scene, i, records + ((u64)i << ENTITY_PAGE_SHIFT), sceneEntityPageRecords(scene, i));
+    }
+  }
+
+  for (u32 i = 0; i < header->type_count && ok; i++) {
+    Archetype *type = snapshotCreateArchetype(scene, types[i].component_mask, i);
+    ok = type && types[i].size <= file_bytesize / type->row_bytesize;
+    if (!ok) {
+      break;
+    }
+    type->size = types[i].size;
+
+    for (u32 j = 0; j < archetypeActiveChunks(type) && ok; j++) {
+      u32 cap = snapshotChunkCap(archetypeChunkRows(type, j));
+      u8 *data = mapBlock(base, &offset, (size_t)cap * type->row_bytesize, file_bytesize);
+
+      ok = data;
+      if (ok) {
+        archetypeSetChunk(type, j, data, cap);
+      }
+    }
+  }
+
+  if (!ok) {
+    sceneClear(scene);
+  }
+  return ok;
+}
+
+// Background saves
+void snapshotWriterInit(SnapshotWriter *writer) {
+  *writer = (SnapshotWriter) {
+    .staging = NULL,
+      .staging_cap = 0,
+      .staging_bytesize = 0,
+      .path = NULL,
+      .busy = false,
+      .done = false,
+      .ok = true
+  };
+}
+
+// Streams the staged image to a temporary file and renames it over the
+// target so a crash mid save never leaves a torn snapshot behind
+static void *snapshotWriterRun(void *arg) {
+  SnapshotWriter *writer = arg;
+  size_t path_len = strlen(writer->path);
+  char *tmp_path = malloc(path_len + 5);
+  memcpy(tmp_path, writer->path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+
+  bool ok = false;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    u64 written = 0;
+    ok = true;
+    while (ok && written < writer->staging_bytesize) {
+      ssize_t result = write(fd, writer->staging + written, writer->staging_bytesize - written);
+      ok = result > 0;
+      written += ok ? result : 0;
+    }
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmp_path, writer->path) == 0;
+  }
+
+  free(tmp_path);
+  writer->ok = ok;
+  __atomic_store_n(&writer->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+bool sceneSaveAsync(SnapshotWriter *writer, Scene *scene, const char *path) {
+  // Reap a finished save without blocking
+  if (writer->busy && __atomic_load_n(&writer->done, __ATOMIC_ACQUIRE)) {
+    snapshotWriterWait(writer);
+  }
+  if (writer->busy) {
+    return false;
+  }
+
+  // Size the image first, then copy every column into the staging buffer
+  SnapshotStream stream = {.file = NULL, .buffer = NULL, .offset = 0, .ok = true};
+  snapshotWrite(&stream, scene);
+
+  if (stream.offset > writer->staging_cap) {
+    free(writer->staging);
+    writer->staging_cap = stream.offset + stream.offset / 4;
+    writer->staging = malloc(writer->staging_cap);
+  }
+  writer->staging_bytesize = stream.offset;
+
+  stream = (SnapshotStream) {.file = NULL, .buffer = writer->staging, .offset = 0, .ok = true};
+  snapshotWrite(&stream, scene);
+
+  free(writer->path);
+  writer->path = strdup(path);
+  writer->busy = true;
+  writer->done = false;
+
+  if (pthread_create(&writer->thread, NULL, snapshotWriterRun, writer) != 0) {
+    writer->busy = false;
+    writer->ok = false;
+  }
+  return writer->busy;
+}
+
+bool snapshotWriterWait(SnapshotWriter *writer) {
+  if (writer->busy) {
+    pthread_join(writer->thread, NULL);
+    writer->busy = false;
+  }
+  return writer->ok;
+}
+
+void snapshotWriterDeinit(SnapshotWriter *writer) {
+  snapshotWriterWait(writer);
+  free(writer->staging);
+  free(writer->path);
+  snapshotWriterInit(writer);
+}
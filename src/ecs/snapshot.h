@@ -0,0 +1,69 @@
+#ifndef ECS_SNAPSHOT_H
+#define ECS_SNAPSHOT_H
+#include "ecs/ecs.h"
+#include <pthread.h>
+
+// Binary scene snapshots. A header (component sizes, archetype masks and
+// sizes, entity allocation state) is followed by the free id queue, the entity
+// index as one raw block and every archetype chunk as one block laid out like
+// the chunk itself. Blocks of a page or more start on a page boundary so a
+// snapshot can be mapped and used in place.
+// Data is stored in native byte order and component ids must match between
+// save and load. Tables are checked on load, column and index contents are
+// trusted.
+#define SNAPSHOT_MAGIC 0x53534345 // "ECSS"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_PAGE_SIZE 4096
+
+typedef struct {
+  u32 magic, version;
+  u32 component_count, type_count;
+  EntityID max_entity_id;
+  u32 free_id_count;
+} SnapshotHeader;
+
+typedef struct {
+  ComponentID id;
+  u32 size;
+} SnapshotComponent;
+
+typedef struct {
+  Bitmask component_mask;
+  u64 size;
+} SnapshotArchetype;
+
+// Whether a mask read from a file is one an archetype can have, not empty and
+// only made of registered components
+bool snapshotCheckMask(Bitmask mask);
+
+// All return false on I/O errors, counts that don't fit in the file or a
+// snapshot that doesn't match the registered components. Loads never
+// register components, register every saved one first. A failed load leaves
+// the scene cleared.
+bool sceneSave(Scene *scene, const char *path);
+bool sceneLoad(Scene *scene, const char *path);
+
+// Maps the file copy-on-write (MAP_PRIVATE) and points the entity pages and
+// archetype chunks straight into the mapping, so loading costs the same for
+// any world size and pages fault in as systems touch them. The mapping is
+// released by sceneClear/sceneDestroy, chunks that grow move to the arena.
+bool sceneMap(Scene *scene, const char *path);
+
+// Background saves. sceneSaveAsync copies the snapshot image into a staging
+// buffer (the only cost on the calling thread, call it between frames) and a
+// writer thread streams it to disk. Returns false while a save is in flight.
+typedef struct {
+  pthread_t thread;
+  u8 *staging;
+  size_t staging_cap, staging_bytesize;
+  char *path;
+  bool busy, done, ok;
+} SnapshotWriter;
+
+void snapshotWriterInit(SnapshotWriter *writer);
+bool sceneSaveAsync(SnapshotWriter *writer, Scene *scene, const char *path);
+// Waits for the save in flight, if any, and returns whether the last one succeeded
+bool snapshotWriterWait(SnapshotWriter *writer);
+void snapshotWriterDeinit(SnapshotWriter *writer);
+
+#endif
@@ -0,0 +1,165 @@
+#include "sort.h"
+#include "ecs/trace.h"
+
+#define SORT_RADIX_BITS 8
+#define SORT_RADIX_BUCKETS (1 << SORT_RADIX_BITS)
+
+// Cells are clamped to the i32 range so any float quantizes
+static u32 sortQuantize(float value, float cell_size) {
+  float cell = value / cell_size;
+  if (!(cell > -2147483648.0f)) {
+    return 0;
+  }
+  if (cell >= 2147483647.0f) {
+    return UINT32_MAX;
+  }
+  i32 truncated = (i32)cell;
+  truncated -= cell < truncated;
+  return (u32)truncated ^ 0x80000000;
+}
+
+// Spreads the bits of value over the even bits of the result
+static u64 sortSpreadBits(u32 value) {
+  u64 bits = value;
+  bits = (bits | bits << 16) & 0x0000FFFF0000FFFF;
+  bits = (bits | bits << 8) & 0x00FF00FF00FF00FF;
+  bits = (bits | bits << 4) & 0x0F0F0F0F0F0F0F0F;
+  bits = (bits | bits << 2) & 0x3333333333333333;
+  bits = (bits | bits << 1) & 0x5555555555555555;
+  return bits;
+}
+
+u64 sortMortonKey(const void *component, void *user) {
+  const SortMorton *morton = user;
+  float position[2];
+  memcpy(position, (const u8*)component + morton->offset, sizeof(position));
+  return sortSpreadBits(sortQuantize(position[0], morton->cell_size)) |
+    sortSpreadBits(sortQuantize(position[1], morton->cell_size)) << 1;
+}
+
+// Stable LSD radix sort of keys with their rows, digits every key shares are
+// skipped. Returns the sorted rows, which end up in rows or scratch_rows.
+static u32 *sortRadix(u64 *keys, u64 *scratch_keys, u32 *rows, u32 *scratch_rows, u32 n) {
+  for (u32 shift = 0; shift < 64; shift += SORT_RADIX_BITS) {
+    u32 counts[SORT_RADIX_BUCKETS] = {0};
+    for (u32 i = 0; i < n; i++) {
+      counts[(keys[i] >> shift) & (SORT_RADIX_BUCKETS - 1)]++;
+    }
+    if (counts[(keys[0] >> shift) & (SORT_RADIX_BUCKETS - 1)] == n) {
+      continue;
+    }
+
+    u32 offset = 0;
+    for (u32 b = 0; b < SORT_RADIX_BUCKETS; b++) {
+      u32 bucket_count = counts[b];
+      counts[b] = offset;
+      offset += bucket_count;
+    }
+    for (u32 i = 0; i < n; i++) {
+      u32 slot = counts[(keys[i] >> shift) & (SORT_RADIX_BUCKETS - 1)]++;
+      scratch_keys[slot] = keys[i];
+      scratch_rows[slot] = rows[i];
+    }
+
+    u64 *swap_keys = keys;
+    keys = scratch_keys;
+    scratch_keys = swap_keys;
+    u32 *swap_rows = rows;
+    rows = scratch_rows;
+    scratch_rows = swap_rows;
+  }
+  return rows;
+}
+
+// Copies one column's rows in the given order into out, packed. Column
+// component_count stands for the entity ids.
+static size_t sortGatherColumn(Archetype *type, u8 column, const u32 *rows, u8 *out) {
+  bool ids = column == type->component_count;
+  size_t size = ids ? sizeof(EntityID) : component_sizes[type->component_id[column]];
+
+  for (u64 i = 0; i < type->size; i++) {
+    u32 row = rows[i];
+    ArchetypeChunk *chunk = archetypeReadChunk(type, row >> CHUNK_SHIFT);
+    const u8 *data = ids ? (const u8*)chunkGetEntities(chunk) : chunkGetColumn(type, chunk, column);
+    memcpy(out + size * i, data + size * (row & (CHUNK_ROWS - 1)), size);
+  }
+  return size * type->size;
+}
+
+bool archetypeSort(Archetype *type, ComponentID component, SortKey key, void *user) {
+  assert(getBit(type->component_mask, component) && "The archetype lacks the sort component.");
+  u32 n = type->size;
+  if (n < 2) {
+    return false;
+  }
+  if (type->scene->trace) {
+    traceUntraced(type->scene->trace);
+  }
+
+  u64 *keys = malloc(sizeof(u64) * n * 2);
+  u32 *rows = malloc(sizeof(u32) * n * 2);
+  u8 column = archetypeGetComponentIndex(type, component);
+  size_t component_size = component_sizes[component];
+
+  bool sorted = true;
+  for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+    ArchetypeChunk *chunk = archetypeReadChunk(type, j);
+    const u8 *values = chunkGetColumn(type, chunk, column);
+    u32 first = j << CHUNK_SHIFT;
+
+    for (u32 r = 0; r < archetypeChunkRows(type, j); r++) {
+      u32 row = first + r;
+      keys[row] = key(values + component_size * r, user);
+      rows[row] = row;
+      sorted = sorted && (!row || keys[row - 1] <= keys[row]);
+    }
+  }
+  if (sorted) {
+    free(keys);
+    free(rows);
+    return false;
+  }
+  const u32 *order = sortRadix(keys, keys + n, rows, rows + n, n);
+
+  // Every column is gathered in the new order, entity ids first so they stay
+  // aligned, then written back chunk by chunk
+  u8 *packed = malloc((size_t)type->row_bytesize * n);
+  const EntityID *entities = (const EntityID*)packed;
+  u8 *out = packed + sortGatherColumn(type, type->component_count, order, packed);
+  for (u8 i = 0; i < type->component_count; i++) {
+    out += sortGatherColumn(type, i, order, out);
+  }
+
+  for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+    ArchetypeChunk *chunk = archetypeWriteChunk(type, j);
+    u32 first = j << CHUNK_SHIFT, chunk_rows = archetypeChunkRows(type, j);
+
+    memcpy(chunkGetEntities(chunk), entities + first, sizeof(EntityID) * chunk_rows);
+    const u8 *in = packed + sizeof(EntityID) * n;
+    for (u8 i = 0; i < type->component_count; i++) {
+      size_t size = component_sizes[type->component_id[i]];
+      memcpy(chunkGetColumn(type, chunk, i), in + size * first, size * chunk_rows);
+      in += size * n;
+    }
+  }
+
+  for (u32 i = 0; i < n; i++) {
+    if (order[i] != i) {
+      sceneWriteRecord(type->scene, entities[i])->index = i;
+    }
+  }
+
+  free(packed);
+  free(keys);
+  free(rows);
+  return true;
+}
+
+u32 sceneSortArchetypes(Scene *scene, ComponentID component, SortKey key, void *user) {
+  ArchetypeList *list = _sceneGetComponentTypes(scene, component);
+  u32 moved = 0;
+  for (u32 i = 0; i < list->count; i++) {
+    moved += archetypeSort(list->types[i], component, key, user);
+  }
+  return moved;
+}
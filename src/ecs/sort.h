@@ -0,0 +1,38 @@
+#ifndef ECS_SORT_H
+#define ECS_SORT_H
+#include "ecs/ecs.h"
+#include <stddef.h>
+
+// Row sorting. Swap removes and appends leave archetype rows in no useful
+// order, sorting them by a key computed from one component (the Morton order
+// of a position, say) puts related entities next to each other in memory.
+// Every column moves together and the entity index follows. Keys are
+// computed for all rows first, an archetype already in order costs that one
+// pass and isn't written. Ties keep their current order. Sorting goes through
+// the usual chunk writes, so it's recorded by history and copies shared
+// chunks, and shows up as written to deltas, checksums and spatial indices.
+typedef u64 (*SortKey)(const void *component, void *user);
+
+// Returns whether any row moved
+bool archetypeSort(Archetype *type, ComponentID component, SortKey key, void *user);
+
+// Sorts every archetype of the scene holding the component, returns how many
+// had rows moved
+u32 sceneSortArchetypes(Scene *scene, ComponentID component, SortKey key, void *user);
+
+#define sceneSortBy(scene, CompType, key, user) \
+  sceneSortArchetypes(scene, CompType##ID, key, user)
+
+// Morton (Z) order of two floats at an offset in the component, quantized to
+// cells of cell_size. Pass a SortMorton as the user pointer.
+typedef struct {
+  u32 offset;
+  float cell_size;
+} SortMorton;
+
+u64 sortMortonKey(const void *component, void *user);
+
+#define sortMortonFor(CompType, field, cell) \
+  ((SortMorton) {.offset = offsetof(CompType, field), .cell_size = (cell)})
+
+#endif
@@ -0,0 +1,311 @@
+#include "spatial.h"
+
+// Cells are clamped to this so far off and NaN positions stay representable
+#define SPATIAL_CELL_LIMIT (1 << 30)
+
+static i32 spatialCell(const SpatialGrid *grid, float coordinate) {
+  float cell = coordinate * grid->inv_cell_size;
+  if (!(cell > -SPATIAL_CELL_LIMIT)) {
+    return -SPATIAL_CELL_LIMIT;
+  }
+  if (cell > SPATIAL_CELL_LIMIT) {
+    return SPATIAL_CELL_LIMIT;
+  }
+  // Floor without libm
+  i32 truncated = (i32)cell;
+  return truncated - (cell < truncated);
+}
+
+static u32 spatialBucket(const SpatialGrid *grid, i32 cell_x, i32 cell_y) {
+  u32 hash = (u32)cell_x * 0x9E3779B1 ^ (u32)cell_y * 0x85EBCA77;
+  hash ^= hash >> 16;
+  return hash & grid->bucket_mask;
+}
+
+// How far a position is outside the cell it's filed under
+static float spatialDrift(const SpatialGrid *grid, const SpatialEntry *entry) {
+  float min_x = entry->cell_x * grid->cell_size, min_y = entry->cell_y * grid->cell_size;
+  float drift = 0;
+  float distances[4] = {
+    min_x - entry->x, entry->x - (min_x + grid->cell_size),
+    min_y - entry->y, entry->y - (min_y + grid->cell_size)
+  };
+  for (u32 i = 0; i < 4; i++) {
+    drift = distances[i] > drift ? distances[i] : drift;
+  }
+  return drift;
+}
+
+static void spatialReadPosition(
+    const SpatialGrid *grid, const u8 *column, size_t component_size, u32 row,
+    float *x, float *y) {
+  float position[2];
+  memcpy(position, column + component_size * row + grid->offset, sizeof(position));
+  *x = position[0];
+  *y = position[1];
+}
+
+void spatialGridInit(SpatialGrid *grid, ComponentID component, u32 offset, float cell_size) {
+  assert(cell_size > 0 && "Cells need a size.");
+  assert(offset + 2 * sizeof(float) <= component_sizes[component] &&
+      "The position doesn't fit in the component, register its size first.");
+  *grid = (SpatialGrid) {
+    .component = component,
+      .offset = offset,
+      .cell_size = cell_size,
+      .inv_cell_size = 1 / cell_size,
+
+      .entries = NULL,
+      .scratch = NULL,
+      .entry_count = 0,
+      .entry_cap = 0,
+
+      .bucket_start = NULL,
+      .bucket_mask = 0,
+      .bucket_cap = 0,
+
+      .entity_entry = NULL,
+      .entity_cap = 0,
+
+      .drift = 0,
+      .source_id = 0,
+      .source_version = 0,
+      .builds = 0,
+      .updates = 0
+  };
+}
+
+void spatialGridDeinit(SpatialGrid *grid) {
+  free(grid->entries);
+  free(grid->scratch);
+  free(grid->bucket_start);
+  free(grid->entity_entry);
+  grid->entries = grid->scratch = NULL;
+  grid->bucket_start = grid->entity_entry = NULL;
+  grid->entry_count = grid->entry_cap = grid->bucket_cap = grid->entity_cap = 0;
+  grid->source_id = 0;
+}
+
+static u64 spatialCountRows(SpatialGrid *grid, Scene *scene) {
+  ArchetypeList *list = _sceneGetComponentTypes(scene, grid->component);
+  u64 count = 0;
+  for (u32 i = 0; i < list->count; i++) {
+    count += list->types[i]->size;
+  }
+  return count;
+}
+
+void spatialGridBuild(SpatialGrid *grid, Scene *scene) {
+  ArchetypeList *list = _sceneGetComponentTypes(scene, grid->component);
+  u64 count = spatialCountRows(grid, scene);
+  assert(count < UINT32_MAX && "Too many entities for a spatial grid.");
+
+  if (count > grid->entry_cap) {
+    u32 new_cap = grid->entry_cap ? grid->entry_cap : 1024;
+    while (new_cap < count) {
+      new_cap *= 2;
+    }
+    grid->entries = realloc(grid->entries, sizeof(SpatialEntry) * new_cap);
+    grid->scratch = realloc(grid->scratch, sizeof(SpatialEntry) * new_cap);
+    grid->entry_cap = new_cap;
+  }
+
+  // About one entity per bucket
+  u32 bucket_cap = 64;
+  while (bucket_cap < count) {
+    bucket_cap *= 2;
+  }
+  if (bucket_cap != grid->bucket_cap) {
+    grid->bucket_start = realloc(grid->bucket_start, sizeof(u32) * (bucket_cap + 1));
+    grid->bucket_cap = bucket_cap;
+    grid->bucket_mask = bucket_cap - 1;
+  }
+  u32 *bucket_start = grid->bucket_start;
+  memset(bucket_start, 0, sizeof(u32) * (bucket_cap + 1));
+
+  // Gather in row order, counting bucket sizes
+  SpatialEntry *scratch = grid->scratch;
+  u32 n = 0;
+  for (u32 i = 0; i < list->count; i++) {
+    Archetype *type = list->types[i];
+    u8 column_index = archetypeGetComponentIndex(type, grid->component);
+    size_t component_size = component_sizes[grid->component];
+
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      ArchetypeChunk *chunk = archetypeReadChunk(type, j);
+      const EntityID *entities = chunkGetEntities(chunk);
+      const u8 *column = chunkGetColumn(type, chunk, column_index);
+      u32 rows = archetypeChunkRows(type, j);
+
+      for (u32 r = 0; r < rows; r++) {
+        SpatialEntry *entry = &scratch[n++];
+        spatialReadPosition(grid, column, component_size, r, &entry->x, &entry->y);
+        entry->cell_x = spatialCell(grid, entry->x);
+        entry->cell_y = spatialCell(grid, entry->y);
+        entry->entity = entities[r];
+        entry->type = type->scene_index;
+        entry->row = (j << CHUNK_SHIFT) + r;
+        bucket_start[spatialBucket(grid, entry->cell_x, entry->cell_y) + 1]++;
+      }
+    }
+  }
+
+  // Counting sort, bucket_start ends up holding each bucket's end and is
+  // shifted back to starts afterwards
+  for (u32 b = 1; b <= bucket_cap; b++) {
+    bucket_start[b] += bucket_start[b - 1];
+  }
+  SpatialEntry *entries = grid->entries;
+  for (u32 i = 0; i < n; i++) {
+    u32 bucket = spatialBucket(grid, scratch[i].cell_x, scratch[i].cell_y);
+    entries[bucket_start[bucket]++] = scratch[i];
+  }
+  memmove(bucket_start + 1, bucket_start, sizeof(u32) * bucket_cap);
+  bucket_start[0] = 0;
+
+  if (scene->max_entity_id > grid->entity_cap) {
+    grid->entity_cap = scene->max_entity_id;
+    grid->entity_entry = realloc(grid->entity_entry, sizeof(u32) * grid->entity_cap);
+  }
+  for (u32 i = 0; i < n; i++) {
+    grid->entity_entry[entries[i].entity] = i;
+  }
+
+  grid->entry_count = n;
+  grid->drift = 0;
+  grid->source_id = scene->id;
+  grid->source_version = scene->version;
+  grid->builds++;
+}
+
+bool spatialGridUpdate(SpatialGrid *grid, Scene *scene) {
+  if (grid->source_id != scene->id || spatialCountRows(grid, scene) != grid->entry_count) {
+    spatialGridBuild(grid, scene);
+    return true;
+  }
+
+  ArchetypeList *list = _sceneGetComponentTypes(scene, grid->component);
+  float drift = grid->drift;
+  for (u32 i = 0; i < list->count; i++) {
+    Archetype *type = list->types[i];
+    u8 column_index = archetypeGetComponentIndex(type, grid->component);
+    size_t component_size = component_sizes[grid->component];
+
+    for (u32 j = 0; j < archetypeActiveChunks(type); j++) {
+      if (type->chunks[j].version <= grid->source_version) {
+        continue;
+      }
+      ArchetypeChunk *chunk = archetypeReadChunk(type, j);
+      const EntityID *entities = chunkGetEntities(chunk);
+      const u8 *column = chunkGetColumn(type, chunk, column_index);
+      u32 rows = archetypeChunkRows(type, j);
+
+      for (u32 r = 0; r < rows; r++) {
+        // Entities must still be in the rows their entries point at
+        EntityID entity = entities[r];
+        u32 index = entity < grid->entity_cap ? grid->entity_entry[entity] : UINT32_MAX;
+        SpatialEntry *entry = index < grid->entry_count ? &grid->entries[index] : NULL;
+        if (!entry || entry->entity != entity || entry->type != type->scene_index ||
+            entry->row != (j << CHUNK_SHIFT) + r) {
+          spatialGridBuild(grid, scene);
+          return true;
+        }
+
+        spatialReadPosition(grid, column, component_size, r, &entry->x, &entry->y);
+        float entry_drift = spatialDrift(grid, entry);
+        drift = entry_drift > drift ? entry_drift : drift;
+      }
+    }
+  }
+
+  if (drift > SPATIAL_MAX_DRIFT * grid->cell_size) {
+    spatialGridBuild(grid, scene);
+    return true;
+  }
+  grid->drift = drift;
+  grid->source_version = scene->version;
+  grid->updates++;
+  return false;
+}
+
+void spatialIterInit(
+    SpatialIter *iter, const SpatialGrid *grid,
+    float min_x, float min_y, float max_x, float max_y) {
+  *iter = (SpatialIter) {
+    .grid = grid,
+      .min_x = spatialCell(grid, min_x - grid->drift),
+      .min_y = spatialCell(grid, min_y - grid->drift),
+      .max_x = spatialCell(grid, max_x + grid->drift),
+      .max_y = spatialCell(grid, max_y + grid->drift),
+      .scan = false,
+      .bucket = 0
+  };
+  iter->cell_x = iter->min_x - 1;
+  iter->cell_y = iter->min_y;
+
+  // Empty ranges (and NaN rectangles) hand out nothing
+  if (!grid->entry_count || iter->min_x > iter->max_x || iter->min_y > iter->max_y) {
+    iter->min_y = iter->cell_y = 1;
+    iter->max_y = 0;
+    return;
+  }
+  u64 cells = (u64)((i64)iter->max_x - iter->min_x + 1) * (u64)((i64)iter->max_y - iter->min_y + 1);
+  iter->scan = cells > grid->bucket_cap;
+}
+
+const SpatialEntry *spatialIterNext(SpatialIter *iter, u32 *count) {
+  const SpatialGrid *grid = iter->grid;
+
+  if (iter->scan) {
+    while (iter->bucket < grid->bucket_cap) {
+      u32 bucket = iter->bucket++;
+      u32 start = grid->bucket_start[bucket], end = grid->bucket_start[bucket + 1];
+      if (end > start) {
+        *count = end - start;
+        return &grid->entries[start];
+      }
+    }
+    return NULL;
+  }
+
+  while (iter->cell_y <= iter->max_y) {
+    if (++iter->cell_x > iter->max_x) {
+      iter->cell_x = iter->min_x - 1;
+      iter->cell_y++;
+      continue;
+    }
+    u32 bucket = spatialBucket(grid, iter->cell_x, iter->cell_y);
+    u32 start = grid->bucket_start[bucket], end = grid->bucket_start[bucket + 1];
+    if (end > start) {
+      *count = end - start;
+      return &grid->entries[start];
+    }
+  }
+  return NULL;
+}
+
+u32 spatialGridQueryRadius(
+    const SpatialGrid *grid, float x, float y, float radius, SpatialEntry *out, u32 cap) {
+  SpatialIter iter;
+  spatialIterInit(&iter, grid, x - radius, y - radius, x + radius, y + radius);
+
+  float radius_squared = radius * radius;
+  u32 found = 0, count;
+  const SpatialEntry *run;
+  while ((run = spatialIterNext(&iter, &count))) {
+    for (u32 i = 0; i < count; i++) {
+      const SpatialEntry *entry = &run[i];
+      if (!iter.scan && (entry->cell_x != iter.cell_x || entry->cell_y != iter.cell_y)) {
+        continue;
+      }
+      float dx = entry->x - x, dy = entry->y - y;
+      if (dx * dx + dy * dy <= radius_squared) {
+        if (found < cap) {
+          out[found] = *entry;
+        }
+        found++;
+      }
+    }
+  }
+  return found;
+}
@@ -0,0 +1,90 @@
+#ifndef ECS_SPATIAL_H
+#define ECS_SPATIAL_H
+#include "ecs/ecs.h"
+#include <stddef.h>
+
+// Uniform spatial hash grid over a 2D float position (two floats at an offset
+// in a component, Position.x and .y usually). Cells are square and hashed into
+// a power of two bucket table, a build counting sorts every entity with the
+// component into its bucket so buckets are contiguous runs of entries, in
+// archetype and row order within a bucket.
+// Updates only look at chunks the scene wrote since the last update. Entities
+// that still sit in their rows just get their position refreshed, their entry
+// stays filed under its old cell and queries widen by how far entries have
+// drifted out of their cells. The grid is rebuilt once that drift passes
+// SPATIAL_MAX_DRIFT cells or rows moved (spawns, kills, component changes).
+// Pick a cell size around the usual query radius, queries then cost the
+// entries in the few cells they overlap.
+#define SPATIAL_MAX_DRIFT 0.5f
+
+typedef struct {
+  float x, y; // Position at the last update
+  i32 cell_x, cell_y; // Cell the entry is filed under
+  EntityID entity;
+  u32 type, row; // Scene archetype index and row
+} SpatialEntry;
+
+typedef struct {
+  ComponentID component;
+  u32 offset; // Of the x coordinate in the component, y follows it
+  float cell_size, inv_cell_size;
+
+  SpatialEntry *entries, *scratch;
+  u32 entry_count, entry_cap;
+
+  // Bucket b holds entries [bucket_start[b], bucket_start[b + 1])
+  u32 *bucket_start;
+  u32 bucket_mask, bucket_cap;
+
+  // EntityID -> entry, for updates
+  u32 *entity_entry;
+  u32 entity_cap;
+
+  // How far entries are out of their cells at most, in world units
+  float drift;
+
+  // Id of the scene last built from, 0 before the first build
+  u64 source_id;
+  u64 source_version;
+  u32 builds, updates;
+} SpatialGrid;
+
+void spatialGridInit(SpatialGrid *grid, ComponentID component, u32 offset, float cell_size);
+void spatialGridDeinit(SpatialGrid *grid);
+
+// Refiles every entity with the component
+void spatialGridBuild(SpatialGrid *grid, Scene *scene);
+// Refreshes moved entities from the chunks written since the last update,
+// rebuilding when needed. Returns whether it rebuilt.
+bool spatialGridUpdate(SpatialGrid *grid, Scene *scene);
+
+#define spatialGridInitFor(grid, CompType, field, cell_size) \
+  spatialGridInit(grid, CompType##ID, offsetof(CompType, field), cell_size)
+
+// Cell range queries hand out bucket runs. Entries of a run may lie in other
+// cells (hash collisions, drift), callers test the positions themselves.
+// Ranges of more cells than there are buckets scan every bucket once instead.
+typedef struct {
+  const SpatialGrid *grid;
+  i32 min_x, min_y, max_x, max_y;
+  // Cell of the last run handed out, unused when scanning
+  i32 cell_x, cell_y;
+  bool scan;
+  u32 bucket;
+} SpatialIter;
+
+// Cells overlapping the rectangle, widened by the grid's drift
+void spatialIterInit(
+    SpatialIter *iter, const SpatialGrid *grid,
+    float min_x, float min_y, float max_x, float max_y);
+// The next non-empty run, NULL when the range is done. Buckets shared by
+// several cells of the range are handed out once per cell, entries filed
+// under iter->cell_x/y are the ones that belong to it.
+const SpatialEntry *spatialIterNext(SpatialIter *iter, u32 *count);
+
+// Entries within radius of (x, y), in no particular order. Returns
+// how many there are and fills up to cap of them.
+u32 spatialGridQueryRadius(
+    const SpatialGrid *grid, float x, float y, float radius, SpatialEntry *out, u32 cap);
+
+#endif
@@ -0,0 +1,369 @@
+#include "trace.h"
+
+typedef struct {
+  u32 magic, version;
+} TraceHeader;
+
+static void traceFlush(SceneTrace *trace) {
+  if (trace->buffered && fwrite(trace->buffer, trace->buffered, 1, trace->file) != 1) {
+    trace->ok = false;
+  }
+  trace->buffered = 0;
+}
+
+// Longest op without its name: kind byte and five varints
+#define TRACE_OP_MAX_BYTESIZE 64
+
+static void traceReserve(SceneTrace *trace) {
+  if (trace->buffered + TRACE_OP_MAX_BYTESIZE > TRACE_BUFFER_BYTESIZE) {
+    traceFlush(trace);
+  }
+}
+
+static void tracePutByte(SceneTrace *trace, u8 byte) {
+  trace->buffer[trace->buffered++] = byte;
+}
+
+static void tracePutVarint(SceneTrace *trace, u64 value) {
+  while (value >= 0x80) {
+    tracePutByte(trace, (u8)value | 0x80);
+    value >>= 7;
+  }
+  tracePutByte(trace, (u8)value);
+}
+
+static void tracePutEntity(SceneTrace *trace, EntityID entity) {
+  i32 delta = (i32)(entity - trace->last_entity);
+  trace->last_entity = entity;
+  tracePutVarint(trace, ((u32)delta << 1) ^ (u32)(delta >> 31));
+}
+
+bool sceneTraceBegin(Scene *scene, const char *path) {
+  sceneTraceEnd(scene);
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+
+  SceneTrace *trace = malloc(sizeof(SceneTrace));
+  *trace = (SceneTrace) {
+    .file = file,
+      .ok = true,
+      .untraced = false,
+      .last_entity = 0,
+      .defined_components = {{0}},
+      .systems = NULL,
+      .system_count = 0,
+      .system_cap = 0,
+      .buffer = malloc(TRACE_BUFFER_BYTESIZE),
+      .buffered = 0
+  };
+  TraceHeader header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION};
+  memcpy(trace->buffer, &header, sizeof(header));
+  trace->buffered = sizeof(header);
+
+  scene->trace = trace;
+  return true;
+}
+
+bool sceneTraceEnd(Scene *scene) {
+  SceneTrace *trace = scene->trace;
+  if (!trace) {
+    return true;
+  }
+  traceFlush(trace);
+  bool ok = trace->ok && fclose(trace->file) == 0 && !trace->untraced;
+
+  free(trace->systems);
+  free(trace->buffer);
+  free(trace);
+  scene->trace = NULL;
+  return ok;
+}
+
+void traceNewEntity(SceneTrace *trace, EntityID entity) {
+  traceReserve(trace);
+  tracePutByte(trace, TRACE_NEW_ENTITY);
+  tracePutEntity(trace, entity);
+}
+
+void traceAddComponent(SceneTrace *trace, EntityID entity, ComponentID component_id) {
+  traceReserve(trace);
+  if (!getBit(trace->defined_components, component_id)) {
+    addBit(trace->defined_components, component_id);
+    tracePutByte(trace, TRACE_DEFINE_COMPONENT);
+    tracePutVarint(trace, component_id);
+    tracePutVarint(trace, component_sizes[component_id]);
+  }
+  tracePutByte(trace, TRACE_ADD_COMPONENT);
+  tracePutEntity(trace, entity);
+  tracePutVarint(trace, component_id);
+}
+
+void traceKillEntity(SceneTrace *trace, EntityID entity) {
+  traceReserve(trace);
+  tracePutByte(trace, TRACE_KILL_ENTITY);
+  tracePutEntity(trace, entity);
+}
+
+static void traceDefineSystem(SceneTrace *trace, u32 index, ECSSystem *sys, Bitmask mask) {
+  // Names are written with their terminator so replays can point at them
+  const char *name = sys->name ? sys->name : "";
+  size_t name_bytesize = strlen(name) + 1;
+
+  traceReserve(trace);
+  tracePutByte(trace, TRACE_DEFINE_SYSTEM);
+  tracePutVarint(trace, index);
+  tracePutVarint(trace, sys->step != NULL);
+  tracePutVarint(trace, name_bytesize);
+  for (size_t i = 0; i < name_bytesize; i++) {
+    traceReserve(trace);
+    tracePutByte(trace, name[i]);
+  }
+
+  traceReserve(trace);
+  tracePutVarint(trace, bitmaskFlagCount(&mask));
+  for (u32 i = 0; i < MAX_COMPONENTS; i++) {
+    if (getBit(mask, i)) {
+      traceReserve(trace);
+      tracePutVarint(trace, i);
+    }
+  }
+}
+
+void traceRunSystem(SceneTrace *trace, ECSSystem *sys) {
+  Bitmask mask = sys->query ? sys->query->mask : (Bitmask) {0};
+
+  // Systems are told apart by address, a changed query defines a new one
+  u32 index = 0;
+  while (index < trace->system_count && (trace->systems[index].system != sys ||
+        !bitmaskEquals(trace->systems[index].mask, mask))) {
+    index++;
+  }
+  if (index == trace->system_count) {
+    if (trace->system_count == trace->system_cap) {
+      trace->system_cap = trace->system_cap ? trace->system_cap * 2 : 8;
+      trace->systems = realloc(trace->systems, sizeof(TraceSystem) * trace->system_cap);
+    }
+    trace->systems[trace->system_count++] = (TraceSystem) {.system = sys, .mask = mask};
+    traceDefineSystem(trace, index, sys, mask);
+  }
+
+  traceReserve(trace);
+  tracePutByte(trace, TRACE_RUN_SYSTEM);
+  tracePutVarint(trace, index);
+}
+
+void traceClear(SceneTrace *trace) {
+  traceReserve(trace);
+  tracePutByte(trace, TRACE_CLEAR);
+}
+
+// Logged once, replays stop at it
+void traceUntraced(SceneTrace *trace) {
+  if (!trace->untraced) {
+    trace->untraced = true;
+    traceReserve(trace);
+    tracePutByte(trace, TRACE_UNTRACED);
+  }
+}
+
+u8 *traceLoad(const char *path, size_t *bytesize) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  u8 *bytes = NULL;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long end = ftell(file);
+    if (end >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+      bytes = malloc(end ? end : 1);
+      if (fread(bytes, 1, end, file) == (size_t)end) {
+        *bytesize = end;
+      } else {
+        free(bytes);
+        bytes = NULL;
+      }
+    }
+  }
+  fclose(file);
+  return bytes;
+}
+
+// Replay
+typedef struct {
+  const u8 *at, *end;
+  EntityID last_entity;
+  bool ok;
+} TraceCursor;
+
+static u64 traceGetVarint(TraceCursor *cursor) {
+  u64 value = 0;
+  for (u32 shift = 0; shift < 64; shift += 7) {
+    if (cursor->at == cursor->end) {
+      break;
+    }
+    u8 byte = *cursor->at++;
+    value |= (u64)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  cursor->ok = false;
+  return 0;
+}
+
+static EntityID traceGetEntity(TraceCursor *cursor) {
+  u32 zigzag = traceGetVarint(cursor);
+  i32 delta = (i32)(zigzag >> 1) ^ -(i32)(zigzag & 1);
+  cursor->last_entity += delta;
+  return cursor->last_entity;
+}
+
+typedef struct {
+  ECSQuery query;
+  ECSSystem system;
+} TraceReplaySystem;
+
+// Steps of replayed systems only get the scene, the system being run is
+// passed on the side
+static _Thread_local const Bitmask *replay_mask;
+static _Thread_local TraceReplayStats *replay_stats;
+
+static void traceReplayStep(Scene *scene) {
+  u32 rows = sceneGetEntityArraySize(scene);
+  u64 sum = 0;
+  for (u32 i = 0; i < MAX_COMPONENTS; i++) {
+    if (!getBit(*replay_mask, i)) {
+      continue;
+    }
+    const u8 *column = _getComponentArray(scene, i);
+    size_t bytesize = component_sizes[i] * rows;
+    for (size_t j = 0; j < bytesize; j++) {
+      sum += column[j];
+    }
+  }
+  replay_stats->rows += rows;
+  replay_stats->column_sum += sum;
+}
+
+bool sceneReplayTrace(Scene *scene, const u8 *bytes, size_t bytesize, TraceReplayStats *stats) {
+  *stats = (TraceReplayStats) {0};
+  TraceHeader header;
+  if (bytesize < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    return false;
+  }
+
+  TraceCursor cursor = {
+    .at = bytes + sizeof(header),
+      .end = bytes + bytesize,
+      .last_entity = 0,
+      .ok = true
+  };
+  TraceReplaySystem *systems = NULL;
+  u32 system_count = 0, system_cap = 0;
+
+  while (cursor.ok && cursor.at < cursor.end) {
+    u8 op = *cursor.at++;
+
+    switch (op) {
+      case TRACE_NEW_ENTITY: {
+        EntityID entity = traceGetEntity(&cursor);
+        cursor.ok = cursor.ok && sceneNewEntity(scene) == entity;
+        break;
+      }
+      case TRACE_ADD_COMPONENT: {
+        EntityID entity = traceGetEntity(&cursor);
+        u64 component_id = traceGetVarint(&cursor);
+        cursor.ok = cursor.ok && entity < scene->max_entity_id &&
+          component_id < MAX_COMPONENTS && component_sizes[component_id];
+        if (cursor.ok) {
+          _addComponent(scene, entity, component_id);
+        }
+        break;
+      }
+      case TRACE_KILL_ENTITY: {
+        EntityID entity = traceGetEntity(&cursor);
+        cursor.ok = cursor.ok && entity < scene->max_entity_id;
+        if (cursor.ok) {
+          sceneKillEntity(scene, entity);
+        }
+        break;
+      }
+      case TRACE_RUN_SYSTEM: {
+        u64 index = traceGetVarint(&cursor);
+        cursor.ok = cursor.ok && index < system_count;
+        if (cursor.ok) {
+          // The system array may have moved since the query pointer was set
+          TraceReplaySystem *system = &systems[index];
+          system->system.query = &system->query;
+          replay_mask = &system->query.mask;
+          replay_stats = stats;
+          sceneRunSystem(scene, &system->system);
+        }
+        break;
+      }
+      case TRACE_CLEAR:
+        sceneClear(scene);
+        break;
+      case TRACE_DEFINE_COMPONENT: {
+        u64 component_id = traceGetVarint(&cursor);
+        u64 size = traceGetVarint(&cursor);
+        cursor.ok = cursor.ok && component_id < MAX_COMPONENTS && size;
+        if (cursor.ok && !component_sizes[component_id]) {
+          component_sizes[component_id] = size;
+        }
+        cursor.ok = cursor.ok && component_sizes[component_id] == size;
+        break;
+      }
+      case TRACE_DEFINE_SYSTEM: {
+        u64 index = traceGetVarint(&cursor);
+        bool step = traceGetVarint(&cursor);
+        u64 name_bytesize = traceGetVarint(&cursor);
+        const char *name = (const char*)cursor.at;
+        cursor.ok = cursor.ok && index == system_count && name_bytesize &&
+          name_bytesize <= (u64)(cursor.end - cursor.at) && !name[name_bytesize - 1];
+        if (!cursor.ok) {
+          break;
+        }
+        cursor.at += name_bytesize;
+
+        if (system_count == system_cap) {
+          system_cap = system_cap ? system_cap * 2 : 8;
+          systems = realloc(systems, sizeof(TraceReplaySystem) * system_cap);
+        }
+        TraceReplaySystem *system = &systems[system_count++];
+        queryInit(&system->query);
+        u64 component_count = traceGetVarint(&cursor);
+        for (u64 i = 0; cursor.ok && i < component_count; i++) {
+          u64 component_id = traceGetVarint(&cursor);
+          cursor.ok = cursor.ok && component_id < MAX_COMPONENTS && component_sizes[component_id];
+          if (cursor.ok) {
+            _queryRequire(&system->query, component_id);
+          }
+        }
+        system->system = (ECSSystem) {
+          .name = name[0] ? name : NULL,
+            .query = &system->query,
+            .begin = NULL,
+            .step = step ? traceReplayStep : NULL
+        };
+        break;
+      }
+      case TRACE_UNTRACED:
+      default:
+        cursor.ok = false;
+        break;
+    }
+    if (cursor.ok) {
+      stats->ops[op]++;
+    }
+  }
+
+  free(systems);
+  return cursor.ok;
+}
@@ -0,0 +1,85 @@
+#ifndef ECS_TRACE_H
+#define ECS_TRACE_H
+#include "ecs/ecs.h"
+
+// Operation traces. A scene with a trace logs every sceneNewEntity,
+// _addComponent, sceneKillEntity, sceneRunSystem and sceneClear call to a
+// file, so a recorded session can be replayed without the game attached.
+// Splices and partition syncs are logged as a new entity and an add of each
+// component per row, partition unloads as kills. Loads, maps, applied deltas,
+// rollbacks and archetype sorts can't be expressed in ops: they mark the
+// trace untraced, so sceneTraceEnd and replays of it fail. Component values
+// aren't recorded.
+// Ops are a kind byte followed by LEB128 varints, entities are stored as the
+// zigzag delta from the previous entity of the trace. Components and systems
+// are defined once, on first use: components with their size, systems with
+// their name and query.
+// Replayed systems have no game code, their step reads every column the query
+// requires through write access so chunk versions, copy-on-write and history
+// see the same traffic. Ops issued from inside a system are replayed after it.
+// Start a trace on an empty scene, replays check every new entity id.
+#define TRACE_MAGIC 0x52544345 // "ECTR"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_BYTESIZE (64 * 1024)
+
+typedef enum {
+  TRACE_NEW_ENTITY, // entity
+  TRACE_ADD_COMPONENT, // entity, component
+  TRACE_KILL_ENTITY, // entity
+  TRACE_RUN_SYSTEM, // system
+  TRACE_CLEAR,
+  TRACE_DEFINE_COMPONENT, // component, size
+  TRACE_DEFINE_SYSTEM, // system, name length, name, component count, components
+  TRACE_UNTRACED, // the scene changed in a way the trace doesn't hold
+  TRACE_OP_COUNT
+} TraceOp;
+
+typedef struct {
+  const ECSSystem *system;
+  Bitmask mask;
+} TraceSystem;
+
+typedef struct SceneTrace {
+  FILE *file;
+  bool ok, untraced;
+  EntityID last_entity;
+  Bitmask defined_components;
+
+  TraceSystem *systems;
+  u32 system_count, system_cap;
+
+  u8 *buffer;
+  u32 buffered;
+} SceneTrace;
+
+// Starts logging the scene's ops to path, ending the trace it had if any.
+// False if the file can't be created.
+bool sceneTraceBegin(Scene *scene, const char *path);
+// Flushes and closes the trace, false if any write failed or the trace was
+// marked untraced
+bool sceneTraceEnd(Scene *scene);
+
+// Called by the scene for every traced op
+void traceNewEntity(SceneTrace *trace, EntityID entity);
+void traceAddComponent(SceneTrace *trace, EntityID entity, ComponentID component_id);
+void traceKillEntity(SceneTrace *trace, EntityID entity);
+void traceRunSystem(SceneTrace *trace, ECSSystem *sys);
+void traceClear(SceneTrace *trace);
+void traceUntraced(SceneTrace *trace);
+
+typedef struct {
+  u64 ops[TRACE_OP_COUNT];
+  // Rows visited by replayed systems, and a sum of the bytes they read
+  u64 rows, column_sum;
+} TraceReplayStats;
+
+// Reads a whole trace file into memory, free the bytes with free()
+u8 *traceLoad(const char *path, size_t *bytesize);
+
+// Replays a loaded trace on the scene. False on a malformed or untraced trace,
+// component sizes that don't match the registered ones, or entity ids that
+// diverge from the recording, the scene is left as far as the replay got. Names of replayed
+// systems point into bytes, keep them while profiling zones refer to them.
+bool sceneReplayTrace(Scene *scene, const u8 *bytes, size_t bytesize, TraceReplayStats *stats);
+
+#endif
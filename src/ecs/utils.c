@@ -1,96 +1,152 @@
 #include "ecs/utils.h"
+#include "ecs/profile.h"
 
 // Arenas
-void arenaInit(Arena *arena, size_t bytesize) {
-  arena->head = malloc(bytesize);
-  arena->tail = arena->head;
-  arena->mem_left = bytesize;
+void arenaInit(Arena *arena, size_t block_size) {
+  (*arena) = (Arena) {
+    .head = NULL,
+      .tail = NULL,
+      .current = NULL,
+      .mem_left = 0,
+      .block_size = block_size,
+      .allocated = 0,
+      .high_water = 0
+  };
 }
 
-void *arenaAlloc(Arena *arena, size_t bytesize) {
-  assert((arena->mem_left -= bytesize) >= 0 && "No memory left in arena.");
-  void *ptr = arena->head;
-  arena->head += bytesize;
-  return ptr;
+static void arenaSetBlock(Arena *arena, ArenaBlock *block) {
+  arena->current = block;
+  arena->head = (void*)(
+      ((uintptr_t)(block + 1) + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+  arena->mem_left = block->bytesize;
 }
 
-void arenaFree(Arena *arena) {
-  free(arena->tail);
-  arena->mem_left = 0;
-}
+static void arenaGrow(Arena *arena, size_t bytesize) {
+  // Reuse blocks kept by arenaReset, dropping ones too small for this allocation
+  ArenaBlock *next;
+  while (arena->current && (next = arena->current->next)) {
+    if (next->bytesize >= bytesize) {
+      arenaSetBlock(arena, next);
+      return;
+    }
+    arena->current->next = next->next;
+    free(next);
+  }
 
-// Bitmasks
-void bitmaskInit(Arena *arena, Bitmask *mask, u64 bitsize) {
-  mask->size = (bitsize + 63) / 64;
-  mask->bytesize = mask->size * sizeof(u64);
-  mask->bitsize = bitsize;
+  // Each block is as big as the ones before it together, the arena doubles
+  // as a whole so big arenas stay a short list and one that just outgrows its
+  // first block reserves twice that rather than three times
+  PROFILE_ZONE_BEGIN(grow);
+  size_t block_size = arena->current ? arenaReserved(arena) : arena->block_size;
+  if (block_size < bytesize) {
+    block_size = bytesize;
+  }
 
-  mask->bits = (u64*)arenaAlloc(arena, mask->bytesize);
-  memset(mask->bits, 0, mask->bytesize);
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + ARENA_ALIGNMENT + block_size);
+  assert(block && "Out of memory growing arena.");
+  *block = (ArenaBlock) {.next = NULL, .bytesize = block_size};
+
+  if (arena->current) {
+    arena->current->next = block;
+  } else {
+    arena->tail = block;
+  }
+  arenaSetBlock(arena, block);
+  PROFILE_ZONE_END(grow, PROFILE_ARENA, "arenaGrow", block_size, 0);
 }
 
-void bitmaskInitCpy(Arena *arena, Bitmask *mask, Bitmask *copying) {
-  bitmaskInit(arena, mask, copying->bitsize);
-  memcpy(mask->bits, copying->bits, mask->bytesize);
+void *arenaAlloc(Arena *arena, size_t bytesize) {
+  bytesize = (bytesize + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  if ((i64)bytesize > arena->mem_left) {
+    arenaGrow(arena, bytesize);
+  }
+  arena->mem_left -= bytesize;
+  arena->allocated += bytesize;
+  if (arena->allocated > arena->high_water) {
+    arena->high_water = arena->allocated;
+  }
+
+  void *ptr = arena->head;
+  arena->head += bytesize;
+  return ptr;
 }
 
-bool bitmaskContains(Bitmask *mask, Bitmask *element) {
-  for (u32 i = 0; i < mask->size; i++) {
-    if ((mask->bits[i] & element->bits[i]) != element->bits[i]) {
-      return false;
-    }
+bool arenaExtend(Arena *arena, void *ptr, size_t old_bytesize, size_t new_bytesize) {
+  size_t old_aligned = (old_bytesize + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  size_t new_aligned = (new_bytesize + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  if (!ptr || ptr + old_aligned != arena->head ||
+      (i64)(new_aligned - old_aligned) > arena->mem_left) {
+    return false;
+  }
+  arena->head += new_aligned - old_aligned;
+  arena->mem_left -= new_aligned - old_aligned;
+  arena->allocated += new_aligned - old_aligned;
+  if (arena->allocated > arena->high_water) {
+    arena->high_water = arena->allocated;
   }
   return true;
 }
 
-void bitmaskPrint(Bitmask *mask) {
-  printf("Bitmask<");
-  for (u32 i = 0; i < mask->size; i++) {
-    u64 word = mask->bits[i];
+// Grows in place when ptr is the last allocation, otherwise copies and
+// leaves the old array to the arena
+void *arenaRealloc(Arena *arena, void *ptr, size_t old_bytesize, size_t new_bytesize) {
+  if (arenaExtend(arena, ptr, old_bytesize, new_bytesize)) {
+    return ptr;
+  }
 
-    for (u8 j = 0; j < 64; j++) {
-      printf("%li", (word >> j) & 1);
-    }
+  void *new_ptr = arenaAlloc(arena, new_bytesize);
+  if (old_bytesize) {
+    memcpy(new_ptr, ptr, old_bytesize);
   }
-  printf(">\n");
+  return new_ptr;
 }
 
-u32 bitmaskLowestFlag(Bitmask *mask) {
-  for (u8 i = 0; i < mask->size; i++) {
-    u64 word = mask->bits[i];
+// Rewinds to the first block in O(1), blocks are kept and reused
+void arenaReset(Arena *arena) {
+  if (arena->tail) {
+    arenaSetBlock(arena, arena->tail);
+  }
+  arena->allocated = 0;
+}
 
-    for (u8 j = 0; j < 64; j++) {
-      if ((word >> j) & 1) {
-        return i * 64 + j;
-      }
-    }
+void arenaFree(Arena *arena) {
+  ArenaBlock *block = arena->tail;
+  while (block) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
   }
-  return -1;
+  arenaInit(arena, arena->block_size);
 }
 
-u32 bitmaskHighestFlag(Bitmask *mask) {
-  for (i8 i = mask->size - 1; i >= 0; i--) {
-    u64 word = mask->bits[i];
+size_t arenaReserved(Arena *arena) {
+  size_t bytesize = 0;
+  for (ArenaBlock *block = arena->tail; block; block = block->next) {
+    bytesize += block->bytesize;
+  }
+  return bytesize;
+}
 
-    for (i8 j = 63; j >= 0; j--) {
-      if ((word >> j) & 1) {
-        return i * 64 + j;
-      }
-    }
+// Bitmasks
+u64 bitmaskHash(Bitmask *mask) {
+  u64 hash = 0;
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    hash = (hash ^ mask->bits[i]) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 32;
   }
-  return -1;
+  return hash;
 }
 
-// Brian Kernighan's algorithm :)
-u32 bitmaskFlagCount(Bitmask *mask) {
-  u32 count = 0;
-  u64 n;
-  for (u8 i = 0; i < mask->size; i++) {
-    n = mask->bits[i];
-    while (n) {
-      n &= (n - 1);
-      count++;
+void bitmaskPrint(Bitmask *mask) {
+  printf("Bitmask<");
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    u64 word = mask->bits[i];
+
+    for (u8 j = 0; j < 64; j++) {
+      printf("%li", (word >> j) & 1);
     }
   }
-  return count;
+  printf(">\n");
 }
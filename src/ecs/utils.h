@@ -6,6 +6,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define kB * 1000
 #define MB * 1000000
@@ -20,27 +23,43 @@ typedef int16_t i16;
 typedef int32_t i32;
 typedef int64_t i64;
 
-// Arenas
+// Arenas, a list of blocks allocated lazily as the arena fills up
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t bytesize;
+} ArenaBlock;
+
 typedef struct {
-  void *head, *tail;
+  void *head;
+  ArenaBlock *tail, *current;
   i64 mem_left;
+  size_t block_size;
+
+  // Bytes handed out since the last reset, and the most there ever were
+  size_t allocated, high_water;
 } Arena;
 
-void arenaInit(Arena *arena, size_t bytesize);
+void arenaInit(Arena *arena, size_t block_size);
 void *arenaAlloc(Arena *arena, size_t bytesize);
+void *arenaRealloc(Arena *arena, void *ptr, size_t old_bytesize, size_t new_bytesize);
+// Grows the last allocation in place, false when ptr isn't the last one or
+// the block has no room left
+bool arenaExtend(Arena *arena, void *ptr, size_t old_bytesize, size_t new_bytesize);
+void arenaReset(Arena *arena);
 void arenaFree(Arena *arena);
+// Bytes of all blocks, used or not
+size_t arenaReserved(Arena *arena);
+
+// Bitmasks, fixed width and passed around by value
+#define BITMASK_BITS 128
+#define BITMASK_WORDS (BITMASK_BITS / 64)
 
-// Bitmasks
 typedef struct {
-  u64 *bits;
-  size_t bytesize;
-  u64 bitsize;
-  u64 size;
+  u64 bits[BITMASK_WORDS];
 } Bitmask;
 
-#define bitmaskEquals(a, b) \
-  (memcmp((a).bits, (b).bits, (a).bytesize) == 0)
-
 #define addBit(mask, bit) \
   ((mask).bits[(bit) / 64] |= ((u64)1 << ((bit) % 64)))
 
@@ -50,14 +69,74 @@ typedef struct {
 #define removeBit(mask, bit) \
   ((mask).bits[(bit) / 64] &= ~((u64)1 << ((bit) % 64)))
 
-bool bitmaskContains(Bitmask *mask, Bitmask *element);
+#define bitmaskEquals(a, b) bitmaskEq(&(a), &(b))
+
+static inline void bitmaskClear(Bitmask *mask) {
+  *mask = (Bitmask) {0};
+}
+
+#if defined(__SSE2__) && BITMASK_WORDS == 2
+static inline bool bitmaskEq(Bitmask *a, Bitmask *b) {
+  __m128i cmp = _mm_cmpeq_epi8(
+      _mm_loadu_si128((__m128i*)a->bits), _mm_loadu_si128((__m128i*)b->bits));
+  return _mm_movemask_epi8(cmp) == 0xFFFF;
+}
+
+static inline bool bitmaskContains(Bitmask *mask, Bitmask *element) {
+  __m128i m = _mm_loadu_si128((__m128i*)mask->bits);
+  __m128i e = _mm_loadu_si128((__m128i*)element->bits);
+#ifdef __SSE4_1__
+  return _mm_testc_si128(m, e);
+#else
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(m, e), e)) == 0xFFFF;
+#endif
+}
+#else
+static inline bool bitmaskEq(Bitmask *a, Bitmask *b) {
+  u64 diff = 0;
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    diff |= a->bits[i] ^ b->bits[i];
+  }
+  return !diff;
+}
+
+static inline bool bitmaskContains(Bitmask *mask, Bitmask *element) {
+  u64 missing = 0;
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    missing |= element->bits[i] & ~mask->bits[i];
+  }
+  return !missing;
+}
+#endif
+
+static inline u32 bitmaskFlagCount(Bitmask *mask) {
+  u32 count = 0;
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    count += __builtin_popcountll(mask->bits[i]);
+  }
+  return count;
+}
+
+// -1 if no flags are set
+static inline u32 bitmaskLowestFlag(Bitmask *mask) {
+  for (u32 i = 0; i < BITMASK_WORDS; i++) {
+    if (mask->bits[i]) {
+      return i * 64 + __builtin_ctzll(mask->bits[i]);
+    }
+  }
+  return -1;
+}
+
+static inline u32 bitmaskHighestFlag(Bitmask *mask) {
+  for (i32 i = BITMASK_WORDS - 1; i >= 0; i--) {
+    if (mask->bits[i]) {
+      return i * 64 + 63 - __builtin_clzll(mask->bits[i]);
+    }
+  }
+  return -1;
+}
 
-void bitmaskInit(Arena *arena, Bitmask *mask, u64 bitsize);
-void bitmaskInitCpy(Arena *arena, Bitmask *mask, Bitmask *copying);
+u64 bitmaskHash(Bitmask *mask);
 void bitmaskPrint(Bitmask *mask);
-u32 bitmaskFlagCount(Bitmask *mask);
-u32 bitmaskLowestFlag(Bitmask *mask);
-u32 bitmaskHighestFlag(Bitmask *mask);
-void bitmaskClear(Bitmask *mask);
 
 #endif
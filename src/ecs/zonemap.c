@@ -0,0 +1,184 @@
+#include "zonemap.h"
+#include <math.h>
+
+void zoneMapInit(ZoneMap *map, ComponentID component) {
+  *map = (ZoneMap) {
+    .component = component,
+      .field_count = 0,
+
+      .archetypes = NULL,
+      .archetype_cap = 0,
+      .source_id = 0,
+
+      .refreshes = 0,
+      .tested = 0,
+      .skipped = 0
+  };
+}
+
+void zoneMapDeinit(ZoneMap *map) {
+  for (u32 i = 0; i < map->archetype_cap; i++) {
+    free(map->archetypes[i].chunks);
+  }
+  free(map->archetypes);
+  map->archetypes = NULL;
+  map->archetype_cap = 0;
+  map->source_id = 0;
+}
+
+u32 zoneMapAddField(ZoneMap *map, ZoneFieldType type, u32 offset) {
+  assert(map->field_count < ZONE_MAX_FIELDS && "Too many zone map fields.");
+  assert(offset + sizeof(u32) <= component_sizes[map->component] &&
+      "The field doesn't fit in the component, register its size first.");
+  map->offsets[map->field_count] = offset;
+  map->types[map->field_count] = type;
+  return map->field_count++;
+}
+
+// Drops every summary when the map moves to another scene, or the scene was
+// destroyed and another one initialized in its place
+static void zoneMapSetSource(ZoneMap *map, Scene *scene) {
+  if (map->source_id != scene->id) {
+    for (u32 i = 0; i < map->archetype_cap; i++) {
+      ZoneArchetype *archetype = &map->archetypes[i];
+      if (archetype->chunks) {
+        memset(archetype->chunks, 0, sizeof(ZoneSummary) * archetype->chunk_cap);
+      }
+    }
+    map->source_id = scene->id;
+  }
+}
+
+static ZoneSummary *zoneMapGetSummary(ZoneMap *map, Archetype *type, u32 chunk_index) {
+  if (type->scene_index >= map->archetype_cap) {
+    u32 new_cap = map->archetype_cap ? map->archetype_cap : 16;
+    while (new_cap <= type->scene_index) {
+      new_cap *= 2;
+    }
+    map->archetypes = realloc(map->archetypes, sizeof(ZoneArchetype) * new_cap);
+    memset(map->archetypes + map->archetype_cap, 0,
+        sizeof(ZoneArchetype) * (new_cap - map->archetype_cap));
+    map->archetype_cap = new_cap;
+  }
+
+  ZoneArchetype *archetype = &map->archetypes[type->scene_index];
+  if (chunk_index >= archetype->chunk_cap) {
+    u32 new_cap = archetype->chunk_cap ? archetype->chunk_cap : 16;
+    while (new_cap <= chunk_index) {
+      new_cap *= 2;
+    }
+    archetype->chunks = realloc(archetype->chunks, sizeof(ZoneSummary) * new_cap);
+    memset(archetype->chunks + archetype->chunk_cap, 0,
+        sizeof(ZoneSummary) * (new_cap - archetype->chunk_cap));
+    archetype->chunk_cap = new_cap;
+  }
+  return &archetype->chunks[chunk_index];
+}
+
+static double zoneReadField(ZoneFieldType type, const u8 *field) {
+  switch (type) {
+    case ZONE_F32: {
+      float value;
+      memcpy(&value, field, sizeof(value));
+      return value;
+    }
+    case ZONE_I32: {
+      i32 value;
+      memcpy(&value, field, sizeof(value));
+      return value;
+    }
+    case ZONE_U32: {
+      u32 value;
+      memcpy(&value, field, sizeof(value));
+      return value;
+    }
+  }
+  assert(false && "Unknown zone field type.");
+  return 0;
+}
+
+static void zoneMapRefresh(ZoneMap *map, Archetype *type, u32 chunk_index, ZoneSummary *summary) {
+  ArchetypeChunk *chunk = archetypeReadChunk(type, chunk_index);
+  const u8 *column = chunkGetColumn(type, chunk, archetypeGetComponentIndex(type, map->component));
+  size_t component_size = component_sizes[map->component];
+  u32 rows = archetypeChunkRows(type, chunk_index);
+
+  for (u32 f = 0; f < map->field_count; f++) {
+    // Empty until a row is seen, so chunks without rows match nothing
+    double min = INFINITY, max = -INFINITY;
+    const u8 *field = column + map->offsets[f];
+    for (u32 r = 0; r < rows; r++) {
+      double value = zoneReadField(map->types[f], field + component_size * r);
+      min = value < min ? value : min;
+      max = value > max ? value : max;
+    }
+    summary->min[f] = min;
+    summary->max[f] = max;
+  }
+
+  summary->version = chunk->version;
+  summary->rows = rows;
+  summary->valid = true;
+  map->refreshes++;
+}
+
+const ZoneSummary *zoneMapGetChunk(ZoneMap *map, Archetype *type, u32 chunk_index) {
+  assert(getBit(type->component_mask, map->component) && "The archetype lacks the zone map component.");
+  zoneMapSetSource(map, type->scene);
+
+  ZoneSummary *summary = zoneMapGetSummary(map, type, chunk_index);
+  if (!summary->valid || summary->version != type->chunks[chunk_index].version ||
+      summary->rows != archetypeChunkRows(type, chunk_index)) {
+    zoneMapRefresh(map, type, chunk_index, summary);
+  }
+  return summary;
+}
+
+bool zoneMapChunkMayMatch(
+    ZoneMap *map, Archetype *type, u32 chunk_index, const ZoneRange *ranges, u32 range_count) {
+  const ZoneSummary *summary = zoneMapGetChunk(map, type, chunk_index);
+  map->tested++;
+
+  for (u32 i = 0; i < range_count; i++) {
+    const ZoneRange *range = &ranges[i];
+    assert(range->field < map->field_count && "No such zone map field.");
+    if (!(summary->max[range->field] >= range->min && summary->min[range->field] <= range->max)) {
+      map->skipped++;
+      return false;
+    }
+  }
+  return true;
+}
+
+void zoneIterInit(
+    ZoneIter *iter, ZoneMap *map, Scene *scene, ECSQuery *query,
+    const ZoneRange *ranges, u32 range_count) {
+  assert(getBit(query->mask, map->component) && "The query has to require the zone map component.");
+  *iter = (ZoneIter) {
+    .map = map,
+      .ranges = ranges,
+      .range_count = range_count,
+      .type = NULL,
+      .chunk = 0
+  };
+  queryIterInit(&iter->query, scene, query);
+}
+
+Archetype *zoneIterNext(ZoneIter *iter, u32 *chunk_index) {
+  while (true) {
+    if (!iter->type || iter->chunk >= archetypeActiveChunks(iter->type)) {
+      iter->type = queryIterNext(&iter->query);
+      iter->chunk = 0;
+      if (!iter->type) {
+        return NULL;
+      }
+      continue;
+    }
+
+    u32 chunk = iter->chunk++;
+    if (zoneMapChunkMayMatch(iter->map, iter->type, chunk, iter->ranges, iter->range_count)) {
+      *chunk_index = chunk;
+      return iter->type;
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef ECS_ZONEMAP_H
+#define ECS_ZONEMAP_H
+#include "ecs/ecs.h"
+#include <stddef.h>
+
+// Zone maps, per chunk min/max summaries of a few numeric fields of one
+// component, so range predicates (inside a viewport, health under a
+// threshold) can skip whole chunks. Summaries are computed the first time a
+// chunk is tested and kept until the chunk's version changes, chunks nobody
+// writes are never rescanned and cold chunks stay cold. NaNs are left out of
+// the summaries since they never fall in a range.
+//
+// Pruning is only as good as the row order: rows spread at random over the
+// chunks give every chunk about the whole range. Sorting archetypes by the
+// filtered fields (see sort.h) keeps chunks narrow.
+#define ZONE_MAX_FIELDS 4
+
+typedef enum {
+  ZONE_F32,
+  ZONE_I32,
+  ZONE_U32
+} ZoneFieldType;
+
+typedef struct {
+  u64 version;
+  u32 rows;
+  bool valid;
+  double min[ZONE_MAX_FIELDS], max[ZONE_MAX_FIELDS];
+} ZoneSummary;
+
+typedef struct {
+  ZoneSummary *chunks;
+  u32 chunk_cap;
+} ZoneArchetype;
+
+typedef struct {
+  ComponentID component;
+  u32 field_count;
+  u32 offsets[ZONE_MAX_FIELDS];
+  ZoneFieldType types[ZONE_MAX_FIELDS];
+
+  // Indexed by archetype scene_index, summaries are dropped when the map is
+  // used with another scene (by id, see Scene)
+  ZoneArchetype *archetypes;
+  u32 archetype_cap;
+  u64 source_id;
+
+  u64 refreshes, tested, skipped;
+} ZoneMap;
+
+void zoneMapInit(ZoneMap *map, ComponentID component);
+void zoneMapDeinit(ZoneMap *map);
+
+// Returns the field's index for ranges
+u32 zoneMapAddField(ZoneMap *map, ZoneFieldType type, u32 offset);
+
+#define zoneMapInitFor(map, CompType) zoneMapInit(map, CompType##ID)
+#define zoneMapAddFieldFor(map, CompType, field, type) \
+  zoneMapAddField(map, type, offsetof(CompType, field))
+
+// Summary of a chunk of an archetype holding the component, up to date
+const ZoneSummary *zoneMapGetChunk(ZoneMap *map, Archetype *type, u32 chunk_index);
+
+// Inclusive range on a field
+typedef struct {
+  u32 field;
+  double min, max;
+} ZoneRange;
+
+// Whether some row of the chunk may have every field in its range, rows of
+// chunks that may match still need testing
+bool zoneMapChunkMayMatch(
+    ZoneMap *map, Archetype *type, u32 chunk_index, const ZoneRange *ranges, u32 range_count);
+
+// Walks the chunks of archetypes matching a query that may match every
+// range, the query has to require the map's component. Ranges are read
+// while iterating.
+typedef struct {
+  ZoneMap *map;
+  ECSQueryIter query;
+  const ZoneRange *ranges;
+  u32 range_count;
+
+  Archetype *type;
+  u32 chunk;
+} ZoneIter;
+
+void zoneIterInit(
+    ZoneIter *iter, ZoneMap *map, Scene *scene, ECSQuery *query,
+    const ZoneRange *ranges, u32 range_count);
+// Returns the archetype and sets the chunk, NULL at the end
+Archetype *zoneIterNext(ZoneIter *iter, u32 *chunk_index);
+
+#endif
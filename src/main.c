@@ -1,4 +1,5 @@
 #include "ecs/ecs.h"
+#include "ecs/trace.h"
 #include <raylib.h>
 #include <raymath.h>
 
@@ -32,11 +33,11 @@ EntityID newDot(float x, float y) {
 ECSQuery draw_query;
 ECSSystem draw_system;
 
-void drawSystemStep() {
-  Position *pos = getComponentArray(Position);
-  Color *col = getComponentArray(Color);
+void drawSystemStep(Scene *scene) {
+  const Position *pos = sceneReadComponentArray(scene, Position);
+  const Color *col = sceneReadComponentArray(scene, Color);
   
-  for (u64 i = 0; i < getEntityArraySize(); i++) {
+  for (u64 i = 0; i < sceneGetEntityArraySize(scene); i++) {
     DrawPixel(pos[i].x, pos[i].y, col[i]);
   }
 }
@@ -47,6 +48,7 @@ void drawSystemInit() {
   queryRequire(&draw_query, Color);
 
   draw_system = (ECSSystem) {
+    .name = "draw",
     .query = &draw_query,
     .begin = NULL,
     .step = drawSystemStep
@@ -56,13 +58,13 @@ void drawSystemInit() {
 ECSQuery move_query;
 ECSSystem move_system;
 
-void moveSystemStep() {
+void moveSystemStep(Scene *scene) {
   float delta = GetFrameTime();
 
-  Position *pos = getComponentArray(Position);
-  Move *move = getComponentArray(Move);
+  Position *pos = sceneGetComponentArray(scene, Position);
+  const Move *move = sceneReadComponentArray(scene, Move);
   
-  for (u64 i = 0; i < getEntityArraySize(); i++) {
+  for (u64 i = 0; i < sceneGetEntityArraySize(scene); i++) {
     pos[i].x += move[i].x * delta;
     pos[i].y += move[i].y * delta;
   }
@@ -74,6 +76,7 @@ void moveSystemInit() {
   queryRequire(&move_query, Move);
 
   move_system = (ECSSystem) {
+    .name = "move",
     .query = &move_query,
     .begin = NULL,
     .step = moveSystemStep
@@ -81,11 +84,17 @@ void moveSystemInit() {
 }
 
 int main() {
-  ecsInit(20 MB);
+  ecsInit(64 kB);
   Scene scene;
-  sceneInit(&scene);
+  sceneInit(&scene, 1 MB);
   setCurrentScene(&scene);
 
+  // Records the session for ecs_replay
+  const char *trace_path = getenv("ECS_TRACE");
+  if (trace_path && !sceneTraceBegin(&scene, trace_path)) {
+    fprintf(stderr, "can't record a trace to %s\n", trace_path);
+  }
+
   InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "cirkul!");
   drawSystemInit();
   moveSystemInit();
@@ -110,6 +119,7 @@ int main() {
   }
 
   CloseWindow();
+  sceneDestroy(&scene);
   ecsDeinit();
   return 0;
 }